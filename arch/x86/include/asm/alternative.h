@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) eduOS contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the University nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * @file arch/x86/include/asm/alternative.h
+ * @brief Boot-time patching of CPU-feature-dependent instructions
+ *
+ * ALTERNATIVE() emits a default instruction sequence and records a
+ * replacement in the section .altinstructions. After cpu_detection()
+ * has read the feature flags, apply_alternatives() copies the replacement
+ * over the default if the CPU supports the required feature. The rest of
+ * the default sequence is filled with NOPs.
+ *
+ * The replacement is executed at a different address than it was
+ * assembled for. Therefore, it must not contain relative jumps, calls or
+ * RIP-relative memory operands.
+ */
+
+#ifndef __ARCH_ALTERNATIVE_H__
+#define __ARCH_ALTERNATIVE_H__
+
+#include <eduos/stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Position of a feature flag in cpu_info (32 * word + bit),
+ * word 0 is feature1, word 1 is feature2 and so on.
+ */
+#define X86_FEATURE_FXSR	(0*32 + 24)
+#define X86_FEATURE_SSE		(0*32 + 25)
+#define X86_FEATURE_SSE2	(0*32 + 26)
+#define X86_FEATURE_X2APIC	(1*32 + 21)
+
+#define __ALT_STR(x)		#x
+#define ALT_STR(x)		__ALT_STR(x)
+
+#ifdef CONFIG_X86_32
+#define ALT_PTR			".long "
+#define ALT_ALIGN		".balign 4\n\t"
+#else
+#define ALT_PTR			".quad "
+#define ALT_ALIGN		".balign 8\n\t"
+#endif
+
+/// Length of the replacement minus the length of the default sequence
+#define ALT_DIFF		"((665f-664f)-(662b-661b))"
+
+/** @brief Instruction sequence, which is replaced if the CPU supports a feature
+ *
+ * The default sequence is padded with NOPs if the replacement is longer.
+ * (The relational operators of gas return -1 for true.)
+ *
+ * @param oldinstr Default instructions
+ * @param newinstr Replacement
+ * @param feature Required feature (X86_FEATURE_*)
+ */
+#define ALTERNATIVE(oldinstr, newinstr, feature)			\
+	"661:\n\t" oldinstr "\n662:\n\t"				\
+	".skip -(" ALT_DIFF " > 0) * " ALT_DIFF ", 0x90\n"		\
+	"663:\n\t"							\
+	".pushsection .altinstructions, \"a\"\n\t"			\
+	ALT_ALIGN							\
+	ALT_PTR "661b\n\t"						\
+	ALT_PTR "664f\n\t"						\
+	".word " ALT_STR(feature) "\n\t"				\
+	".byte 663b-661b\n\t"						\
+	".byte 665f-664f\n\t"						\
+	ALT_ALIGN							\
+	".popsection\n\t"						\
+	".pushsection .altinstr_replacement, \"ax\"\n"			\
+	"664:\n\t" newinstr "\n665:\n\t"				\
+	".popsection\n"
+
+/** @brief Entry of the section .altinstructions */
+typedef struct alt_instr {
+	/// Address of the default instructions
+	size_t instr;
+	/// Address of the replacement
+	size_t replacement;
+	/// Required CPU feature (X86_FEATURE_*)
+	uint16_t feature;
+	/// Length of the default instructions including the padding
+	uint8_t instrlen;
+	/// Length of the replacement
+	uint8_t replacementlen;
+} alt_instr_t;
+
+/** @brief Patch all call sites of ALTERNATIVE()
+ *
+ * Has to be called once after the feature flags are detected.
+ */
+void apply_alternatives(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
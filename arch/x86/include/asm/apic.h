@@ -199,6 +199,25 @@ typedef struct {
 int apic_init(void);
 void apic_eoi(void);
 uint32_t apic_cpu_id(void);
+
+/** @brief Determine the APIC ID of a core
+ *
+ * @param core Dense index of the core (see current_core)
+ * @return
+ * - the APIC ID of the core
+ * - -EINVAL (-22) if the core isn't listed by the MP table
+ */
+int apic_core_id(uint32_t core);
+
+/** @brief Send an inter-processor interrupt
+ *
+ * @param dest APIC ID of the destination core
+ * @param irq Interrupt vector
+ * @return
+ * - 0 on success
+ * - -ENXIO (-6) if the APIC isn't enabled
+ */
+int apic_send_ipi(uint32_t dest, uint8_t irq);
 int apic_calibration(void);
 int apic_is_enabled(void);
 int apic_enable_timer(void);
@@ -97,6 +97,11 @@ static inline size_t sign_extend(ssize_t addr, int bits)
 /// The number of entries in a page map table
 #define PAGE_MAP_ENTRIES	       (1L << PAGE_MAP_BITS)
 
+/// Page offset bits of a large page (4 MiB or 2 MiB)
+#define PAGE_HUGE_BITS		(PAGE_BITS + PAGE_MAP_BITS)
+/// The size of a large page in bytes
+#define PAGE_HUGE_SIZE		(1L << PAGE_HUGE_BITS)
+
 /// Align to next page
 #define PAGE_FLOOR(addr)        (((addr) + PAGE_SIZE - 1) & PAGE_MASK)
 /// Align to page
@@ -124,12 +129,46 @@ static inline size_t sign_extend(ssize_t addr, int bits)
 #define PG_GLOBAL		(1 << 8)
 /// This table is a self-reference and should skipped by page_map_copy()
 #define PG_SELF			(1 << 9)
+/// Page frame is shared read-only and copied on the first write access
+#define PG_COW			(1 << 10)
+/// User page, which is temporarily inaccessible (e.g. by mprotect(PROT_NONE))
+#define PG_NONE			(1 << 11)
+
+/// Memory type of a mapping, selected by the first four entries of the PAT
+#define PG_MT_MASK		(PG_PWT|PG_PCD)
+/// Memory type: write-back (default)
+#define PG_WB			0
+/// Memory type: write-through
+#define PG_WT			PG_PWT
+/// Memory type: write-combining (uncached without PAT support)
+#define PG_WC			PG_PCD
+/// Memory type: uncacheable
+#define PG_UC			(PG_PWT|PG_PCD)
 
 #ifdef CONFIG_X86_64
 /// Disable execution for this page
 #define PG_XD			(1L << 63)
 #endif
 
+#ifdef CONFIG_X86_64
+/// Start of the direct map of the physical memory (the top level entry below the self-references)
+#define PHYS_MAP		0xFFFFFE8000000000UL
+/// Maximal size of the direct map (covered by one top level entry)
+#define PHYS_MAP_SIZE		(1UL << (PAGE_LEVELS * PAGE_MAP_BITS - PAGE_MAP_BITS + PAGE_BITS))
+
+/** @brief Converts a physical address to a virtual address within the direct map
+ *
+ * Valid for the physical memory, after memory_init() has built the direct map.
+ *
+ * @param addr Physical address to convert
+ * @return virtual address
+ */
+static inline void* phys_to_virt(size_t addr)
+{
+	return (void*) (PHYS_MAP + addr);
+}
+#endif
+
 /** @brief Converts a virtual address to a physical
  *
  * A non mapped virtual address causes a pagefault!
@@ -148,16 +187,102 @@ size_t virt_to_phys(size_t vir);
  */
 int page_init(void);
 
+/** @brief Map the physical memory into the kernel space
+ *
+ * On x86_64, the RAM within [0, size) becomes accessible by phys_to_virt().
+ * It's mapped by 1 GiB pages, if the CPU supports them, and otherwise
+ * by 2 MiB pages. Holes of the memory map stay unmapped, the large pages
+ * around them are replaced by 4 KiB pages. The tables are shared between
+ * all tasks.
+ * x86_32 has no direct map.
+ *
+ * @param size Size of the physical memory in bytes
+ * @return
+ * - 0 on success
+ * - -ENOMEM (-12) on failure
+ */
+int page_map_phys(size_t size);
+
 /** @brief Map a continuous region of pages
+ *
+ * With PG_PSE, the parts of the region, which are suitably aligned
+ * in the virtual and physical address space, are mapped by large
+ * pages (4 MiB, 2 MiB or 1 GiB). Large pages of existing mappings
+ * are split, if the region covers them only partly.
  *
  * @param viraddr Desired virtual address
  * @param phyaddr Physical address to map from
  * @param npages The region's size in number of pages
- * @param bits Further page flags
+ * @param bits Further page flags and the memory type (PG_WB, PG_WT, PG_WC or PG_UC)
  * @return
+ * - 0 on success
+ * - -ENOMEM (-12) on failure
  */
 int page_map(size_t viraddr, size_t phyaddr, size_t npages, size_t bits);
 
+/** @brief Map zeroed page frames to the unmapped pages of a region
+ *
+ * Already mapped pages are skipped. Consecutive unmapped pages
+ * are backed by contiguous page frames and mapped at once.
+ * With PG_PSE, the aligned parts of the region are backed by
+ * large pages, if enough aligned page frames are available.
+ * On failure, the pages, which are already populated, stay mapped
+ * (e.g. for the fault-around of the heap). A caller, which needs
+ * all or nothing, releases the region, if it was unmapped before.
+ *
+ * @param viraddr Start address of the region
+ * @param npages The region's size in number of pages
+ * @param bits Further page flags (PG_RW is added)
+ * @return
+ * - 0 on success
+ * - -ENOMEM (-12) on failure
+ */
+int page_populate(size_t viraddr, size_t npages, size_t bits);
+
+/** @brief Unmap the user pages of a region and release their page frames
+ *
+ * In contrast to page_unmap(), the reference of each page frame is
+ * dropped and the TLB entries are invalidated.
+ *
+ * @param viraddr Start address of the region
+ * @param npages The region's size in number of pages
+ * @return 0 on success
+ */
+int page_release(size_t viraddr, size_t npages);
+
+/** @brief Promote a fully populated region of the heap to a large page
+ *
+ * Searches the heap of the current task for a region of PAGE_HUGE_SIZE,
+ * whose pages are present, private and writable with equal flags.
+ * The first one is collapsed into a large page. The page frames are
+ * copied, if they aren't contiguous and aligned.
+ * Called by irq_handler() with enabled interrupts, before a task
+ * returns to user mode.
+ *
+ * @return
+ * - 1 if a region was collapsed
+ * - 0 otherwise
+ */
+int page_collapse(void);
+
+/** @brief Map a page of a file-backed VMA of the current task
+ *
+ * Pages, which are completely backed by the file system cache
+ * (e.g. the init ram disk), are mapped in place. Writable areas
+ * get such pages copy-on-write. Read-only pages of executables are
+ * shared through the image cache. Shared writable areas map the
+ * pages of the file system writable and fail, if the file system
+ * isn't able to provide them. All other pages are filled with
+ * the file content and zeros. Mapped pages are skipped.
+ *
+ * @param viraddr Virtual address within the VMA
+ * @return
+ * - 0 on success
+ * - -EINVAL if the address isn't part of a file-backed VMA
+ * - -ENOMEM on failure
+ */
+int page_map_file(size_t viraddr);
+
 /** @brief Unmap a continuous region of pages
  *
  * @param viraddr The virtual start address
@@ -168,28 +293,57 @@ int page_unmap(size_t viraddr, size_t npages);
 
 /** @brief Change the page permission in the page tables of the current task
  *
- * Applies given flags noted in the 'flags' parameter to
- * the range denoted by virtual start and end addresses.
+ * Applies given flags noted in the 'bits' parameter to the
+ * present user pages of the range. Pages, which are mapped
+ * on demand, aren't touched.
+ * Page frames, which weren't writable, might be shared.
+ * Therefore, they become writable by copy-on-write.
+ * Inaccessible user pages are marked by PG_NONE instead of PG_USER.
  *
- * @param start Range's virtual start address
- * @param end Range's virtual end address
- * @param flags flags to apply
+ * @param viraddr Range's virtual start address
+ * @param npages The range's size in pages
+ * @param bits flags to apply (e.g. PG_USER|PG_RW)
  *
  * @return
  * - 0 on success
  * - -EINVAL (-22) on failure.
  */
-int page_set_flags(size_t viraddr, uint32_t npages, int flags);
+int page_set_flags(size_t viraddr, uint32_t npages, size_t bits);
 
 /** @brief Copy a whole page map tree
  *
- * @param dest Physical address of new page map
+ * Tables of the kernel space are shared, user frames are shared copy-on-write.
+ *
+ * @param dest Task, which owns the new page map
  * @retval 0 Success. Everything went fine.
  * @retval <0 Error. Something went wrong.
  */
 int page_map_copy(struct task *dest);
 
+/** @brief Create a page map tree, which contains only the kernel space
+ *
+ * Tables of the kernel space are shared with the current task.
+ * In contrast to page_map_copy(), no user mappings are inherited.
+ *
+ * @param dest Task, which owns the new page map
+ * @retval 0 Success. Everything went fine.
+ * @retval <0 Error. Something went wrong.
+ */
+int page_map_create(struct task *dest);
+
 /** @brief Free a whole page map tree */
 int page_map_drop(void);
 
+/** @brief Free the page map tree of a task, which never ran
+ *
+ * Releases the user mappings, the tables and the root table
+ * (e.g. after a failed fork).
+ *
+ * @param dest Task, which owns the page map
+ * @return
+ * - 0 on success
+ * - -EINVAL (-22) on failure
+ */
+int page_map_release(struct task *dest);
+
 #endif
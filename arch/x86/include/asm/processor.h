@@ -38,6 +38,7 @@
 
 #include <eduos/stddef.h>
 #include <asm/gdt.h>
+#include <asm/alternative.h>
 #include <asm/apic.h>
 #include <asm/irqflags.h>
 #ifdef CONFIG_PCI
@@ -64,6 +65,7 @@ extern "C" {
 #define CPU_FEATURE_SSE2		(1 << 26)
 
 // feature list 2
+#define CPU_FEATURE_PCID		(1 << 17)
 #define CPU_FEATURE_X2APIC		(1 << 21)
 #define CPU_FEATURE_AVX			(1 << 28)
 #define CPU_FEATURE_HYPERVISOR	(1 << 31)
@@ -74,6 +76,14 @@ extern "C" {
 #define CPU_FEATURE_1GBHP		(1 << 26)
 #define CPU_FEATURE_LM			(1 << 29)
 
+// CPUID.07H:EBX feature list
+#define CPU_FEATURE_AVX2		(1 << 5)
+#define CPU_FEATURE_ERMS		(1 << 9)
+#define CPU_FEATURE_INVPCID		(1 << 10)
+
+// CPUID.07H:EDX feature list
+#define CPU_FEATURE_FSRM		(1 << 4)
+
 // x86 control registers
 
 /// Protected Mode Enable
@@ -136,6 +146,33 @@ extern "C" {
 /// Enable Supervisor Mode Access Protection
 #define CR4_SMAP				(1 << 21)
 
+#ifdef CONFIG_X86_64
+/// Process-context identifier of the address space (with CR4_PCIDE)
+#define CR3_PCID_MASK			0xFFFUL
+/// Keep the TLB entries of the new PCID while writing cr3
+#define CR3_NOFLUSH				(1UL << 63)
+
+/// Invalidate a single address of a PCID
+#define INVPCID_ADDR			0
+/// Invalidate all non-global entries of a PCID
+#define INVPCID_SINGLE			1
+/// Invalidate all entries including global ones
+#define INVPCID_ALL_GLOBAL		2
+/// Invalidate all non-global entries of all PCIDs
+#define INVPCID_ALL				3
+#endif
+
+/// Page attribute table
+#define MSR_IA32_PAT			0x277
+
+// memory types of the page attribute table
+#define PAT_UC					0x00
+#define PAT_WC					0x01
+#define PAT_WT					0x04
+#define PAT_WP					0x05
+#define PAT_WB					0x06
+#define PAT_UC_MINUS			0x07
+
 // x86-64 specific MSRs
 
 /// extended feature register
@@ -166,7 +203,7 @@ extern "C" {
 #define EFER_TCE				(1 << 15)
 
 typedef struct {
-	uint32_t feature1, feature2, feature3;
+	uint32_t feature1, feature2, feature3, feature4, feature5;
 	uint32_t addr_width;
 } cpu_info_t;
 
@@ -199,11 +236,43 @@ inline static uint32_t has_sse2(void) {
 	return (cpu_info.feature1 & CPU_FEATURE_SSE2);
 }
 
+inline static uint32_t has_pse(void)
+{
+	return (cpu_info.feature1 & CPU_FEATUE_PSE);
+}
+
+inline static uint32_t has_1gbhp(void)
+{
+	return (cpu_info.feature3 & CPU_FEATURE_1GBHP);
+}
+
 inline static uint32_t has_pge(void)
 {
 	return (cpu_info.feature1 & CPU_FEATURE_PGE);
 }
 
+inline static uint32_t has_pat(void)
+{
+	return (cpu_info.feature1 & CPU_FEATURE_PAT);
+}
+
+/// Enhanced rep movsb/stosb
+inline static uint32_t has_erms(void)
+{
+	return (cpu_info.feature4 & CPU_FEATURE_ERMS);
+}
+
+/// Fast short rep movsb
+inline static uint32_t has_fsrm(void)
+{
+	return (cpu_info.feature5 & CPU_FEATURE_FSRM);
+}
+
+inline static uint32_t has_avx2(void)
+{
+	return (cpu_info.feature4 & CPU_FEATURE_AVX2);
+}
+
 inline static uint32_t has_sep(void) {
 	return (cpu_info.feature1 & CPU_FEATURE_SEP);
 }
@@ -225,6 +294,16 @@ inline static uint32_t has_nx(void)
 	return (cpu_info.feature3 & CPU_FEATURE_NX);
 }
 
+inline static uint32_t has_pcid(void)
+{
+	return (cpu_info.feature2 & CPU_FEATURE_PCID);
+}
+
+inline static uint32_t has_invpcid(void)
+{
+	return (cpu_info.feature4 & CPU_FEATURE_INVPCID);
+}
+
 /** @brief Read out time stamp counter
  *
  * The rdtsc asm command puts a 64 bit time stamp value
@@ -350,6 +429,24 @@ inline static void flush_cache(void) {
 	asm volatile ("wbinvd" ::: "memory");
 }
 
+#ifdef CONFIG_X86_64
+/** @brief Invalidate TLB entries, which are tagged by a process-context identifier
+ *
+ * @param type INVPCID_ADDR, INVPCID_SINGLE, INVPCID_ALL_GLOBAL or INVPCID_ALL
+ * @param pcid The process-context identifier (ignored by INVPCID_ALL*)
+ * @param addr The virtual address (only used by INVPCID_ADDR)
+ */
+static inline void invpcid(size_t type, size_t pcid, size_t addr)
+{
+	struct {
+		uint64_t pcid;
+		uint64_t addr;
+	} desc = { pcid, addr };
+
+	asm volatile("invpcid %0, %1" : : "m"(desc), "r"(type) : "memory");
+}
+#endif
+
 /** @brief Invalidate cache
  *
  * The invd asm instruction which invalidates cache without writing back
@@ -388,15 +485,33 @@ inline static void invalid_cache(void) {
 	asm volatile ("invd");
 }
 
-/* Force strict CPU ordering */
-typedef void (*func_memory_barrier)(void);
+/*
+ * Force strict CPU ordering. A locked instruction works on every CPU and
+ * is replaced by a fence instruction at boot time (see alternative.h).
+ */
+#ifdef CONFIG_X86_32
+#define LOCKED_NOP	"lock; addl $0,0(%%esp)"
+#else
+#define LOCKED_NOP	"lock; addl $0,0(%%rsp)"
+#endif
 
 /// Force strict CPU ordering, serializes load and store operations.
-extern func_memory_barrier mb;
+static inline void mb(void)
+{
+	asm volatile (ALTERNATIVE(LOCKED_NOP, "mfence", X86_FEATURE_SSE2) ::: "memory", "cc");
+}
+
 /// Force strict CPU ordering, serializes load operations.
-extern func_memory_barrier rmb;
+static inline void rmb(void)
+{
+	asm volatile (ALTERNATIVE(LOCKED_NOP, "lfence", X86_FEATURE_SSE2) ::: "memory", "cc");
+}
+
 /// Force strict CPU ordering, serializes store operations.
-extern func_memory_barrier wmb;
+static inline void wmb(void)
+{
+	asm volatile (ALTERNATIVE(LOCKED_NOP, "sfence", X86_FEATURE_SSE) ::: "memory", "cc");
+}
 
 /** @brief Read out CPU ID
  *
@@ -26,6 +26,46 @@
 extern "C" {
 #endif
 
+/// Implementation of memcpy()
+typedef void* (*func_memcpy)(void* dest, const void* src, size_t count);
+/// Implementation of memset()
+typedef void* (*func_memset)(void* dest, int val, size_t count);
+/// Implementation of strlen()
+typedef size_t (*func_strlen)(const char* str);
+/// Implementation of a clear
+typedef void (*func_memzero)(void* dest, size_t count);
+
+/*
+ * The implementations are selected by string_init() with regard to the
+ * CPU features. Until then, the baseline variants are used.
+ */
+extern func_memcpy memcpy_func;
+extern func_memset memset_func;
+extern func_strlen strlen_func;
+
+/** @brief Copy of whole pages, which aren't accessed soon
+ *
+ * Uses non-temporal stores if available. count has to be a multiple of the page size.
+ */
+extern func_memcpy memcpy_page;
+
+/** @brief Clear of whole pages, which aren't accessed soon
+ *
+ * Uses non-temporal stores if available. count has to be a multiple of the page size.
+ */
+extern func_memzero memzero_page;
+
+/** @brief Select the best implementations of the string functions
+ *
+ * Is called by cpu_detection().
+ */
+void string_init(void);
+
+#ifdef CONFIG_BENCHMARK
+/** @brief Measure each implementation by a sweep over the size */
+void string_benchmark(void);
+#endif
+
 #ifdef HAVE_ARCH_MEMCPY
 /** @brief Copy a byte range from source to dest
  *
@@ -35,30 +75,10 @@ extern "C" {
  */
 inline static void *memcpy(void* dest, const void *src, size_t count)
 {
-	size_t i, j, k;
-
 	if (BUILTIN_EXPECT(!dest || !src, 0))
 		return dest;
 
-#ifdef CONFIG_X86_32
-	asm volatile (
-		"cld; rep movsl\n\t"
-		"movl %4, %%ecx\n\t" 
-		"andl $3, %%ecx\n\t"
-		"rep movsb\n\t" 
-		: "=&c"(i), "=&D"(j), "=&S"(k) 
-		: "0"(count/4), "g"(count), "1"(dest), "2"(src) : "memory","cc");
-#elif defined(CONFIG_X86_64)
-	asm volatile (
-		"cld; rep movsq\n\t"
-		"movq %4, %%rcx\n\t"
-		"andq $7, %%rcx\n\t"
-		"rep movsb\n\t"
-		: "=&c"(i), "=&D"(j), "=&S"(k)
-		: "0"(count/8), "g"(count), "1"(dest), "2"(src) : "memory","cc");
-#endif
-
-	return dest;
+	return memcpy_func(dest, src, count);
 }
 #endif
 
@@ -71,18 +91,105 @@ inline static void *memcpy(void* dest, const void *src, size_t count)
  */
 inline static void *memset(void* dest, int val, size_t count)
 {
-	size_t i, j;
-
 	if (BUILTIN_EXPECT(!dest, 0))
 		return dest;
 
-	asm volatile ("cld; rep stosb" 
-		: "=&c"(i), "=&D"(j)
-		: "a"(val), "1"(dest), "0"(count) : "memory","cc");
+	return memset_func(dest, val, count);
+}
+#endif
 
-	return dest;
+/** @brief Fill a range with zeros by non-temporal stores
+ *
+ * The stores bypass the caches and don't evict the working set of
+ * other tasks. The caller has to check the SSE2 support (movnti).
+ *
+ * @param dest Destination address
+ * @param count Size of target range in bytes (a non-zero multiple of 32)
+ */
+inline static void memzero_nt(void* dest, size_t count)
+{
+	size_t i, j;
+
+#ifdef CONFIG_X86_32
+	asm volatile (
+		"xorl %%eax, %%eax\n\t"
+		"1: movnti %%eax, (%%edi)\n\t"
+		"movnti %%eax, 4(%%edi)\n\t"
+		"movnti %%eax, 8(%%edi)\n\t"
+		"movnti %%eax, 12(%%edi)\n\t"
+		"addl $16, %%edi\n\t"
+		"decl %%ecx\n\t"
+		"jnz 1b\n\t"
+		"sfence"
+		: "=&c"(i), "=&D"(j)
+		: "0"(count/16), "1"(dest) : "eax", "memory", "cc");
+#elif defined(CONFIG_X86_64)
+	asm volatile (
+		"xorq %%rax, %%rax\n\t"
+		"1: movnti %%rax, (%%rdi)\n\t"
+		"movnti %%rax, 8(%%rdi)\n\t"
+		"movnti %%rax, 16(%%rdi)\n\t"
+		"movnti %%rax, 24(%%rdi)\n\t"
+		"addq $32, %%rdi\n\t"
+		"decq %%rcx\n\t"
+		"jnz 1b\n\t"
+		"sfence"
+		: "=&c"(i), "=&D"(j)
+		: "0"(count/32), "1"(dest) : "rax", "memory", "cc");
+#endif
 }
+
+/** @brief Copy a range by non-temporal stores
+ *
+ * The stores bypass the caches and don't evict the working set of
+ * other tasks. The caller has to check the SSE2 support (movnti).
+ *
+ * @param dest Destination address
+ * @param src Source address
+ * @param count Size of the range in bytes (a non-zero multiple of 32)
+ */
+inline static void memcpy_nt(void* dest, const void* src, size_t count)
+{
+	size_t i, j, k;
+
+#ifdef CONFIG_X86_32
+	asm volatile (
+		"1: prefetchnta 256(%%esi)\n\t"
+		"movl (%%esi), %%eax\n\t"
+		"movl 4(%%esi), %%edx\n\t"
+		"movnti %%eax, (%%edi)\n\t"
+		"movnti %%edx, 4(%%edi)\n\t"
+		"movl 8(%%esi), %%eax\n\t"
+		"movl 12(%%esi), %%edx\n\t"
+		"movnti %%eax, 8(%%edi)\n\t"
+		"movnti %%edx, 12(%%edi)\n\t"
+		"addl $16, %%esi\n\t"
+		"addl $16, %%edi\n\t"
+		"decl %%ecx\n\t"
+		"jnz 1b\n\t"
+		"sfence"
+		: "=&c"(i), "=&D"(j), "=&S"(k)
+		: "0"(count/16), "1"(dest), "2"(src) : "eax", "edx", "memory", "cc");
+#elif defined(CONFIG_X86_64)
+	asm volatile (
+		"1: prefetchnta 512(%%rsi)\n\t"
+		"movq (%%rsi), %%rax\n\t"
+		"movq 8(%%rsi), %%rdx\n\t"
+		"movq 16(%%rsi), %%r8\n\t"
+		"movq 24(%%rsi), %%r9\n\t"
+		"movnti %%rax, (%%rdi)\n\t"
+		"movnti %%rdx, 8(%%rdi)\n\t"
+		"movnti %%r8, 16(%%rdi)\n\t"
+		"movnti %%r9, 24(%%rdi)\n\t"
+		"addq $32, %%rsi\n\t"
+		"addq $32, %%rdi\n\t"
+		"decq %%rcx\n\t"
+		"jnz 1b\n\t"
+		"sfence"
+		: "=&c"(i), "=&D"(j), "=&S"(k)
+		: "0"(count/32), "1"(dest), "2"(src) : "rax", "rdx", "r8", "r9", "memory", "cc");
 #endif
+}
 
 #ifdef HAVE_ARCH_STRLEN
 /** @brief Standard string length
@@ -96,25 +203,10 @@ inline static void *memset(void* dest, int val, size_t count)
  */
 inline static size_t strlen(const char* str)
 {
-	size_t len = 0;
-	size_t i, j;
-
 	if (BUILTIN_EXPECT(!str, 0))
-		return len;
-
-#ifdef CONFIG_X86_32
-	asm volatile("not %%ecx; cld; repne scasb; not %%ecx; dec %%ecx"
-		: "=&c"(len), "=&D"(i), "=&a"(j)
-		: "2"(0), "1"(str), "0"(len)
-		: "memory","cc");
-#elif defined(CONFIG_X86_64)
-	asm volatile("not %%rcx; cld; repne scasb; not %%rcx; dec %%rcx"
-		: "=&c"(len), "=&D"(i), "=&a"(j)
-		: "2"(0), "1"(str), "0"(len)
-		: "memory","cc");
-#endif
+		return 0;
 
-	return len;
+	return strlen_func(str);
 }
 #endif
 
@@ -61,6 +61,19 @@ void switch_context(size_t** stack);
  */
 int create_default_frame(task_t* task, entry_point_t ep, void* arg);
 
+/** @brief Setup the frame of a forked task
+ *
+ * The system call frame of the current task is copied to the
+ * kernel stack of the new task. Afterwards, the new task
+ * returns from the system call with the return value 0.
+ *
+ * @param task Pointer to the task structure of the new task
+ * @return
+ * - 0 on success
+ * - -EINVAL (-22) on failure
+ */
+int arch_fork(task_t* task);
+
 /** @brief Register a task's TSS at GDT
  *
  * @return
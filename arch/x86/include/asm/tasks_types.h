@@ -83,10 +83,28 @@ union fpu_state {
 
 typedef void (*handle_fpu_state)(union fpu_state* state);
 
-extern handle_fpu_state save_fpu_state;
-extern handle_fpu_state restore_fpu_state;
 extern handle_fpu_state fpu_init;
 
+/*
+ * fnsave/frstor work on every FPU and are replaced by fxsave/fxrstor at
+ * boot time (see alternative.h). The state is addressed by a register
+ * because the replacement must not use RIP-relative operands.
+ */
+
+/** @brief Save the FPU state of a task */
+static inline void save_fpu_state(union fpu_state* state)
+{
+	asm volatile (ALTERNATIVE("fnsave (%1); fwait", "fxsave (%1); fnclex", X86_FEATURE_FXSR)
+		: "=m"(*state) : "r"(state) : "memory");
+}
+
+/** @brief Restore the FPU state of a task */
+static inline void restore_fpu_state(union fpu_state* state)
+{
+	asm volatile (ALTERNATIVE("frstor (%0)", "fxrstor (%0)", X86_FEATURE_FXSR)
+		:: "r"(state), "m"(*state));
+}
+
 #ifdef __cplusplus
 }
 #endif
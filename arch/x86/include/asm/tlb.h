@@ -0,0 +1,146 @@
+/*
+ * Copyright (c) eduOS contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the University nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * @file arch/x86/include/asm/tlb.h
+ * @brief Batched TLB shootdowns
+ *
+ * An operation on the page tables collects the changed pages in a batch.
+ * The local TLB is flushed immediately. Other cores are notified once
+ * per batch by an IPI, which covers the listed pages or the whole range.
+ * Only cores, which currently run the address space, receive a user-level
+ * batch. Changes of the kernel space are sent to all online cores.
+ * Page frames, which were unmapped by the batch, are released after
+ * all cores acknowledged the shootdown.
+ *
+ * A batch is flushed without holding the page_lock. A core, which waits
+ * with disabled interrupts for the lock, wouldn't acknowledge the IPI.
+ *
+ * On a single core system (MAX_CORES == 1), a batch is reduced to the
+ * local flushes and the deferred release of the page frames.
+ */
+
+#ifndef __ARCH_TLB_H__
+#define __ARCH_TLB_H__
+
+#include <eduos/stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Number of pages, which are listed individually by a batch
+#define TLB_BATCH_PAGES		16
+/// Number of page frames, whose release is deferred by a batch
+#define TLB_BATCH_FRAMES	16
+/// Deferred page frames, which a single step of an operation adds at most (a page and its tables)
+#define TLB_BATCH_STEP		4
+/// A user-level range above this size (in pages) drops the whole TLB instead of single pages
+#define TLB_FLUSH_CEILING	64
+/// Interrupt vector of a shootdown request
+#define TLB_SHOOTDOWN_IRQ	122
+
+struct task;
+
+/** @brief Pending invalidations of an operation on the page tables */
+typedef struct tlb_batch {
+	/// Address space of the user-level pages
+	struct task*	task;
+	/// Lowest changed address
+	size_t		start;
+	/// End of the highest changed page
+	size_t		end;
+	/// Number of changed pages (the list overflows beyond TLB_BATCH_PAGES)
+	uint32_t	npages;
+	/// A page of the kernel space was changed => all cores are affected
+	uint8_t		kernel;
+	/// Listed pages
+	size_t		pages[TLB_BATCH_PAGES];
+	/// Number of deferred page frames
+	uint32_t	nframes;
+	/// Deferred page frames (physical address and number of pages)
+	struct {
+		size_t	phyaddr;
+		size_t	npages;
+	} frames[TLB_BATCH_FRAMES];
+} tlb_batch_t;
+
+/** @brief Start an empty batch for the address space of the current task */
+void tlb_batch_init(tlb_batch_t* batch);
+
+/** @brief Invalidate a page
+ *
+ * The local TLB entry is flushed immediately, remote ones by tlb_batch_flush().
+ */
+void tlb_batch_add(tlb_batch_t* batch, size_t viraddr);
+
+/** @brief Invalidate a range of user-level pages
+ *
+ * Large ranges drop the whole (non-global) TLB instead of single entries.
+ */
+void tlb_batch_range(tlb_batch_t* batch, size_t viraddr, size_t npages);
+
+/** @brief Release page frames after the shootdown of the batch
+ *
+ * A caller, which holds the page_lock, checks tlb_batch_full() before
+ * each step. Otherwise, a full list of deferred frames flushes the batch.
+ */
+void tlb_batch_free(tlb_batch_t* batch, size_t phyaddr, size_t npages);
+
+/** @brief Check whether the next step might overflow the deferred page frames
+ *
+ * The caller has to release its locks and to flush the batch before.
+ *
+ * @return
+ * - 1 if less than TLB_BATCH_STEP frames can be deferred
+ * - 0 otherwise
+ */
+int tlb_batch_full(tlb_batch_t* batch);
+
+/** @brief Notify the other cores and release the deferred page frames
+ *
+ * The batch is empty afterwards and can be reused.
+ */
+void tlb_batch_flush(tlb_batch_t* batch);
+
+/** @brief Register a switch of the current core to the address space of task
+ *
+ * Is called before the root table of task is loaded.
+ */
+void tlb_switch(struct task* task);
+
+/** @brief Install the shootdown handler and register the current core as online
+ *
+ * Is called by apic_init(), once the dense index of the core is known.
+ */
+int tlb_init(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -60,6 +60,16 @@ int vga_putchar(unsigned char c);
 /** @brief Clear the screen */
 void vga_cls(void);
 
+#ifdef CONFIG_BENCHMARK
+/** @brief Measure bulk writes to the video memory mapped uncacheable and write-combining
+ *
+ * The video memory remains mapped write-combining.
+ *
+ * @param n Number of page-sized copies per memory type
+ */
+void vga_benchmark(uint32_t n);
+#endif
+
 #ifdef __cplusplus
 }
 #endif
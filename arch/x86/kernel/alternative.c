@@ -0,0 +1,130 @@
+/*
+ * Copyright (c) eduOS contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the University nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * @file arch/x86/kernel/alternative.c
+ * @brief Boot-time patching of CPU-feature-dependent instructions
+ */
+
+#include <eduos/stdio.h>
+#include <eduos/string.h>
+#include <asm/irqflags.h>
+#include <asm/processor.h>
+#include <asm/alternative.h>
+
+/* defined in the linker script */
+extern const alt_instr_t altinstr_start[];
+extern const alt_instr_t altinstr_end[];
+
+#define ALT_NOP_MAX	8
+
+/*
+ * Recommended multi-byte NOPs of the P6 family. Every CPU, which
+ * supports one of the patched features, supports them as well.
+ */
+static const uint8_t alt_nops[ALT_NOP_MAX+1][ALT_NOP_MAX] = {
+	{ },
+	{ 0x90 },
+	{ 0x66, 0x90 },
+	{ 0x0f, 0x1f, 0x00 },
+	{ 0x0f, 0x1f, 0x40, 0x00 },
+	{ 0x0f, 0x1f, 0x44, 0x00, 0x00 },
+	{ 0x66, 0x0f, 0x1f, 0x44, 0x00, 0x00 },
+	{ 0x0f, 0x1f, 0x80, 0x00, 0x00, 0x00, 0x00 },
+	{ 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00 }
+};
+
+static int has_feature(uint16_t feature)
+{
+	uint32_t word;
+
+	switch(feature / 32) {
+	case 0:
+		word = cpu_info.feature1;
+		break;
+	case 1:
+		word = cpu_info.feature2;
+		break;
+	case 2:
+		word = cpu_info.feature3;
+		break;
+	case 3:
+		word = cpu_info.feature4;
+		break;
+	case 4:
+		word = cpu_info.feature5;
+		break;
+	default:
+		return 0;
+	}
+
+	return (word >> (feature % 32)) & 1;
+}
+
+static void add_nops(uint8_t* instr, uint32_t len)
+{
+	while (len > 0) {
+		uint32_t n = (len > ALT_NOP_MAX) ? ALT_NOP_MAX : len;
+
+		memcpy(instr, alt_nops[n], n);
+		instr += n;
+		len -= n;
+	}
+}
+
+void apply_alternatives(void)
+{
+	const alt_instr_t* alt;
+	uint32_t a=0, b=0, c=0, d=0;
+	uint32_t patched = 0;
+	uint8_t flags;
+
+	flags = irq_nested_disable();
+
+	for(alt=altinstr_start; alt<altinstr_end; alt++) {
+		uint8_t* instr = (uint8_t*) alt->instr;
+
+		if (!has_feature(alt->feature))
+			continue;
+
+		// ALTERNATIVE() pads the default sequence => never true
+		if (BUILTIN_EXPECT(alt->replacementlen > alt->instrlen, 0))
+			continue;
+
+		memcpy(instr, (const uint8_t*) alt->replacement, alt->replacementlen);
+		add_nops(instr + alt->replacementlen, alt->instrlen - alt->replacementlen);
+		patched++;
+	}
+
+	// serialize the instruction stream before the patched code is executed
+	cpuid(0, &a, &b, &c, &d);
+
+	irq_nested_enable(flags);
+
+	kprintf("Patched %u of %u alternative instructions\n",
+		patched, (uint32_t) (altinstr_end - altinstr_start));
+}
@@ -41,6 +41,7 @@
 #include <asm/page.h>
 #include <asm/apic.h>
 #include <asm/multiboot.h>
+#include <asm/tlb.h>
 
 /*
  * Note that linker symbols are not variables, they have no memory allocated for
@@ -77,42 +78,38 @@ spinlock_t bootlock = SPINLOCK_INIT;
 // forward declaration
 static int lapic_reset(void);
 
-static uint32_t lapic_read_default(uint32_t addr)
+/*
+ * The memory-mapped accesses are replaced by rdmsr/wrmsr at boot time if
+ * the CPU supports x2APIC (see alternative.h). apic_init() enables the
+ * x2APIC mode in this case.
+ */
+static inline uint32_t lapic_read(uint32_t addr)
 {
-	return *((const volatile uint32_t*) (lapic+addr));
-}
+	uint32_t lo, hi;
 
-static uint32_t lapic_read_msr(uint32_t addr)
-{
-	return rdmsr(0x800 + (addr >> 4));
-}
+	asm volatile (ALTERNATIVE("movl (%2), %0", "rdmsr", X86_FEATURE_X2APIC)
+		: "=a"(lo), "=d"(hi) : "r"(lapic+addr), "c"(0x800 + (addr >> 4)) : "memory");
 
-typedef uint32_t (*lapic_read_func)(uint32_t addr);
-
-static lapic_read_func lapic_read = lapic_read_default;
+	return lo;
+}
 
-static void lapic_write_default(uint32_t addr, uint32_t value)
+static inline void lapic_write(uint32_t addr, uint32_t value)
 {
+	uint32_t hi = 0;
+
 #ifdef CONFIG_X86_32
 	/*
 	 * to avoid a pentium bug, we have to read a apic register
 	 * before we write a value to this register
 	 */
-	asm volatile ("movl (%%eax), %%edx; movl %%ebx, (%%eax)" :: "a"(lapic+addr), "b"(value) : "%edx");
+	asm volatile (ALTERNATIVE("movl (%2), %0; movl %1, (%2)", "wrmsr", X86_FEATURE_X2APIC)
+		: "+d"(hi) : "a"(value), "r"(lapic+addr), "c"(0x800 + (addr >> 4)) : "memory");
 #else
-	*((volatile uint32_t*) (lapic+addr)) = value;
+	asm volatile (ALTERNATIVE("movl %0, (%2)", "wrmsr", X86_FEATURE_X2APIC)
+		:: "a"(value), "d"(hi), "r"(lapic+addr), "c"(0x800 + (addr >> 4)) : "memory");
 #endif
 }
 
-static void lapic_write_msr(uint32_t addr, uint32_t value)
-{
-	wrmsr(0x800 + (addr >> 4), value);
-}
-
-typedef void (*lapic_write_func)(uint32_t addr, uint32_t value);
-
-static lapic_write_func lapic_write = lapic_write_default;
-
 static inline uint32_t ioapic_read(uint32_t reg)
 {
 	ioapic->reg = reg;
@@ -157,8 +154,42 @@ int apic_is_enabled(void)
 
 uint32_t apic_cpu_id(void)
 {
-	if (apic_is_enabled())
+	if (apic_is_enabled()) {
+		// the x2APIC ID uses the whole register
+		if (has_x2apic())
+			return lapic_read(APIC_ID);
 		return ((lapic_read(APIC_ID)) >> 24);
+	}
+
+	return 0;
+}
+
+int apic_core_id(uint32_t core)
+{
+	if (BUILTIN_EXPECT((core >= MAX_CORES) || !apic_processors[core], 0))
+		return -EINVAL;
+
+	return apic_processors[core]->id;
+}
+
+int apic_send_ipi(uint32_t dest, uint8_t irq)
+{
+	uint32_t lo = APIC_INT_ASSERT | APIC_DM_FIXED | irq;
+
+	if (BUILTIN_EXPECT(!apic_is_enabled(), 0))
+		return -ENXIO;
+
+	if (has_x2apic()) {
+		// x2APIC => the ICR is a single 64 bit register
+		wrmsr(0x830, ((uint64_t) dest << 32) | lo);
+		return 0;
+	}
+
+	while (lapic_read(APIC_ICR1) & APIC_ICR_BUSY)
+		PAUSE;
+
+	lapic_write(APIC_ICR2, dest << 24);
+	lapic_write(APIC_ICR1, lo);
 
 	return 0;
 }
@@ -220,7 +251,7 @@ static apic_mp_t* search_mptable(size_t base, size_t limit) {
 			vptr = 0;
 		}
 
-		if (BUILTIN_EXPECT(!page_map(ptr & PAGE_MASK, ptr & PAGE_MASK, 1, PG_GLOBAL | PG_RW | PG_PCD), 1))
+		if (BUILTIN_EXPECT(!page_map(ptr & PAGE_MASK, ptr & PAGE_MASK, 1, PG_GLOBAL | PG_RW | PG_UC), 1))
 			vptr = ptr & PAGE_MASK;
 		else
 			return NULL;
@@ -367,7 +398,7 @@ found_mp:
 
 	apic_config = (apic_config_table_t*) ((size_t) apic_mp->mp_config);
 	if (((size_t) apic_config & PAGE_MASK) != ((size_t) apic_mp & PAGE_MASK)) {
-		page_map((size_t) apic_config & PAGE_MASK,  (size_t) apic_config & PAGE_MASK, 1, PG_GLOBAL | PG_RW | PG_PCD);
+		page_map((size_t) apic_config & PAGE_MASK,  (size_t) apic_config & PAGE_MASK, 1, PG_GLOBAL | PG_RW | PG_UC);
 		vma_add( (size_t) apic_config & PAGE_MASK, ((size_t) apic_config & PAGE_MASK) + PAGE_SIZE, VMA_READ|VMA_WRITE);
 	}
 
@@ -424,7 +455,7 @@ found_mp:
 			apic_io_entry_t* io_entry = (apic_io_entry_t*) addr;
 			ioapic = (ioapic_t*) ((size_t) io_entry->addr);
 			kprintf("Found IOAPIC at 0x%x\n", ioapic);
-			page_map(IOAPIC_ADDR, (size_t)ioapic & PAGE_MASK, 1, PG_GLOBAL | PG_RW | PG_PCD);
+			page_map(IOAPIC_ADDR, (size_t)ioapic & PAGE_MASK, 1, PG_GLOBAL | PG_RW | PG_UC);
 			vma_add(IOAPIC_ADDR, IOAPIC_ADDR + PAGE_SIZE, VMA_READ|VMA_WRITE);
 			ioapic = (ioapic_t*) IOAPIC_ADDR;
 			addr += 8;
@@ -459,10 +490,8 @@ check_lapic:
 	if (has_x2apic()) {
 		kprintf("Enable X2APIC support!\n");
 		wrmsr(0x1B, lapic | 0xD00);
-		lapic_read = lapic_read_msr;
-		lapic_write = lapic_write_msr;
 	} else {
-		page_map(LAPIC_ADDR, (size_t)lapic & PAGE_MASK, 1, PG_GLOBAL | PG_RW | PG_PCD);
+		page_map(LAPIC_ADDR, (size_t)lapic & PAGE_MASK, 1, PG_GLOBAL | PG_RW | PG_UC);
 		vma_add(LAPIC_ADDR, LAPIC_ADDR + PAGE_SIZE, VMA_READ | VMA_WRITE);
 		lapic = LAPIC_ADDR;
 		kprintf("Map APIC to 0x%x\n", lapic);
@@ -510,6 +539,13 @@ int apic_init(void)
 	if (ret)
 		return ret;
 
+	// the position in the processor table is the dense index of the core
+	if (boot_processor < MAX_CORES)
+		current_core = boot_processor;
+
+	// the index is known => the core receives TLB shootdowns
+	tlb_init();
+
 	// set APIC error handler
 	irq_install_handler(126, apic_err_handler);
 	kprintf("Boot processor %u (ID %u)\n", boot_processor, apic_processors[boot_processor]->id);
@@ -138,7 +138,7 @@ cpu_init:
 	shr edi, 10               ; (edi >> 12) * 4 (index for boot_pgt)
 %endif
 	add edi, boot_pgt
-	or eax, 0x113             ; set present, global, writable and cache disable bits
+	or eax, 0x113             ; set present, global, writable and write-combining (PCD => PAT entry 2) bits
 	mov DWORD [edi], eax
 	pop edi
 %endif
@@ -244,7 +244,7 @@ L1:
 	; Set CR0
 	mov eax, cr0
 	and eax, ~(1 << 30)     ; enable caching
-	and eax, ~(1 << 16)	; allow kernel write access to read-only pages
+	or eax, (1 << 16)	; protect read-only pages also against kernel writes (copy-on-write)
 	or eax, (1 << 31)       ; enable paging
 	%ifdef CONFIG_X86_64
 		or eax, (1 << 0)    ; long mode also needs PM-bit set
@@ -405,6 +405,12 @@ isrstub_pseudo_error 9
 %assign i i+1
 %endrep
 
+global apic_tlb
+apic_tlb:
+	push byte 0 ; pseudo error code
+	push byte 122
+	jmp common_stub
+
 global apic_timer
 apic_timer:
 	push byte 0 ; pseudo error code
@@ -465,6 +471,9 @@ isrsyscall:
     extern syscall_handler
     call syscall_handler
 
+; a forked task starts here => see arch_fork()
+global syscall_return
+syscall_return:
     cli
     add esp, 4 ; eax contains the return value
                ; => we did not restore eax
@@ -566,11 +575,15 @@ isrsyscall:
     push rbx
     push rdi
     push rsi
+    mov rcx, r10 ; rcx contains the return address => the third argument is passed by r10
 	sti
 
     extern syscall_handler
     call syscall_handler
 
+; a forked task starts here => see arch_fork()
+global syscall_return
+syscall_return:
 	cli
     pop rsi
     pop rdi
@@ -701,6 +714,8 @@ boot_stack:
 
 ; Bootstrap page tables are used during the initialization.
 ALIGN 4096
+global boot_map
+boot_map:
 %ifdef CONFIG_X86_32
 boot_pgd:
 
@@ -41,6 +41,8 @@
 #include <asm/idt.h>
 #include <asm/isrs.h>
 #include <asm/io.h>
+#include <asm/irqflags.h>
+#include <asm/page.h>
 
 /* 
  * These are our own ISRs that point to our special IRQ handler
@@ -70,6 +72,7 @@ extern void irq20(void);
 extern void irq21(void);
 extern void irq22(void);
 extern void irq23(void);
+extern void apic_tlb(void);
 extern void apic_timer(void);
 extern void apic_lint0(void);
 extern void apic_lint1(void);
@@ -194,6 +197,8 @@ static int irq_install(void)
 		IDT_FLAG_PRESENT|IDT_FLAG_RING0|IDT_FLAG_32BIT|IDT_FLAG_INTTRAP);
 
 	// add APIC interrupt handler
+	idt_set_gate(122, (size_t)apic_tlb, KERNEL_CODE_SELECTOR,
+		IDT_FLAG_PRESENT|IDT_FLAG_RING0|IDT_FLAG_32BIT|IDT_FLAG_INTTRAP);
 	idt_set_gate(123, (size_t)apic_timer, KERNEL_CODE_SELECTOR,
 		IDT_FLAG_PRESENT|IDT_FLAG_RING0|IDT_FLAG_32BIT|IDT_FLAG_INTTRAP);
 	idt_set_gate(124, (size_t)apic_lint0, KERNEL_CODE_SELECTOR,
@@ -272,6 +277,19 @@ size_t** irq_handler(struct state *s)
 	outportb(0x20, 0x20);
 
 leave_handler:
+	/*
+	 * Promote populated parts of the heap to large pages, before the
+	 * task returns to user mode. The task holds no kernel locks and the
+	 * interrupt is already acknowledged => run it with enabled interrupts
+	 * like a system call.
+	 */
+	if ((s->cs & 0x3) && (current_task->flags & TASK_HEAP_COLLAPSE)) {
+		current_task->flags &= ~TASK_HEAP_COLLAPSE;
+		irq_enable();
+		page_collapse();
+		irq_disable();
+	}
+
 	// timer interrupt?
 	if (s->int_no == 32)
 		return scheduler(); // switch to a new task
@@ -0,0 +1,335 @@
+/*
+ * Copyright (c) eduOS contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the University nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * @file arch/x86/kernel/memops.c
+ * @brief Implementations of memcpy, memset and strlen
+ *
+ * The kernel doesn't save the SSE registers of a task before it uses them
+ * (lazy FPU switching). Therefore, all variants work with the general
+ * purpose registers. SSE2 contributes only the non-temporal store movnti.
+ */
+
+#include <eduos/stddef.h>
+#include <eduos/stdio.h>
+#include <eduos/stdlib.h>
+#include <eduos/string.h>
+#include <eduos/processor.h>
+
+/// Without FSRM, shorter copies avoid the startup costs of rep movsb
+#define ERMS_MIN_SIZE	128
+
+/** @brief Copy by words and the remaining bytes (baseline) */
+static void* memcpy_movs(void* dest, const void* src, size_t count)
+{
+	size_t i, j, k;
+
+#ifdef CONFIG_X86_32
+	asm volatile (
+		"cld; rep movsl\n\t"
+		"movl %4, %%ecx\n\t" 
+		"andl $3, %%ecx\n\t"
+		"rep movsb\n\t" 
+		: "=&c"(i), "=&D"(j), "=&S"(k) 
+		: "0"(count/4), "g"(count), "1"(dest), "2"(src) : "memory","cc");
+#elif defined(CONFIG_X86_64)
+	asm volatile (
+		"cld; rep movsq\n\t"
+		"movq %4, %%rcx\n\t"
+		"andq $7, %%rcx\n\t"
+		"rep movsb\n\t"
+		: "=&c"(i), "=&D"(j), "=&S"(k)
+		: "0"(count/8), "g"(count), "1"(dest), "2"(src) : "memory","cc");
+#endif
+
+	return dest;
+}
+
+/** @brief Copy by rep movsb (fast for all sizes with FSRM) */
+static void* memcpy_fsrm(void* dest, const void* src, size_t count)
+{
+	size_t i, j, k;
+
+	asm volatile ("cld; rep movsb"
+		: "=&c"(i), "=&D"(j), "=&S"(k)
+		: "0"(count), "1"(dest), "2"(src) : "memory","cc");
+
+	return dest;
+}
+
+/** @brief Copy by rep movsb, if the copy is large enough (ERMS) */
+static void* memcpy_erms(void* dest, const void* src, size_t count)
+{
+	if (count < ERMS_MIN_SIZE)
+		return memcpy_movs(dest, src, count);
+
+	return memcpy_fsrm(dest, src, count);
+}
+
+/** @brief Copy whole pages by non-temporal stores */
+static void* memcpy_page_nt(void* dest, const void* src, size_t count)
+{
+	memcpy_nt(dest, src, count);
+
+	return dest;
+}
+
+/** @brief Byte-wise rep stosb (ERMS) */
+static void* memset_erms(void* dest, int val, size_t count)
+{
+	size_t i, j;
+
+	asm volatile ("cld; rep stosb" 
+		: "=&c"(i), "=&D"(j)
+		: "a"(val), "1"(dest), "0"(count) : "memory","cc");
+
+	return dest;
+}
+
+/** @brief Fill by words and the remaining bytes (baseline) */
+static void* memset_stos(void* dest, int val, size_t count)
+{
+	size_t i, j;
+	size_t pattern = (size_t) (uint8_t) val * ((size_t) -1 / 0xFF);
+
+#ifdef CONFIG_X86_32
+	asm volatile (
+		"cld; rep stosl\n\t"
+		"movl %4, %%ecx\n\t"
+		"andl $3, %%ecx\n\t"
+		"rep stosb\n\t"
+		: "=&c"(i), "=&D"(j)
+		: "a"(pattern), "0"(count/4), "g"(count), "1"(dest) : "memory","cc");
+#elif defined(CONFIG_X86_64)
+	asm volatile (
+		"cld; rep stosq\n\t"
+		"movq %4, %%rcx\n\t"
+		"andq $7, %%rcx\n\t"
+		"rep stosb\n\t"
+		: "=&c"(i), "=&D"(j)
+		: "a"(pattern), "0"(count/8), "g"(count), "1"(dest) : "memory","cc");
+#endif
+
+	return dest;
+}
+
+/** @brief Clear whole pages by the selected memset() */
+static void memzero_page_default(void* dest, size_t count)
+{
+	memset_func(dest, 0x00, count);
+}
+
+#ifdef CONFIG_BENCHMARK
+/** @brief Search the terminating zero by repne scasb (previous implementation, for comparison) */
+static size_t strlen_scasb(const char* str)
+{
+	size_t len = 0;
+	size_t i, j;
+
+#ifdef CONFIG_X86_32
+	asm volatile("not %%ecx; cld; repne scasb; not %%ecx; dec %%ecx"
+		: "=&c"(len), "=&D"(i), "=&a"(j)
+		: "2"(0), "1"(str), "0"(len)
+		: "memory","cc");
+#elif defined(CONFIG_X86_64)
+	asm volatile("not %%rcx; cld; repne scasb; not %%rcx; dec %%rcx"
+		: "=&c"(len), "=&D"(i), "=&a"(j)
+		: "2"(0), "1"(str), "0"(len)
+		: "memory","cc");
+#endif
+
+	return len;
+}
+#endif
+
+typedef size_t __attribute__((may_alias)) word_t;
+
+/** @brief Search the terminating zero word by word
+ *
+ * An aligned word never crosses a page boundary. Therefore, the
+ * bytes behind the terminating zero are read without a page fault.
+ */
+static size_t strlen_word(const char* str)
+{
+	const size_t ones = (size_t) -1 / 0xFF;
+	const size_t highs = ones << 7;
+	const char* s = str;
+	const word_t* w;
+
+	for (; (size_t) s & (sizeof(size_t)-1); s++) {
+		if (!*s)
+			return s - str;
+	}
+
+	// a word contains a zero byte, if the subtraction borrows from it
+	for (w = (const word_t*) s; !((*w - ones) & ~*w & highs); w++)
+		;
+
+	for (s = (const char*) w; *s; s++)
+		;
+
+	return s - str;
+}
+
+func_memcpy memcpy_func = memcpy_movs;
+func_memset memset_func = memset_stos;
+func_strlen strlen_func = strlen_word;
+func_memcpy memcpy_page = memcpy_movs;
+func_memzero memzero_page = memzero_page_default;
+
+void string_init(void)
+{
+	if (has_fsrm())
+		memcpy_func = memcpy_fsrm;
+	else if (has_erms())
+		memcpy_func = memcpy_erms;
+
+	if (has_erms())
+		memset_func = memset_erms;
+
+	if (has_sse2()) {
+		memcpy_page = memcpy_page_nt;
+		memzero_page = memzero_nt;
+	} else memcpy_page = memcpy_func;
+
+	kprintf("String operations: %s%s%s%s\n",
+		has_erms() ? "ERMS " : "", has_fsrm() ? "FSRM " : "",
+		has_sse2() ? "SSE2 (non-temporal stores) " : "",
+		has_avx2() ? "AVX2 (unused, no AVX state)" : "");
+}
+
+#ifdef CONFIG_BENCHMARK
+/// Largest size of the sweep
+#define BENCH_MAX	(64 << 10)
+/// Bytes, which are processed per variant and size
+#define BENCH_TOTAL	(1 << 20)
+
+static const size_t bench_sizes[] = {32, 128, 512, 4096, 16384, BENCH_MAX};
+#define BENCH_NSIZES	(sizeof(bench_sizes) / sizeof(bench_sizes[0]))
+
+void string_benchmark(void)
+{
+	struct {
+		const char* name;
+		func_memcpy copy;
+	} copies[] = {
+		{"memcpy movs", memcpy_movs},
+		{"memcpy erms", memcpy_erms},
+		{"memcpy fsrm", memcpy_fsrm},
+		{"memcpy nt  ", memcpy_page_nt}
+	};
+	struct {
+		const char* name;
+		func_memset set;
+	} sets[] = {
+		{"memset stos", memset_stos},
+		{"memset erms", memset_erms}
+	};
+	struct {
+		const char* name;
+		func_strlen len;
+	} lens[] = {
+		{"strlen scas", strlen_scasb},
+		{"strlen word", strlen_word}
+	};
+	char* src = (char*) kmalloc(BENCH_MAX);
+	char* dest = (char*) kmalloc(BENCH_MAX);
+	volatile size_t len = 0; // keeps the calls of strlen()
+	uint32_t v, s, i, n;
+	uint64_t tsc;
+
+	if (BUILTIN_EXPECT(!src || !dest, 0))
+		goto out;
+
+	memset(src, 'a', BENCH_MAX);
+
+	kprintf("string_benchmark: cycles per call for");
+	for(s=0; s<BENCH_NSIZES; s++)
+		kprintf(" %lu", bench_sizes[s]);
+	kprintf(" bytes\n");
+
+	for(v=0; v<sizeof(copies)/sizeof(copies[0]); v++) {
+		// movnti is part of SSE2
+		if ((copies[v].copy == memcpy_page_nt) && !has_sse2())
+			continue;
+
+		kprintf("string_benchmark: %s:", copies[v].name);
+		for(s=0; s<BENCH_NSIZES; s++) {
+			n = BENCH_TOTAL / bench_sizes[s];
+			tsc = rdtsc();
+			for(i=0; i<n; i++)
+				copies[v].copy(dest, src, bench_sizes[s]);
+			kprintf(" %llu", (rdtsc() - tsc) / n);
+		}
+		kprintf("\n");
+	}
+
+	for(v=0; v<sizeof(sets)/sizeof(sets[0]); v++) {
+		kprintf("string_benchmark: %s:", sets[v].name);
+		for(s=0; s<BENCH_NSIZES; s++) {
+			n = BENCH_TOTAL / bench_sizes[s];
+			tsc = rdtsc();
+			for(i=0; i<n; i++)
+				sets[v].set(dest, 0, bench_sizes[s]);
+			kprintf(" %llu", (rdtsc() - tsc) / n);
+		}
+		kprintf("\n");
+	}
+
+	if (has_sse2()) {
+		kprintf("string_benchmark: memzero nt :");
+		for(s=0; s<BENCH_NSIZES; s++) {
+			n = BENCH_TOTAL / bench_sizes[s];
+			tsc = rdtsc();
+			for(i=0; i<n; i++)
+				memzero_nt(dest, bench_sizes[s]);
+			kprintf(" %llu", (rdtsc() - tsc) / n);
+		}
+		kprintf("\n");
+	}
+
+	for(v=0; v<sizeof(lens)/sizeof(lens[0]); v++) {
+		kprintf("string_benchmark: %s:", lens[v].name);
+		for(s=0; s<BENCH_NSIZES; s++) {
+			n = BENCH_TOTAL / bench_sizes[s];
+			src[bench_sizes[s]-1] = '\0';
+			tsc = rdtsc();
+			for(i=0; i<n; i++)
+				len += lens[v].len(src);
+			kprintf(" %llu", (rdtsc() - tsc) / n);
+			src[bench_sizes[s]-1] = 'a';
+		}
+		kprintf("\n");
+	}
+
+out:
+	if (src)
+		kfree(src);
+	if (dest)
+		kfree(dest);
+}
+#endif
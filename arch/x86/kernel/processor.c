@@ -34,24 +34,9 @@
 
 extern void isrsyscall(void);
 
-cpu_info_t cpu_info = { 0, 0, 0, 0};
+cpu_info_t cpu_info = { 0, 0, 0, 0, 0, 0};
 static uint32_t cpu_freq = 0;
 
-static void default_mb(void)
-{
-	asm volatile ("lock; addl $0,0(%%esp)" ::: "memory", "cc");
-}
-
-static void default_save_fpu_state(union fpu_state* state)
-{
-	asm volatile ("fnsave %0; fwait" : "=m"((*state).fsave) :: "memory");
-}
-
-static void default_restore_fpu_state(union fpu_state* state)
-{
-	asm volatile ("frstor %0" :: "m"(state->fsave));
-}
-
 static void default_fpu_init(union fpu_state* fpu)
 {
 	i387_fsave_t *fp = &fpu->fsave;
@@ -63,27 +48,8 @@ static void default_fpu_init(union fpu_state* fpu)
 	fp->fos = 0xffff0000u;
 }
 
-func_memory_barrier mb = default_mb;
-func_memory_barrier rmb = default_mb;
-func_memory_barrier wmb = default_mb;
-
-static void mfence(void) { asm volatile("mfence" ::: "memory"); }
-static void lfence(void) { asm volatile("lfence" ::: "memory"); }
-static void sfence(void) { asm volatile("sfence" ::: "memory"); }
-handle_fpu_state save_fpu_state = default_save_fpu_state;
-handle_fpu_state restore_fpu_state = default_restore_fpu_state;
 handle_fpu_state fpu_init = default_fpu_init;
 
-static void save_fpu_state_fxsr(union fpu_state* state)
-{
-	asm volatile ("fxsave %0; fnclex" : "=m"((*state).fxsave) :: "memory");
-}
-
-static void restore_fpu_state_fxsr(union fpu_state* state)
-{
-	asm volatile ("fxrstor %0" :: "m"(state->fxsave));
-}
-
 static void fpu_init_fxsr(union fpu_state* fpu)
 {
 	i387_fxsave_t* fx = &fpu->fxsave;
@@ -140,10 +106,17 @@ int cpu_detection(void) {
 
 		cpuid(0x80000001, &a, &b, &c, &cpu_info.feature3);
 		cpuid(0x80000008, &cpu_info.addr_width, &b, &c, &d);
+
+		// structured extended feature flags (subleaf 0)
+		cpuid(0, &a, &b, &c, &d);
+		if (a >= 7) {
+			c = 0;
+			cpuid(7, &a, &cpu_info.feature4, &c, &cpu_info.feature5);
+		}
 	}
 
 	if (first_time) {
-		kprintf("Paging features: %s%s%s%s%s%s%s%s\n",
+		kprintf("Paging features: %s%s%s%s%s%s%s%s%s%s\n",
 				(cpu_info.feature1 & CPU_FEATUE_PSE) ? "PSE (2/4Mb) " : "",
 				(cpu_info.feature1 & CPU_FEATURE_PAE) ? "PAE " : "",
 				(cpu_info.feature1 & CPU_FEATURE_PGE) ? "PGE " : "",
@@ -151,6 +124,8 @@ int cpu_detection(void) {
 				(cpu_info.feature1 & CPU_FEATURE_PSE36) ? "PSE36 " : "",
 				(cpu_info.feature3 & CPU_FEATURE_NX) ? "NX " : "",
 				(cpu_info.feature3 & CPU_FEATURE_1GBHP) ? "PSE (1Gb) " : "",
+				(cpu_info.feature2 & CPU_FEATURE_PCID) ? "PCID " : "",
+				(cpu_info.feature4 & CPU_FEATURE_INVPCID) ? "INVPCID " : "",
 				(cpu_info.feature3 & CPU_FEATURE_LM) ? "LM" : "");
 
 		kprintf("Physical adress-width: %u bits\n", cpu_info.addr_width & 0xff);
@@ -166,8 +141,34 @@ int cpu_detection(void) {
 		cr4 |= CR4_OSXMMEXCPT;	// set the OSXMMEXCPT bit
 	if (has_pge())
 		cr4 |= CR4_PGE;
+	if (has_pse())
+		cr4 |= CR4_PSE;		// enable large pages
+#ifdef CONFIG_X86_64
+	if (has_pcid())
+		cr4 |= CR4_PCIDE;	// tag TLB entries by the address space
+#endif
 	write_cr4(cr4);
 
+	/*
+	 * PG_PWT and PG_PCD select the memory type (see page.h).
+	 * page_map() uses the PAT bit of a 4 KiB page as PG_PSE and never
+	 * sets it => the upper half of the PAT repeats the lower one.
+	 */
+	if (has_pat()) {
+		uint64_t pat = ((uint64_t) PAT_WB << 0) | ((uint64_t) PAT_WT << 8)
+			| ((uint64_t) PAT_WC << 16) | ((uint64_t) PAT_UC << 24);
+
+		flush_cache();
+		wrmsr(MSR_IA32_PAT, pat | (pat << 32));
+		flush_cache();
+
+		// drop the global entries of the boot mappings
+		if (cr4 & CR4_PGE) {
+			write_cr4(cr4 & ~CR4_PGE);
+			write_cr4(cr4);
+		} else flush_tlb();
+	}
+
 #ifdef CONFIG_X86_64
 	if (cpu_info.feature3 & CPU_FEATURE_SYSCALL) {
 		wrmsr(MSR_EFER, rdmsr(MSR_EFER) | EFER_LMA | EFER_SCE);
@@ -180,13 +181,12 @@ int cpu_detection(void) {
 		wrmsr(MSR_EFER, rdmsr(MSR_EFER) | EFER_NXE);
 #endif
 
-	if (first_time && has_sse())
-		wmb = sfence;
+	// barriers, FPU switches and the x2APIC accesses
+	if (first_time)
+		apply_alternatives();
 
-	if (first_time && has_sse2()) {
-		rmb = lfence;
-		mb = mfence;
-	}
+	if (first_time)
+		string_init();
 
 	if (first_time && has_avx())
 		kprintf("The CPU owns the Advanced Vector Extensions (AVX). However, eduOS doesn't support AVX!\n");
@@ -197,11 +197,8 @@ int cpu_detection(void) {
 		asm volatile ("fninit");
 	}
 
-	if (first_time && has_fxsr()) {
-		save_fpu_state = save_fpu_state_fxsr;
-		restore_fpu_state = restore_fpu_state_fxsr;
+	if (first_time && has_fxsr())
 		fpu_init = fpu_init_fxsr;
-	}
 
 	if (first_time && on_hypervisor()) {
 		uint32_t c, d;
@@ -34,14 +34,34 @@
 #include <eduos/memory.h>
 #include <eduos/fs.h>
 #include <eduos/vma.h>
+#include <eduos/image.h>
 #include <asm/elf.h>
 #include <asm/page.h>
+#include <asm/tlb.h>
+
+extern uint32_t tlb_kernel_gen;
 
 size_t* get_current_stack(void)
 {
 	task_t* curr_task = current_task;
 
+#if MAX_CORES > 1
+	tlb_switch(curr_task);
+#endif
+
 	// use new page table
+#ifdef CONFIG_X86_64
+	if (has_pcid()) {
+		/* The TLB entries of the address space are tagged by its PCID
+		 * and survive the switch, unless the kernel space was changed */
+		if (curr_task->tlb_gen == tlb_kernel_gen) {
+			write_cr3(curr_task->page_map | curr_task->id | CR3_NOFLUSH);
+		} else {
+			curr_task->tlb_gen = tlb_kernel_gen;
+			write_cr3(curr_task->page_map | curr_task->id);
+		}
+	} else
+#endif
 	write_cr3(curr_task->page_map);
 
 	return curr_task->last_stack_pointer;
@@ -125,6 +145,78 @@ int create_default_frame(task_t* task, entry_point_t ep, void* arg)
 	return 0;
 }
 
+/** Entry point of a forked task, defined in entry.asm */
+extern const void syscall_return;
+
+/*
+ * Size of the frame, which isrsyscall pushes on top of the kernel stack.
+ * In 32bit mode, the processor pushes additionally ss, esp, eflags, cs and eip.
+ */
+#ifdef CONFIG_X86_32
+#define SYSCALL_FRAME_SIZE	(14*sizeof(size_t))
+#else
+#define SYSCALL_FRAME_SIZE	(12*sizeof(size_t))
+#endif
+
+int arch_fork(task_t* task)
+{
+	task_t* curr_task = current_task;
+	size_t *stack;
+	struct state *stptr;
+	size_t state_size;
+
+	if (BUILTIN_EXPECT(!task, 0))
+		return -EINVAL;
+
+	if (BUILTIN_EXPECT(!task->stack, 0))
+		return -EINVAL;
+
+	/* Copy the system call frame of the current task to the
+	 * same position on the kernel stack of the new task. */
+	stack = (size_t*) (task->stack + KERNEL_STACK_SIZE - 16 - SYSCALL_FRAME_SIZE);
+	memcpy(stack, curr_task->stack + KERNEL_STACK_SIZE - 16 - SYSCALL_FRAME_SIZE, SYSCALL_FRAME_SIZE);
+
+	/* Below the system call frame, we create a register state,
+	 * which continues at the end of isrsyscall. */
+#ifdef CONFIG_X86_32
+	state_size = sizeof(struct state) - 2*sizeof(size_t);
+#else
+	state_size = sizeof(struct state);
+#endif
+	stptr = (struct state *) ((size_t) stack - state_size);
+	memset(stptr, 0x00, state_size); // => the new task gets the return value 0
+
+	stptr->int_no = 0xB16B00B5;
+	stptr->error =  0xC03DB4B3;
+	stptr->cs = 0x08;
+#ifdef CONFIG_X86_32
+	stptr->esp = (size_t) stack;
+	stptr->eip = (size_t) &syscall_return;
+	stptr->ds = stptr->es = 0x10;
+	stptr->eflags = 0x1202;
+#else
+	stptr->rsp = (size_t) stack;
+	stptr->rip = (size_t) &syscall_return;
+	stptr->ss = 0x10;
+	stptr->rflags = 0x1202;
+	stptr->userrsp = (size_t) stack;
+#endif
+
+	/* The FPU registers belong to the current task
+	 * => save them and restore them at the next access */
+	if (curr_task->flags & TASK_FPU_USED) {
+		save_fpu_state(&curr_task->fpu);
+		curr_task->flags &= ~TASK_FPU_USED;
+		write_cr0(read_cr0() | CR0_TS);
+	}
+	memcpy(&task->fpu, &curr_task->fpu, sizeof(union fpu_state));
+	task->flags = curr_task->flags & TASK_FPU_INIT;
+
+	task->last_stack_pointer = (size_t*) stptr;
+
+	return 0;
+}
+
 #define MAX_ARGS        (PAGE_SIZE - 2*sizeof(int) - sizeof(vfs_node_t*))
 
 /** @brief Structure which keeps all
@@ -148,9 +240,13 @@ typedef struct {
 static int load_task(load_args_t* largs)
 {
 	uint32_t i, offset, idx;
-	uint32_t addr, npages;
 	size_t stack = 0, heap = 0;
 	size_t flags;
+	image_t image;
+	image_segment_t* seg;
+#ifdef CONFIG_BENCHMARK
+	uint64_t tsc = rdtsc();
+#endif
 	elf_header_t header;
 	elf_program_header_t prog_header;
 	//elf_section_header_t sec_header;
@@ -170,6 +266,10 @@ static int load_task(load_args_t* largs)
 	if (!file->node)
 		return -EINVAL;
 
+	// known executable => skip parsing of the ELF file
+	if (image_lookup(file->node, &image) == 0)
+		goto load;
+
 	err = read_fs(file, (uint8_t*)&header, sizeof(elf_header_t));
 	if (err < 0) {
 		kprintf("read_fs failed: %d\n", err);
@@ -208,6 +308,11 @@ static int load_task(load_args_t* largs)
 	if (header.entry <= KERNEL_SPACE)
 		goto invalid;
 
+	memset(&image, 0x00, sizeof(image_t));
+	image.node = file->node;
+	image.generation = file->node->generation;
+	image.entry = header.entry;
+
 	// interpret program header table
 	for (i=0; i<header.ph_entry_count; i++) {
 		file->offset = header.ph_offset+i*header.ph_entry_size;
@@ -216,84 +321,83 @@ static int load_task(load_args_t* largs)
 			continue;
 		}
 
+		flags = VMA_CACHEABLE|VMA_USER;
+		if (prog_header.flags & PF_R)
+			flags |= VMA_READ;
+		if (prog_header.flags & PF_W)
+			flags |= VMA_WRITE;
+		if (prog_header.flags & PF_X)
+			flags |= VMA_EXECUTE;
+
 		switch(prog_header.type)
 		{
 		case  ELF_PT_LOAD:  // load program segment
 			if (!prog_header.virt_addr)
 				continue;
 
-			npages = (prog_header.mem_size >> PAGE_BITS);
-			if (prog_header.mem_size & (PAGE_SIZE-1))
-				npages++;
-
-			addr = get_pages(npages);
+			if (BUILTIN_EXPECT(image.nsegs >= MAX_SEGMENTS, 0)) {
+				kprintf("Too many program segments!\n");
+				return -EINVAL;
+			}
 
-			flags = PG_USER;
-#ifdef CONFIG_X86_64
-			if (has_nx() && !(prog_header.flags & PF_X))
-				flags |= PG_XD;
-#endif
-			// map page frames in the address space of the current task
-			if (page_map(prog_header.virt_addr, addr, npages, flags|PG_RW))
-				kprintf("Could not map 0x%x at 0x%x\n", addr, prog_header.virt_addr);
-
-			// clear pages
-			memset((void*) prog_header.virt_addr, 0x00, npages*PAGE_SIZE);
-
-			// update heap location
-			if (heap < prog_header.virt_addr + prog_header.mem_size)
-				heap = prog_header.virt_addr + prog_header.mem_size;
-
-			// load program
-			file->offset = prog_header.offset;
-			read_fs(file, (uint8_t*)prog_header.virt_addr, prog_header.file_size);
-
-			flags = VMA_CACHEABLE;
-			if (prog_header.flags & PF_R)
-				flags |= VMA_READ;
-			if (prog_header.flags & PF_W)
-				flags |= VMA_WRITE;
-			if (prog_header.flags & PF_X)
-				flags |= VMA_EXECUTE;
-			vma_add(prog_header.virt_addr, prog_header.virt_addr+npages*PAGE_SIZE-1, flags);
-
-			if (!(prog_header.flags & PF_W))
-				page_set_flags(prog_header.virt_addr, npages, flags);
+			seg = &image.segs[image.nsegs++];
+			seg->start = PAGE_CEIL(prog_header.virt_addr);
+			seg->end = PAGE_FLOOR(prog_header.virt_addr + prog_header.mem_size);
+			seg->flags = flags;
+			seg->offset = prog_header.offset - (prog_header.virt_addr - seg->start);
+
+			/*
+			 * The segment is loaded on demand by the page fault handler.
+			 * The file content in front of virt_addr belongs to the
+			 * same page and is mapped as well. Bytes behind the
+			 * file size are zeroed (.bss).
+			 */
+			if (prog_header.file_size < prog_header.mem_size)
+				seg->file_size = (prog_header.virt_addr - seg->start) + prog_header.file_size;
+			else
+				seg->file_size = seg->end - seg->start;
 			break;
 
 		case ELF_PT_GNU_STACK: // Indicates stack executability
-			// create user-level stack
-			npages = DEFAULT_STACK_SIZE >> PAGE_BITS;
-			if (DEFAULT_STACK_SIZE & (PAGE_SIZE-1))
-				npages++;
-
-			addr = get_pages(npages);
-			stack = header.entry*2; // virtual address of the stack
-			flags = PG_USER|PG_RW;
-#ifdef CONFIG_X86_64
-			if (has_nx() && !(prog_header.flags & PF_X))
-				flags |= PG_XD;
-#endif
-
-			if (page_map(stack, addr, npages, flags)) {
-				kprintf("Could not map stack at 0x%x\n", stack);
-				return -ENOMEM;
-			}
-			memset((void*) stack, 0x00, npages*PAGE_SIZE);
-
-			// create vma regions for the user-level stack
-			flags = VMA_CACHEABLE;
-			if (prog_header.flags & PF_R)
-				flags |= VMA_READ;
-			if (prog_header.flags & PF_W)
-				flags |= VMA_WRITE;
-			if (prog_header.flags & PF_X)
-				flags |= VMA_EXECUTE;
-			vma_add(stack, stack+npages*PAGE_SIZE-1, flags);
+			image.stack_flags = flags;
 			break;
 		}
 	}
 
+	image_insert(&image);
+
+load:
+	for (i=0; i<image.nsegs; i++) {
+		seg = &image.segs[i];
+
+		err = vma_add_file(seg->start, seg->end, seg->flags, file->node, seg->offset, seg->file_size);
+		if (BUILTIN_EXPECT(err, 0)) {
+			kprintf("Could not add segment 0x%lx - 0x%lx\n", seg->start, seg->end);
+			return err;
+		}
+
+		// update heap location
+		if (heap < seg->end)
+			heap = seg->end;
+	}
+
+	if (image.stack_flags) {
+		/*
+		 * Create the user-level stack. The pages are mapped on demand
+		 * by the page fault handler, while the stack grows downwards.
+		 * The guard page below the stack catches an overflow.
+		 */
+		stack = PAGE_FLOOR(image.entry*2) + PAGE_SIZE; // virtual address of the stack
+
+		err = vma_add(stack - PAGE_SIZE, stack, VMA_NO_ACCESS|VMA_USER);
+		if (!err)
+			err = vma_add(stack, stack + DEFAULT_STACK_SIZE, image.stack_flags);
+		if (BUILTIN_EXPECT(err, 0)) {
+			kprintf("Could not create stack at 0x%lx\n", stack);
+			return err;
+		}
+	}
+
 	// setup heap
 	if (!curr_task->heap)
 		curr_task->heap = (vma_t*) kmalloc(sizeof(vma_t));
@@ -304,8 +408,13 @@ static int load_task(load_args_t* largs)
 	}
 
 	curr_task->heap->flags = VMA_HEAP|VMA_USER;
+#ifdef CONFIG_HEAP_POPULATE
+	curr_task->heap->flags |= VMA_POPULATE;
+#endif
 	curr_task->heap->start = PAGE_FLOOR(heap);
 	curr_task->heap->end = PAGE_FLOOR(heap);
+	curr_task->heap->node = NULL;
+	curr_task->heap->prev = curr_task->heap->next = NULL;
 
 	if (BUILTIN_EXPECT(!stack, 0)) {
 		kprintf("Stack is missing!\n");
@@ -360,7 +469,12 @@ static int load_task(load_args_t* largs)
 	// clear fpu state => currently not supported
 	curr_task->flags &= ~(TASK_FPU_USED|TASK_FPU_INIT);
 
-	jump_to_user_code(header.entry, stack+offset);
+#ifdef CONFIG_BENCHMARK
+	kprintf("load_task: task %u loaded within %llu cycles, %d resident pages\n",
+		curr_task->id, rdtsc() - tsc, percpu_counter_sum(&curr_task->user_usage));
+#endif
+
+	jump_to_user_code(image.entry, stack+offset);
 
 	return 0;
 
@@ -34,6 +34,7 @@
 #include <asm/irqflags.h>
 #include <asm/vga.h>
 #include <asm/io.h>
+#include <asm/page.h>
 
 /* 
  * This will keep track of how many ticks the system
@@ -56,6 +57,11 @@ static void timer_handler(struct state *s)
 	/* Increment our 'tick counter' */
 	timer_ticks++;
 
+	/* the heap is collapsed before the task returns to user mode,
+	 * see irq_handler() */
+	if ((s->cs & 0x3) && !(timer_ticks % HEAP_COLLAPSE_INTERVAL))
+		current_task->flags |= TASK_HEAP_COLLAPSE;
+
 	/*
 	 * Every TIMER_FREQ clocks (approximately 1 second), we will
 	 * display a message on the screen
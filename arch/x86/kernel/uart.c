@@ -282,7 +282,7 @@ int uart_early_init(char* cmdline)
 			int err;
 			size_t newaddr = ((size_t) &kernel_start - PAGE_SIZE);
 
-			err = page_map_bootmap(newaddr & PAGE_MASK, iobase & PAGE_MASK, PG_GLOBAL | PG_ACCESSED | PG_DIRTY | PG_RW | PG_PCD);
+			err = page_map_bootmap(newaddr & PAGE_MASK, iobase & PAGE_MASK, PG_GLOBAL | PG_ACCESSED | PG_DIRTY | PG_RW | PG_UC);
 			if (BUILTIN_EXPECT(err, 0)) {
 				iobase = 0;
 				return err;
@@ -325,7 +325,7 @@ Lsuccess:
 		kprintf("UART uses io address 0x%x\n", iobase);
 	} else {
 		mmio = 1;
-		page_map(iobase & PAGE_MASK, iobase & PAGE_MASK, 1, PG_GLOBAL | PG_ACCESSED | PG_DIRTY | PG_RW | PG_PCD);
+		page_map(iobase & PAGE_MASK, iobase & PAGE_MASK, 1, PG_GLOBAL | PG_ACCESSED | PG_DIRTY | PG_RW | PG_UC);
 		kprintf("UART uses mmio address 0x%x\n", iobase);
 		vma_add(iobase, iobase + PAGE_SIZE, VMA_READ|VMA_WRITE);
 	}
@@ -26,7 +26,11 @@
  */
 
 #include <eduos/string.h>
+#include <eduos/stdio.h>
+#include <eduos/stdlib.h>
+#include <eduos/processor.h>
 #include <asm/io.h>
+#include <asm/page.h>
 #include <asm/vga.h>
 
 #ifdef CONFIG_VGA
@@ -236,4 +240,38 @@ void vga_init(void)
 	vga_clear();
 }
 
+#ifdef CONFIG_BENCHMARK
+/** @brief Copy the screen n times back to the video memory, mapped with the memory type bits */
+static void vga_benchmark_type(const char* name, size_t bits, void* screen, uint32_t n)
+{
+	uint64_t tsc;
+	uint32_t i;
+
+	/* remap instead of an alias with an other memory type */
+	page_map(VIDEO_MEM_ADDR, VIDEO_MEM_ADDR, 1, PG_GLOBAL | PG_RW | bits);
+
+	/* the screen content is written back => the output isn't destroyed */
+	memcpy(screen, textmemptr, PAGE_SIZE);
+
+	tsc = rdtsc();
+	for(i=0; i<n; i++)
+		memcpy(textmemptr, screen, PAGE_SIZE);
+	wmb(); // drain the write-combining buffers
+	kprintf("vga_benchmark: %u x %lu bytes %s within %llu cycles\n", n, PAGE_SIZE, name, rdtsc() - tsc);
+}
+
+void vga_benchmark(uint32_t n)
+{
+	void* screen = kmalloc(PAGE_SIZE);
+
+	if (BUILTIN_EXPECT(!screen, 0))
+		return;
+
+	vga_benchmark_type("UC", PG_UC, screen, n);
+	vga_benchmark_type("WC", PG_WC, screen, n);
+
+	kfree(screen);
+}
+#endif
+
 #endif
@@ -39,9 +39,13 @@
 #include <eduos/errno.h>
 #include <eduos/string.h>
 #include <eduos/spinlock.h>
+#include <eduos/vma.h>
+#include <eduos/fs.h>
+#include <eduos/image.h>
 
 #include <asm/irq.h>
 #include <asm/page.h>
+#include <asm/tlb.h>
 #include <asm/multiboot.h>
 
 /* Note that linker symbols are not variables, they have no memory
@@ -55,8 +59,51 @@ extern const void kernel_start;
 /** Lock for kernel space page tables */
 static spinlock_t kslock = SPINLOCK_INIT;
 
-/** This PGD table is initialized in entry.asm */
-extern size_t* boot_map;
+/** This PGD or PML4 table is initialized in entry.asm */
+extern size_t boot_map[];
+
+/// Number of entries of a table at level lvl, which cover only the kernel space
+#define KERNEL_ENTRIES(lvl)	(KERNEL_SPACE >> ((lvl) * PAGE_MAP_BITS + PAGE_BITS))
+
+/** Number of page tables, which cover the kernel space */
+atomic_int32_t kernel_page_tables = ATOMIC_INIT(0);
+
+/** Generation of the kernel mappings
+ *
+ * The kernel space is shared between all address spaces. With PCIDs,
+ * a task switch keeps the TLB entries of the next address space.
+ * Therefore, they are flushed if the kernel mappings were changed
+ * in the meantime (see get_current_stack()).
+ */
+uint32_t tlb_kernel_gen = 0;
+
+#if defined(CONFIG_X86_64) && (MAX_TASKS > CR3_PCID_MASK+1)
+#error "The task id is used as PCID => MAX_TASKS is limited to 4096"
+#endif
+
+/** @brief Flush a page, whose mapping was changed or removed
+ *
+ * The mappings of the kernel space might be cached in all address spaces.
+ * The current one is flushed directly, the other ones at their next activation.
+ * Other cores are notified by the batch.
+ */
+static inline void page_flush(tlb_batch_t* batch, size_t viraddr)
+{
+	tlb_batch_add(batch, viraddr);
+
+	if (viraddr < KERNEL_SPACE) {
+		if (current_task->tlb_gen == tlb_kernel_gen)
+			current_task->tlb_gen++;
+		tlb_kernel_gen++;
+	}
+}
+
+/** Heap faults, which were resolved by a large page */
+atomic_int32_t heap_huge_faults = ATOMIC_INIT(0);
+/** Heap faults, which didn't find free aligned page frames for a large page */
+atomic_int32_t heap_huge_fallbacks = ATOMIC_INIT(0);
+/** Heap regions, which were collapsed into a large page */
+atomic_int32_t heap_huge_collapses = ATOMIC_INIT(0);
 
 #ifdef CONFIG_X86_32
 /** A self-reference enables direct access to all page tables */
@@ -78,35 +125,285 @@ static size_t* const self[PAGE_LEVELS] = {
 	(size_t *) 0xFFFFFFFFFFE00000,
 	(size_t *) 0xFFFFFFFFFFFFF000
 };
+#endif
 
-/** An other self-reference for page_map_copy() */
-static size_t * const other[PAGE_LEVELS] = {
-	(size_t *) 0xFFFFFF0000000000,
-	(size_t *) 0xFFFFFFFF80000000,
-	(size_t *) 0xFFFFFFFFFFC00000,
-	(size_t *) 0xFFFFFFFFFFFFE000
-};
+/** @brief Provide kernel access to a page frame
+ *
+ * x86_64 uses the direct map of the physical memory.
+ * x86_32 remaps the reserved page PAGE_TMP, the previous
+ * pointer becomes invalid.
+ */
+static inline void* page_frame_access(size_t phyaddr)
+{
+#ifdef CONFIG_X86_64
+	return phys_to_virt(phyaddr);
+#elif defined(CONFIG_X86_32)
+	page_map(PAGE_TMP, phyaddr, 1, PG_RW);
+
+	return (void*) PAGE_TMP;
 #endif
+}
 
 size_t virt_to_phys(size_t addr)
 {
 	size_t vpn   = addr >> PAGE_BITS;	// virtual page number
-	size_t entry = self[0][vpn];		// page table entry
-	size_t off   = addr  & ~PAGE_MASK;	// offset within page
-	size_t phy   = entry &  PAGE_MASK;	// physical page frame number
+	size_t entry, mask;
+	int lvl;
+
+#ifdef CONFIG_X86_64
+	if ((addr >= PHYS_MAP) && (addr < PHYS_MAP + PHYS_MAP_SIZE))
+		return addr - PHYS_MAP;
+#endif
+
+	// large page?
+	for (lvl=PAGE_LEVELS-1; lvl>0; lvl--) {
+		entry = self[lvl][vpn >> (lvl * PAGE_MAP_BITS)];
+		if ((entry & (PG_PRESENT|PG_PSE)) == (PG_PRESENT|PG_PSE)) {
+			mask = (1L << (lvl * PAGE_MAP_BITS + PAGE_BITS)) - 1;
+			return (entry & PAGE_MASK & ~mask) | (addr & mask);
+		}
+	}
+
+	entry = self[0][vpn];			// page table entry
+
+	return (entry & PAGE_MASK) | (addr & ~PAGE_MASK);
+}
 
-	return phy | off;
+/** @brief Check if the entry self[lvl][vpn] is able to map a large page
+ *
+ * Kernel entries of tables, which aren't shared between all tasks
+ * (e.g. the root table), are copied to each task. Thus, they have
+ * to reference tables, which are shared.
+ */
+static inline int page_huge_possible(int lvl, long vpn)
+{
+	if ((vpn < KERNEL_ENTRIES(lvl)) &&
+	    ((lvl+1 >= PAGE_LEVELS) || ((vpn >> PAGE_MAP_BITS) >= KERNEL_ENTRIES(lvl+1))))
+		return 0;
+
+#ifdef CONFIG_X86_32
+	return (lvl == 1) && has_pse();
+#elif defined(CONFIG_X86_64)
+	return (lvl == 1) || ((lvl == 2) && has_1gbhp());
+#endif
+}
+
+/** @brief Get the entry, which maps a virtual address
+ *
+ * In contrast to a direct access to the page table,
+ * missing tables don't cause a page fault.
+ *
+ * @param lvl Receives the level of the entry (> 0 for a large page)
+ * @return Pointer to the entry or NULL, if the address isn't mapped
+ */
+static size_t* page_leaf(size_t viraddr, int* lvl)
+{
+	long vpn = viraddr >> PAGE_BITS;
+	size_t* entry;
+	int l;
+
+	for (l=PAGE_LEVELS-1; l>=0; l--) {
+		entry = &self[l][vpn >> (l * PAGE_MAP_BITS)];
+		if (!(*entry & PG_PRESENT))
+			return NULL;
+
+		if (!l || (*entry & PG_PSE)) {
+			*lvl = l;
+			return entry;
+		}
+	}
+
+	return NULL;
 }
 
-//TODO: code is missing
-int page_set_flags(size_t viraddr, uint32_t npages, int flags)
+/** @brief Get the descriptor of the table, which holds the entry self[lvl][vpn]
+ *
+ * @return Descriptor or NULL, if the entry count of the table isn't tracked.
+ * This applies to the root table and to the tables of the boot process.
+ */
+static page_frame_t* page_table_frame(int lvl, long vpn)
 {
-	return -EINVAL;
+	page_frame_t* frame;
+
+	if (lvl >= PAGE_LEVELS-1)
+		return NULL;
+
+	frame = get_frame(self[lvl+1][vpn >> PAGE_MAP_BITS] & PAGE_MASK);
+	if (!frame || !(frame->flags & PF_PAGETABLE) || (frame->flags & PF_PINNED))
+		return NULL;
+
+	return frame;
 }
 
-int page_map(size_t viraddr, size_t phyaddr, size_t npages, size_t bits)
+/** @brief An entry self[lvl][vpn] was removed
+ *
+ * Decrements the entry count of the table and releases it, if it's
+ * empty. Afterwards, the parent tables are checked as well.
+ * Tables, which are referenced by the kernel entries of the root
+ * table, are shared between all tasks and never released.
+ */
+static void page_table_put(tlb_batch_t* batch, int lvl, long vpn)
+{
+	page_frame_t* frame;
+	size_t entry;
+	long idx;
+
+	for (; lvl<PAGE_LEVELS-1; lvl++, vpn=idx) {
+		idx = vpn >> PAGE_MAP_BITS; // entry of the parent table
+		frame = page_table_frame(lvl, vpn);
+		if (!frame || !frame->entries || --frame->entries)
+			return;
+
+		/* A kernel table is shared, but the tables of some upper levels aren't
+		 * (e.g. the root table). Only a table, which is referenced by an
+		 * other shared table, can be released. */
+		if ((idx < KERNEL_ENTRIES(lvl+1)) &&
+		    ((lvl+2 >= PAGE_LEVELS) || ((idx >> PAGE_MAP_BITS) >= KERNEL_ENTRIES(lvl+2))))
+			return;
+
+		entry = self[lvl+1][idx];
+		self[lvl+1][idx] = 0;
+
+		/* invlpg drops the paging-structure caches and the TLB entry of
+		 * the table's self-reference, which points to the released frame */
+		page_flush(batch, vpn << (lvl * PAGE_MAP_BITS + PAGE_BITS));
+		tlb_batch_add(batch, (size_t) &self[lvl][idx << PAGE_MAP_BITS]);
+
+		frame->flags &= ~PF_PAGETABLE;
+		tlb_batch_free(batch, entry & PAGE_MASK, 1);
+
+		if (idx < KERNEL_ENTRIES(lvl+1))
+			atomic_int32_dec(&kernel_page_tables);
+		else
+			percpu_counter_dec(&current_task->user_usage);
+	}
+}
+
+/** @brief An entry self[lvl][vpn] was added */
+static inline void page_table_get(int lvl, long vpn)
+{
+	page_frame_t* frame = page_table_frame(lvl, vpn);
+
+	if (frame)
+		frame->entries++;
+}
+
+/** @brief Replace the large page self[lvl][vpn] by a table of smaller pages
+ *
+ * The smaller pages inherit the flags and the page frames.
+ * The caller has to hold the lock of the page tables.
+ */
+static int page_split(tlb_batch_t* batch, int lvl, long vpn)
+{
+	size_t entry = self[lvl][vpn];
+	size_t phyaddr, base, bits, step;
+	page_frame_t* frame;
+	uint8_t flags;
+	long i, first = vpn << PAGE_MAP_BITS;
+
+	phyaddr = get_pages(1);
+	if (BUILTIN_EXPECT(!phyaddr, 0))
+		return -ENOMEM;
+
+	frame = get_frame(phyaddr);
+	if (frame) {
+		frame->flags |= PF_PAGETABLE;
+		frame->entries = PAGE_MAP_ENTRIES;
+	}
+
+	if (vpn < KERNEL_ENTRIES(lvl))
+		atomic_int32_inc(&kernel_page_tables);
+	else
+		percpu_counter_inc(&current_task->user_usage);
+
+	/* PG_PSE of a 4 KiB page selects the page attribute table */
+	bits = entry & ~PAGE_MASK;
+	if (lvl == 1)
+		bits &= ~PG_PSE;
+
+	step = 1L << ((lvl-1) * PAGE_MAP_BITS + PAGE_BITS);
+	base = entry & PAGE_MASK & ~(step * PAGE_MAP_ENTRIES - 1);
+
+	/* nobody is allowed to see the table before it's filled */
+	flags = irq_nested_disable();
+
+	self[lvl][vpn] = phyaddr | PG_PRESENT | PG_USER | PG_RW;
+	tlb_batch_add(batch, (size_t) &self[lvl-1][first]);
+
+	for (i=0; i<PAGE_MAP_ENTRIES; i++)
+		self[lvl-1][first+i] = (base + i*step) | bits;
+
+	tlb_batch_add(batch, vpn << (lvl * PAGE_MAP_BITS + PAGE_BITS));
+
+	irq_nested_enable(flags);
+
+	return 0;
+}
+
+/** @brief Provide the table, which is referenced by the entry self[lvl][vpn]
+ *
+ * A missing table is created and a large page is split.
+ * The caller has to hold the lock of the page tables.
+ */
+static int page_table_ensure(tlb_batch_t* batch, int lvl, long vpn, size_t bits)
+{
+#ifdef CONFIG_X86_32
+	/* The kernel tables are shared between all tasks, but the PGDs aren't.
+	 * Therefore, kernel tables are registered in the boot PGD. */
+	if ((lvl == PAGE_LEVELS-1) && (vpn < KERNEL_ENTRIES(lvl)) &&
+	    !(self[lvl][vpn] & PG_PRESENT) && (boot_map[vpn] & PG_PRESENT))
+		self[lvl][vpn] = boot_map[vpn];
+#endif
+	if (self[lvl][vpn] & PG_PRESENT) {
+		if (self[lvl][vpn] & PG_PSE)
+			return page_split(batch, lvl, vpn);
+
+		return 0;
+	}
+
+	/* There's no table available which covers the region.
+	 * Therefore we need to create a new empty table. */
+	size_t phyaddr = get_pages(1);
+	if (BUILTIN_EXPECT(!phyaddr, 0))
+		return -ENOMEM;
+
+	page_frame_t* frame = get_frame(phyaddr);
+	if (frame) {
+		frame->flags |= PF_PAGETABLE;
+		frame->entries = 0;
+	}
+
+	if (vpn < KERNEL_ENTRIES(lvl))
+		atomic_int32_inc(&kernel_page_tables);
+	else if (bits & PG_USER)
+		percpu_counter_inc(&current_task->user_usage);
+
+	/* Reference the new table within its parent */
+#ifdef CONFIG_X86_32
+	self[lvl][vpn] = phyaddr | bits | PG_PRESENT | PG_USER | PG_RW;
+#elif defined(CONFIG_X86_64)
+	self[lvl][vpn] = (phyaddr | bits | PG_PRESENT | PG_USER | PG_RW) & ~PG_XD;
+#endif
+
+	/* Fill new table with zeros */
+	memset(&self[lvl-1][vpn<<PAGE_MAP_BITS], 0, PAGE_SIZE);
+	page_table_get(lvl, vpn);
+
+#ifdef CONFIG_X86_32
+	if ((lvl == PAGE_LEVELS-1) && (vpn < KERNEL_ENTRIES(lvl)))
+		boot_map[vpn] = self[lvl][vpn];
+#endif
+
+	return 0;
+}
+
+/** @brief Map a region by 4 KiB pages
+ *
+ * The caller has to hold the lock of the page tables.
+ */
+static int page_map_pages(tlb_batch_t* batch, size_t viraddr, size_t phyaddr, size_t npages, size_t bits)
 {
-	int lvl, ret = -ENOMEM;
+	int lvl, ret;
 	long vpn = viraddr >> PAGE_BITS;
 	long first[PAGE_LEVELS], last[PAGE_LEVELS];
 
@@ -116,43 +413,22 @@ int page_map(size_t viraddr, size_t phyaddr, size_t npages, size_t bits)
 		last[lvl]  = (vpn+npages-1) >> (lvl * PAGE_MAP_BITS);
 	}
 
-	/** @todo: might not be sufficient! */
-	if (bits & PG_USER)
-		spinlock_irqsave_lock(&current_task->page_lock);
-	else
-		spinlock_lock(&kslock);
-
 	/* Start iterating through the entries
 	 * beginning at the root table (PGD or PML4) */
 	for (lvl=PAGE_LEVELS-1; lvl>=0; lvl--) {
 		for (vpn=first[lvl]; vpn<=last[lvl]; vpn++) {
 			if (lvl) { /* PML4, PDPT, PGD */
-				if (!(self[lvl][vpn] & PG_PRESENT)) {
-					/* There's no table available which covers the region.
-					 * Therefore we need to create a new empty table. */
-					size_t phyaddr = get_pages(1);
-					if (BUILTIN_EXPECT(!phyaddr, 0))
-						goto out;
-					
-					if (bits & PG_USER)
-						atomic_int32_inc(&current_task->user_usage);
-
-					/* Reference the new table within its parent */
-#ifdef CONFIG_X86_32
-					self[lvl][vpn] = phyaddr | bits | PG_PRESENT | PG_USER | PG_RW;
-#elif defined(CONFIG_X86_64)
-					self[lvl][vpn] = (phyaddr | bits | PG_PRESENT | PG_USER | PG_RW) & ~PG_XD;
-#endif
-
-					/* Fill new table with zeros */
-					memset(&self[lvl-1][vpn<<PAGE_MAP_BITS], 0, PAGE_SIZE);
-				}
+				ret = page_table_ensure(batch, lvl, vpn, bits);
+				if (BUILTIN_EXPECT(ret, 0))
+					return ret;
 			}
 			else { /* PGT */
 				if (self[lvl][vpn] & PG_PRESENT)
 					/* There's already a page mapped at this address.
 					 * We have to flush a single TLB entry. */
-					tlb_flush_one_page(vpn << PAGE_BITS);
+					page_flush(batch, vpn << PAGE_BITS);
+				else
+					page_table_get(lvl, vpn);
 
 				self[lvl][vpn] = phyaddr | bits | PG_PRESENT;
 				phyaddr += PAGE_SIZE;
@@ -160,146 +436,1133 @@ int page_map(size_t viraddr, size_t phyaddr, size_t npages, size_t bits)
 		}
 	}
 
-	ret = 0;
+	return 0;
+}
+
+/** @brief Map a large page by the entry self[lvl][vpn]
+ *
+ * The caller has to hold the lock of the page tables.
+ *
+ * @return
+ * - 0 on success
+ * - -EEXIST if the entry already references a table
+ * - -ENOMEM on failure
+ */
+static int page_map_huge(tlb_batch_t* batch, int lvl, long vpn, size_t phyaddr, size_t bits)
+{
+	int l, ret;
+
+	for (l=PAGE_LEVELS-1; l>lvl; l--) {
+		ret = page_table_ensure(batch, l, vpn >> ((l-lvl) * PAGE_MAP_BITS), bits);
+		if (BUILTIN_EXPECT(ret, 0))
+			return ret;
+	}
+
+	if (self[lvl][vpn] & PG_PRESENT) {
+		if (!(self[lvl][vpn] & PG_PSE))
+			return -EEXIST;
+
+		page_flush(batch, vpn << (lvl * PAGE_MAP_BITS + PAGE_BITS));
+	} else
+		page_table_get(lvl, vpn);
+
+	self[lvl][vpn] = phyaddr | bits | PG_PRESENT | PG_PSE;
+
+	return 0;
+}
+
+int page_map(size_t viraddr, size_t phyaddr, size_t npages, size_t bits)
+{
+	tlb_batch_t batch;
+	int lvl, ret = 0;
+	size_t n;
+
+	tlb_batch_init(&batch);
+
+	/** @todo: might not be sufficient! */
+	if (bits & PG_USER)
+		spinlock_irqsave_lock(&current_task->page_lock);
+	else
+		spinlock_lock(&kslock);
+
+	if (!(bits & PG_PSE)) {
+		ret = page_map_pages(&batch, viraddr, phyaddr, npages, bits);
+		goto out;
+	}
+
+	bits &= ~PG_PSE;
+	while (npages && !ret) {
+		/* search the largest page, which fits to the alignment and the size */
+		for (lvl=PAGE_LEVELS-1; lvl>0; lvl--) {
+			n = 1L << (lvl * PAGE_MAP_BITS);
+			if ((npages >= n) && !(((viraddr | phyaddr) >> PAGE_BITS) & (n-1)) &&
+			    page_huge_possible(lvl, viraddr >> (lvl * PAGE_MAP_BITS + PAGE_BITS)))
+				break;
+		}
+
+		if (lvl) {
+			ret = page_map_huge(&batch, lvl, viraddr >> (lvl * PAGE_MAP_BITS + PAGE_BITS), phyaddr, bits);
+			if (ret == -EEXIST)
+				ret = page_map_pages(&batch, viraddr, phyaddr, n, bits);
+		} else {
+			/* 4 KiB pages up to the next boundary of a large page */
+			n = PAGE_MAP_ENTRIES - ((viraddr >> PAGE_BITS) & (PAGE_MAP_ENTRIES-1));
+			if (n > npages)
+				n = npages;
+
+			ret = page_map_pages(&batch, viraddr, phyaddr, n, bits);
+		}
+
+		viraddr += n << PAGE_BITS;
+		phyaddr += n << PAGE_BITS;
+		npages -= n;
+	}
+
 out:
 	if (bits & PG_USER)
 		spinlock_irqsave_unlock(&current_task->page_lock);
 	else
 		spinlock_unlock(&kslock);
 
+	tlb_batch_flush(&batch);
+
 	return ret;
 }
 
-/** Tables are freed by page_map_drop() */
-int page_unmap(size_t viraddr, size_t npages)
+/** @brief Check if a page is mapped
+ *
+ * In contrast to a direct access to the page table,
+ * missing tables don't cause a page fault.
+ */
+static int page_present(size_t viraddr)
 {
-	/* We aquire both locks for kernel and task tables
-	 * as we dont know to which the region belongs. */
-	spinlock_irqsave_lock(&current_task->page_lock);
-	spinlock_lock(&kslock);
-
-	/* Start iterating through the entries.
-	 * Only the PGT entries are removed. Tables remain allocated. */
-	size_t vpn, start = viraddr>>PAGE_BITS;
-	for (vpn=start; vpn<start+npages; vpn++)
-		self[0][vpn] = 0;
+	int lvl;
 
-	spinlock_irqsave_unlock(&current_task->page_lock);
-	spinlock_unlock(&kslock);
-
-	/* This can't fail because we don't make checks here */
-	return 0;
+	return page_leaf(viraddr, &lvl) != NULL;
 }
 
-int page_map_drop(void)
+int page_populate(size_t viraddr, size_t npages, size_t bits)
 {
-	void traverse(int lvl, long vpn) {
-		long stop;
-		for (stop=vpn+PAGE_MAP_ENTRIES; vpn<stop; vpn++) {
-			if ((self[lvl][vpn] & PG_PRESENT) && (self[lvl][vpn] & PG_USER)) {
-				/* Post-order traversal */
-				if (lvl)
-					traverse(lvl-1, vpn<<PAGE_MAP_BITS);
+	size_t i, n, addr, phyaddr;
+	size_t huge = PAGE_HUGE_SIZE >> PAGE_BITS;
+	int zeroed, ret;
 
-				put_pages(self[lvl][vpn] & PAGE_MASK, 1);
-				atomic_int32_dec(&current_task->user_usage);
+	viraddr &= PAGE_MASK;
+
+	for (i=0; i<npages; i+=n) {
+		addr = viraddr + i*PAGE_SIZE;
+
+		if (page_present(addr)) {
+			n = 1;
+			continue;
+		}
+
+		/* determine the length of the unmapped run */
+		for (n=1; (i+n < npages) && !page_present(addr + n*PAGE_SIZE); n++)
+			;
+
+		/* a single page is taken from the pool of pre-zeroed frames,
+		 * larger runs are mapped by one call of page_map() */
+		phyaddr = 0;
+		zeroed = 0;
+		if ((bits & PG_PSE) && (n >= huge)) {
+			/* aligned frames enable page_map() to use a large page,
+			 * an unaligned run is cut at the next boundary */
+			if (addr & (PAGE_HUGE_SIZE-1)) {
+				n = huge - ((addr >> PAGE_BITS) & (huge-1));
+			} else {
+				n = huge;
+				phyaddr = get_aligned_pages(n, n);
 			}
 		}
-	}
+		if (!phyaddr && (n > 1))
+			phyaddr = get_pages(n);
+		if (!phyaddr) {
+			n = 1;
+			phyaddr = get_zeroed_page(&zeroed);
+		}
+		if (BUILTIN_EXPECT(!phyaddr, 0))
+			return -ENOMEM;
 
-	spinlock_irqsave_lock(&current_task->page_lock);
+		ret = page_map(addr, phyaddr, n, bits|PG_RW);
+		if (BUILTIN_EXPECT(ret, 0)) {
+			put_pages(phyaddr, n);
+			return ret;
+		}
 
-	traverse(PAGE_LEVELS-1, 0);
+		if (!zeroed)
+			memzero_page((void*) addr, n*PAGE_SIZE);
 
-	spinlock_irqsave_unlock(&current_task->page_lock);
+		if (bits & PG_USER)
+			percpu_counter_add(&current_task->user_usage, n);
+	}
 
-	/* This can't fail because we don't make checks here */
 	return 0;
 }
 
-int page_map_copy(task_t *dest)
+/** @brief Get the entry of level 1, which covers a virtual address
+ *
+ * @return Pointer to the entry or NULL, if a table of an upper level
+ * is missing or an upper entry maps a large page
+ */
+static size_t* page_pde(size_t viraddr)
 {
-	int traverse(int lvl, long vpn) {
-		long stop;
-		for (stop=vpn+PAGE_MAP_ENTRIES; vpn<stop; vpn++) {
-			if (self[lvl][vpn] & PG_PRESENT) {
-				if (self[lvl][vpn] & PG_USER) {
-					size_t phyaddr = get_pages(1);
-					if (BUILTIN_EXPECT(!phyaddr, 0))
-						return -ENOMEM;
-
-					atomic_int32_inc(&dest->user_usage);
-
-					other[lvl][vpn] = phyaddr | (self[lvl][vpn] & ~PAGE_MASK);
-					if (lvl) /* PML4, PDPT, PGD */
-						traverse(lvl-1, vpn<<PAGE_MAP_BITS); /* Pre-order traversal */
-					else { /* PGT */
-						page_map(PAGE_TMP, phyaddr, 1, PG_RW);
-						memcpy((void*) PAGE_TMP, (void*) (vpn<<PAGE_BITS), PAGE_SIZE);
-					}
-				}
-				else if (self[lvl][vpn] & PG_SELF)
-					other[lvl][vpn] = 0;
-				else
-					other[lvl][vpn] = self[lvl][vpn];
-			}
-			else
-				other[lvl][vpn] = 0;
-		}
-		return 0;
+	long vpn = viraddr >> PAGE_BITS;
+	size_t entry;
+	int lvl;
+
+	for (lvl=PAGE_LEVELS-1; lvl>1; lvl--) {
+		entry = self[lvl][vpn >> (lvl * PAGE_MAP_BITS)];
+		if (!(entry & PG_PRESENT) || (entry & PG_PSE))
+			return NULL;
 	}
 
-	spinlock_irqsave_lock(&current_task->page_lock);
-	self[PAGE_LEVELS-1][PAGE_MAP_ENTRIES-2] = dest->page_map | PG_PRESENT | PG_SELF | PG_RW;
+	return &self[1][vpn >> PAGE_MAP_BITS];
+}
 
-	int ret = traverse(PAGE_LEVELS-1, 0);
+/** @brief Map a zeroed large page to an unmapped region of the heap
+ *
+ * @param viraddr Start address of the region (aligned to PAGE_HUGE_SIZE)
+ * @return
+ * - 0 on success
+ * - -EINVAL if a part of the region is already mapped
+ * - -ENOMEM if no aligned page frames are available
+ */
+static int page_fault_huge(size_t viraddr)
+{
+	size_t npages = PAGE_HUGE_SIZE >> PAGE_BITS;
+	size_t phyaddr;
+	size_t* pde;
+	int ret;
 
-	other[PAGE_LEVELS-1][PAGE_MAP_ENTRIES-1] = dest->page_map | PG_PRESENT | PG_SELF | PG_RW;
-	self [PAGE_LEVELS-1][PAGE_MAP_ENTRIES-2] = 0;
-	spinlock_irqsave_unlock(&current_task->page_lock);
+	if (!page_huge_possible(1, viraddr >> PAGE_HUGE_BITS))
+		return -EINVAL;
 
-	/* Flush TLB entries of 'other' self-reference */
-	flush_tlb();
+	pde = page_pde(viraddr);
+	if (pde ? (*pde & PG_PRESENT) : page_present(viraddr))
+		return -EINVAL;
 
-	return ret;
+	phyaddr = get_aligned_pages(npages, npages);
+	if (!phyaddr) {
+		atomic_int32_inc(&heap_huge_fallbacks);
+		return -ENOMEM;
+	}
+
+	ret = page_map(viraddr, phyaddr, npages, PG_USER|PG_RW|PG_PSE);
+	if (BUILTIN_EXPECT(ret, 0)) {
+		put_pages(phyaddr, npages);
+		return ret;
+	}
+
+	memzero_page((void*) viraddr, PAGE_HUGE_SIZE);
+
+	percpu_counter_add(&current_task->user_usage, npages);
+	atomic_int32_inc(&heap_huge_faults);
+
+	return 0;
 }
 
-void page_fault_handler(struct state *s)
+/** @brief Replace the table behind the entry self[1][idx] by a large page
+ *
+ * All pages of the table have to be present, private and writable
+ * with equal flags. Their content is copied to aligned page frames,
+ * unless the page frames are already contiguous and aligned.
+ * The caller has to hold the page_lock of the current task.
+ * After the flush of the batch, the caller releases the old table
+ * and (if copy is set) the page frames, which are listed by it.
+ */
+static int page_collapse_table(tlb_batch_t* batch, long idx, size_t* table, int* copy)
 {
-	size_t viraddr = read_cr2();
-	task_t* task = current_task;
+	size_t* pgt = &self[0][idx << PAGE_MAP_BITS];
+	size_t viraddr = (size_t) idx << PAGE_HUGE_BITS;
+	size_t bits, entry, phyaddr, i;
+	page_frame_t* frame;
 
-	// on demand userspace heap mapping
-	if ((task->heap) && (viraddr >= task->heap->start) && (viraddr < task->heap->end)) {
-		viraddr &= PAGE_MASK;
+	bits = pgt[0] & ~(PAGE_MASK|PG_ACCESSED|PG_DIRTY);
+	if ((bits & (PG_PRESENT|PG_USER|PG_RW|PG_COW|PG_NONE|PG_PAT)) != (PG_PRESENT|PG_USER|PG_RW))
+		return -EINVAL;
 
-		size_t phyaddr = get_page();
-		if (BUILTIN_EXPECT(!phyaddr, 0)) {
-			kprintf("out of memory: task = %u\n", task->id);
-			goto default_handler;
-		}
+	phyaddr = pgt[0] & PAGE_MASK;
+	*copy = (phyaddr & (PAGE_HUGE_SIZE-1)) != 0;
 
-		int ret = page_map(viraddr, phyaddr, 1, PG_USER|PG_RW);
-		if (BUILTIN_EXPECT(ret, 0)) {
-			kprintf("map_region: could not map %#lx to %#lx, task = %u\n", phyaddr, viraddr, task->id);
-			put_page(phyaddr);
+	for (i=0; i<PAGE_MAP_ENTRIES; i++) {
+		entry = pgt[i];
+		if ((entry & ~(PAGE_MASK|PG_ACCESSED|PG_DIRTY)) != bits)
+			return -EINVAL;
 
-			goto default_handler;
-		}
+		/* shared page frames stay page-wise mapped */
+		frame = get_frame(entry & PAGE_MASK);
+		if (!frame || (frame->flags & PF_PINNED) || (atomic_int32_read(&frame->count) != 1))
+			return -EINVAL;
+
+		if ((entry & PAGE_MASK) != phyaddr + i*PAGE_SIZE)
+			*copy = 1;
+	}
 
-		memset((void*) viraddr, 0x00, PAGE_SIZE); // fill with zeros
+	if (*copy) {
+		phyaddr = get_aligned_pages(PAGE_MAP_ENTRIES, PAGE_MAP_ENTRIES);
+		if (!phyaddr)
+			return -ENOMEM;
 
-		return;
+		for (i=0; i<PAGE_MAP_ENTRIES; i++)
+			memcpy_page(page_frame_access(phyaddr + i*PAGE_SIZE), (void*) (viraddr + i*PAGE_SIZE), PAGE_SIZE);
 	}
 
-default_handler:
-#ifdef CONFIG_X86_32
-	kprintf("Page Fault Exception (%d) at cs:ip = %#x:%#lx, task = %u, addr = %#lx, error = %#x [ %s %s %s %s %s ]\n",
-		s->int_no, s->cs, s->eip, current_task->id, viraddr, s->error,
-		(s->error & 0x4) ? "user" : "supervisor",
-		(s->error & 0x10) ? "instruction" : "data",
-		(s->error & 0x2) ? "write" : ((s->error & 0x10) ? "fetch" : "read"),
-		(s->error & 0x1) ? "protection" : "not present",
+	*table = self[1][idx] & PAGE_MASK;
+	self[1][idx] = phyaddr | bits | PG_PSE;
+
+	/* drops the 4 KiB pages and the self-reference of the table */
+	tlb_batch_range(batch, viraddr, PAGE_MAP_ENTRIES);
+	tlb_batch_add(batch, (size_t) pgt);
+
+	frame = get_frame(*table);
+	if (frame)
+		frame->flags &= ~PF_PAGETABLE;
+	percpu_counter_dec(&current_task->user_usage);
+
+	return 0;
+}
+
+int page_collapse(void)
+{
+	task_t* task = current_task;
+	size_t addr, end, table, i;
+	size_t* pde;
+	size_t* pgt;
+	tlb_batch_t batch;
+	int copy, ret = 0;
+
+	if (!task->heap)
+		return 0;
+
+	tlb_batch_init(&batch);
+
+	spinlock_lock(&task->vma_lock);
+	spinlock_irqsave_lock(&task->page_lock);
+
+	addr = (task->heap->start + PAGE_HUGE_SIZE - 1) & ~(PAGE_HUGE_SIZE - 1);
+	end = PAGE_FLOOR(task->heap->end) & ~(PAGE_HUGE_SIZE - 1);
+
+	for (; addr < end; addr += PAGE_HUGE_SIZE) {
+		if (!page_huge_possible(1, addr >> PAGE_HUGE_BITS))
+			continue;
+
+		pde = page_pde(addr);
+		if (!pde || ((*pde & (PG_PRESENT|PG_PSE)) != PG_PRESENT))
+			continue;
+
+		/* a single region per pass limits the delay of the return to user mode */
+		if (!page_collapse_table(&batch, addr >> PAGE_HUGE_BITS, &table, &copy)) {
+			atomic_int32_inc(&heap_huge_collapses);
+			ret = 1;
+			break;
+		}
+	}
+
+	spinlock_irqsave_unlock(&task->page_lock);
+	spinlock_unlock(&task->vma_lock);
+
+	tlb_batch_flush(&batch);
+
+	/* the old frames are released after the shootdown,
+	 * the table isn't reachable by the self-reference anymore */
+	if (ret) {
+		if (copy) {
+			pgt = (size_t*) page_frame_access(table);
+			for (i=0; i<PAGE_MAP_ENTRIES; i++)
+				put_page(pgt[i] & PAGE_MASK);
+		}
+
+		put_page(table);
+	}
+
+	return ret;
+}
+
+/** @brief Check if the large page at level lvl lies completely within [vpn, end)
+ *
+ * @param n Receives the number of 4 KiB pages of the entry
+ */
+static inline int page_covered(int lvl, size_t vpn, size_t end, size_t* n)
+{
+	*n = 1L << (lvl * PAGE_MAP_BITS);
+
+	return !(vpn & (*n - 1)) && (vpn + *n <= end);
+}
+
+int page_release(size_t viraddr, size_t npages)
+{
+	task_t* task = current_task;
+	size_t i, n, addr, entry;
+	size_t* leaf;
+	tlb_batch_t batch;
+	int lvl, ret = 0;
+
+	viraddr &= PAGE_MASK;
+	tlb_batch_init(&batch);
+
+	spinlock_irqsave_lock(&task->page_lock);
+
+	for (i=0; i<npages; i+=n) {
+		addr = viraddr + i*PAGE_SIZE;
+		n = 1;
+
+		/* the shootdown of the batch isn't able to wait with the lock */
+		if (tlb_batch_full(&batch)) {
+			spinlock_irqsave_unlock(&task->page_lock);
+			tlb_batch_flush(&batch);
+			spinlock_irqsave_lock(&task->page_lock);
+		}
+
+		leaf = page_leaf(addr, &lvl);
+		if (!leaf || !(*leaf & (PG_USER|PG_NONE)))
+			continue;
+
+		/* a partly released large page is split */
+		if (lvl && !page_covered(lvl, addr >> PAGE_BITS, (viraddr >> PAGE_BITS) + npages, &n)) {
+			ret = page_split(&batch, lvl, addr >> (lvl * PAGE_MAP_BITS + PAGE_BITS));
+			if (BUILTIN_EXPECT(ret, 0))
+				break;
+
+			n = 0;
+			continue;
+		}
+
+		entry = *leaf;
+		*leaf = 0;
+		tlb_batch_add(&batch, addr);
+
+		/* the page frames are released after the shootdown */
+		tlb_batch_free(&batch, entry & PAGE_MASK & ~((n << PAGE_BITS) - 1), n);
+		percpu_counter_sub(&task->user_usage, n);
+
+		page_table_put(&batch, lvl, addr >> (lvl * PAGE_MAP_BITS + PAGE_BITS));
+	}
+
+	spinlock_irqsave_unlock(&task->page_lock);
+
+	tlb_batch_flush(&batch);
+
+	return ret;
+}
+
+int page_set_flags(size_t viraddr, uint32_t npages, size_t bits)
+{
+	task_t* task = current_task;
+	size_t i, n, addr, entry, flags;
+	size_t* leaf;
+	tlb_batch_t batch;
+	int lvl, ret = 0;
+
+	if (BUILTIN_EXPECT(bits & PAGE_MASK, 0))
+		return -EINVAL;
+
+	viraddr &= PAGE_MASK;
+	tlb_batch_init(&batch);
+
+	spinlock_irqsave_lock(&task->page_lock);
+
+	for (i=0; i<npages; i+=n) {
+		addr = viraddr + i*PAGE_SIZE;
+		n = 1;
+
+		leaf = page_leaf(addr, &lvl);
+		if (!leaf || !(*leaf & (PG_USER|PG_NONE)))
+			continue;
+
+		/* a large page, which is partly changed, is split */
+		if (lvl && !page_covered(lvl, addr >> PAGE_BITS, (viraddr >> PAGE_BITS) + npages, &n)) {
+			ret = page_split(&batch, lvl, addr >> (lvl * PAGE_MAP_BITS + PAGE_BITS));
+			if (BUILTIN_EXPECT(ret, 0))
+				break;
+
+			n = 0;
+			continue;
+		}
+
+		entry = *leaf;
+
+		/* the page frame might be shared (e.g. with the parent task or a file)
+		 * => the next write access decides whether it has to be copied */
+		flags = bits;
+		if ((flags & PG_RW) && !(entry & PG_RW))
+			flags = (flags & ~PG_RW) | PG_COW;
+		if (lvl)
+			flags |= PG_PSE;
+
+		*leaf = (entry & (PAGE_MASK|PG_ACCESSED|PG_DIRTY)) | flags | PG_PRESENT;
+		tlb_batch_add(&batch, addr);
+	}
+
+	spinlock_irqsave_unlock(&task->page_lock);
+
+	tlb_batch_flush(&batch);
+
+	return ret;
+}
+
+/** Empty tables are released, the page frames are kept */
+int page_unmap(size_t viraddr, size_t npages)
+{
+	tlb_batch_t batch;
+
+	tlb_batch_init(&batch);
+
+	/* We aquire both locks for kernel and task tables
+	 * as we dont know to which the region belongs. */
+	spinlock_irqsave_lock(&current_task->page_lock);
+	spinlock_lock(&kslock);
+
+	/* Start iterating through the entries.
+	 * Tables without present entries are released. */
+	size_t vpn, n, start = viraddr>>PAGE_BITS;
+	size_t* leaf;
+	int lvl, ret = 0;
+
+	for (vpn=start; vpn<start+npages; vpn+=n) {
+		n = 1;
+
+		/* the shootdown of the batch isn't able to wait with the locks */
+		if (tlb_batch_full(&batch)) {
+			spinlock_irqsave_unlock(&current_task->page_lock);
+			spinlock_unlock(&kslock);
+			tlb_batch_flush(&batch);
+			spinlock_irqsave_lock(&current_task->page_lock);
+			spinlock_lock(&kslock);
+		}
+
+		leaf = page_leaf(vpn << PAGE_BITS, &lvl);
+		if (!leaf)
+			continue;
+
+		/* a partly unmapped large page is split */
+		if (lvl && !page_covered(lvl, vpn, start+npages, &n)) {
+			ret = page_split(&batch, lvl, vpn >> (lvl * PAGE_MAP_BITS));
+			if (BUILTIN_EXPECT(ret, 0))
+				break;
+
+			n = 0;
+			continue;
+		}
+
+		*leaf = 0;
+		page_flush(&batch, vpn << PAGE_BITS);
+
+		page_table_put(&batch, lvl, vpn >> (lvl * PAGE_MAP_BITS));
+	}
+
+	spinlock_irqsave_unlock(&current_task->page_lock);
+	spinlock_unlock(&kslock);
+
+	tlb_batch_flush(&batch);
+
+	/* Only the split of a large page is able to fail */
+	return ret;
+}
+
+int page_map_drop(void)
+{
+	void traverse(int lvl, long vpn) {
+		long stop;
+		for (stop=vpn+PAGE_MAP_ENTRIES; vpn<stop; vpn++) {
+			/* Tables of the kernel space are shared => skip them */
+			if (vpn < KERNEL_ENTRIES(lvl))
+				continue;
+
+			if ((self[lvl][vpn] & PG_PRESENT) && (self[lvl][vpn] & (PG_USER|PG_NONE))) {
+				/* Large page => release all of its page frames */
+				if (lvl && (self[lvl][vpn] & PG_PSE)) {
+					size_t n = 1L << (lvl * PAGE_MAP_BITS);
+
+					put_pages(self[lvl][vpn] & PAGE_MASK & ~((n << PAGE_BITS) - 1), n);
+					percpu_counter_sub(&current_task->user_usage, n);
+					continue;
+				}
+
+				/* Post-order traversal */
+				if (lvl)
+					traverse(lvl-1, vpn<<PAGE_MAP_BITS);
+
+				put_pages(self[lvl][vpn] & PAGE_MASK, 1);
+				percpu_counter_dec(&current_task->user_usage);
+			}
+		}
+	}
+
+	spinlock_irqsave_lock(&current_task->page_lock);
+
+	traverse(PAGE_LEVELS-1, 0);
+
+	spinlock_irqsave_unlock(&current_task->page_lock);
+
+	/* This can't fail because we don't make checks here */
+	return 0;
+}
+
+/** @brief Build the page map tree of a new task
+ *
+ * @param dest The new task
+ * @param user Inherit the user mappings copy-on-write
+ */
+static int page_map_clone(task_t *dest, int user)
+{
+	/* write-protected entries of the current task */
+	tlb_batch_t batch;
+
+	tlb_batch_init(&batch);
+
+	/* table: the table of the new task, which corresponds to self[lvl][vpn] */
+	int traverse(int lvl, long vpn, size_t* table) {
+		int ret;
+		long stop;
+		size_t entry;
+		size_t* dst;
+
+		for (stop=vpn+PAGE_MAP_ENTRIES; vpn<stop; vpn++) {
+			entry = self[lvl][vpn];
+			dst = &table[vpn & (PAGE_MAP_ENTRIES-1)];
+#ifdef CONFIG_X86_32
+			/* The boot PGD knows all kernel tables */
+			if ((lvl == PAGE_LEVELS-1) && (vpn < KERNEL_ENTRIES(lvl)))
+				entry = boot_map[vpn];
+#endif
+
+			if (!(entry & PG_PRESENT) || (entry & PG_SELF))
+				*dst = 0;
+			else if (vpn < KERNEL_ENTRIES(lvl))
+				/* Covers only kernel space => share the table or page */
+				*dst = entry;
+			else if (lvl && (entry & PG_PSE)) {
+				/* Large user page => share its page frames copy-on-write */
+				size_t i, n = 1L << (lvl * PAGE_MAP_BITS);
+				size_t phyaddr = entry & PAGE_MASK & ~((n << PAGE_BITS) - 1);
+
+				if (!user) {
+					*dst = 0;
+					continue;
+				}
+
+				for (i=0; i<n; i++)
+					page_ref(phyaddr + i*PAGE_SIZE);
+				percpu_counter_add(&dest->user_usage, n);
+
+				if (entry & PG_RW) {
+					entry = (entry & ~PG_RW) | PG_COW;
+					self[lvl][vpn] = entry;
+					tlb_batch_add(&batch, vpn << (lvl * PAGE_MAP_BITS + PAGE_BITS));
+				}
+
+				*dst = entry;
+			}
+			else if (lvl && ((((size_t) vpn << (lvl*PAGE_MAP_BITS+PAGE_BITS)) < KERNEL_SPACE) || (user && (entry & PG_USER)))) {
+				/* PML4, PDPT, PGD: covers (partly) user space => new table */
+				size_t phyaddr = get_pages(1);
+				if (BUILTIN_EXPECT(!phyaddr, 0)) {
+					*dst = 0;
+					ret = -ENOMEM;
+					goto fail;
+				}
+
+				page_frame_t* frame = get_frame(phyaddr);
+				if (frame)
+					frame->flags |= PF_PAGETABLE;
+
+				percpu_counter_inc(&dest->user_usage);
+
+				*dst = phyaddr | (entry & ~PAGE_MASK);
+
+#ifdef CONFIG_X86_64
+				size_t* child = (size_t*) phys_to_virt(phyaddr);
+#elif defined(CONFIG_X86_32)
+				size_t* child = &other[lvl-1][vpn << PAGE_MAP_BITS];
+#endif
+
+				ret = traverse(lvl-1, vpn<<PAGE_MAP_BITS, child); /* Pre-order traversal */
+				if (BUILTIN_EXPECT(ret, 0))
+					goto fail;
+
+				/* count the present entries of the new table */
+				if (frame) {
+					long i;
+
+					frame->entries = 0;
+					for (i=0; i<PAGE_MAP_ENTRIES; i++)
+						if (child[i] & PG_PRESENT)
+							frame->entries++;
+				}
+
+#ifdef CONFIG_X86_32
+				/* the new table is complete => drop its 'other' self-reference */
+				tlb_flush_one_page((size_t) child);
+#endif
+			}
+			else if (!(entry & (PG_USER|PG_NONE)))
+				*dst = entry;
+			else if (!user)
+				*dst = 0;
+			else if (page_ref(entry & PAGE_MASK) > 0) { /* PGT */
+				percpu_counter_inc(&dest->user_usage);
+
+				/* Share the page frame and copy it on the first write access */
+				if (entry & PG_RW) {
+					entry = (entry & ~PG_RW) | PG_COW;
+					self[lvl][vpn] = entry;
+					tlb_batch_add(&batch, vpn << PAGE_BITS);
+				}
+
+				*dst = entry;
+			}
+			else { /* PGT, page frame isn't managed => copy it */
+				size_t phyaddr = get_pages(1);
+				if (BUILTIN_EXPECT(!phyaddr, 0)) {
+					*dst = 0;
+					ret = -ENOMEM;
+					goto fail;
+				}
+
+				percpu_counter_inc(&dest->user_usage);
+
+				*dst = phyaddr | (entry & ~PAGE_MASK);
+
+				memcpy_page(page_frame_access(phyaddr), (void*) (vpn<<PAGE_BITS), PAGE_SIZE);
+			}
+		}
+		return 0;
+
+fail:
+		/* clear the remaining entries => page_map_release() is able to drop the partial tree */
+		while (++vpn < stop)
+			table[vpn & (PAGE_MAP_ENTRIES-1)] = 0;
+
+		return ret;
+	}
+
+	page_frame_t* frame = get_frame(dest->page_map);
+	if (frame)
+		frame->flags |= PF_PAGETABLE;
+
+	spinlock_irqsave_lock(&current_task->page_lock);
+#ifdef CONFIG_X86_64
+	/* the tables of the new task are accessed by the direct map */
+	size_t* root = (size_t*) phys_to_virt(dest->page_map);
+#elif defined(CONFIG_X86_32)
+	/* the tables of the new task are accessed by an other self-reference */
+	size_t* root = other[PAGE_LEVELS-1];
+
+	self[PAGE_LEVELS-1][PAGE_MAP_ENTRIES-2] = dest->page_map | PG_PRESENT | PG_SELF | PG_RW;
+#endif
+
+	int ret = traverse(PAGE_LEVELS-1, 0, root);
+
+	root[PAGE_MAP_ENTRIES-1] = dest->page_map | PG_PRESENT | PG_SELF | PG_RW;
+
+#ifdef CONFIG_X86_32
+	self[PAGE_LEVELS-1][PAGE_MAP_ENTRIES-2] = 0;
+
+	/* Flush the remaining TLB entry of the 'other' self-reference.
+	 * invlpg drops the paging-structure caches as well. A failed
+	 * traversal skips the flush of the tables in progress => flush all */
+	if (BUILTIN_EXPECT(ret, 0))
+		flush_tlb();
+	else
+		tlb_flush_one_page((size_t) root);
+#endif
+	spinlock_irqsave_unlock(&current_task->page_lock);
+
+	tlb_batch_flush(&batch);
+
+	/* The PCID of the new task might still tag entries of a previous task */
+#ifdef CONFIG_X86_64
+	if (has_pcid() && has_invpcid()) {
+		invpcid(INVPCID_SINGLE, dest->id, 0);
+		dest->tlb_gen = tlb_kernel_gen;
+	} else
+#endif
+	dest->tlb_gen = tlb_kernel_gen - 1; // outdated => the first activation flushes the PCID
+
+	return ret;
+}
+
+int page_map_copy(task_t *dest)
+{
+	return page_map_clone(dest, 1);
+}
+
+int page_map_create(task_t *dest)
+{
+	return page_map_clone(dest, 0);
+}
+
+/** @brief Release the user part of a page map tree, which isn't active
+ *
+ * The caller has to hold the page_lock of the current task. On x86_32,
+ * the tree has to be mapped by the 'other' self-reference.
+ */
+static void page_map_put_tree(int lvl, long vpn, size_t* table)
+{
+	long stop;
+	size_t entry;
+
+	for (stop=vpn+PAGE_MAP_ENTRIES; vpn<stop; vpn++) {
+		entry = table[vpn & (PAGE_MAP_ENTRIES-1)];
+
+		/* Tables of the kernel space are shared => skip them */
+		if (vpn < KERNEL_ENTRIES(lvl))
+			continue;
+
+		if (!(entry & PG_PRESENT) || (entry & PG_SELF) || !(entry & (PG_USER|PG_NONE)))
+			continue;
+
+		/* Large page => release all of its page frames */
+		if (lvl && (entry & PG_PSE)) {
+			size_t n = 1L << (lvl * PAGE_MAP_BITS);
+
+			put_pages(entry & PAGE_MASK & ~((n << PAGE_BITS) - 1), n);
+			continue;
+		}
+
+		/* Post-order traversal */
+		if (lvl) {
+#ifdef CONFIG_X86_64
+			page_map_put_tree(lvl-1, vpn<<PAGE_MAP_BITS, (size_t*) phys_to_virt(entry & PAGE_MASK));
+#elif defined(CONFIG_X86_32)
+			page_map_put_tree(lvl-1, vpn<<PAGE_MAP_BITS, &other[lvl-1][vpn << PAGE_MAP_BITS]);
+#endif
+		}
+
+		put_pages(entry & PAGE_MASK, 1);
+	}
+}
+
+int page_map_release(task_t *dest)
+{
+	if (BUILTIN_EXPECT(!dest || !dest->page_map || (dest == current_task), 0))
+		return -EINVAL;
+
+	spinlock_irqsave_lock(&current_task->page_lock);
+#ifdef CONFIG_X86_64
+	page_map_put_tree(PAGE_LEVELS-1, 0, (size_t*) phys_to_virt(dest->page_map));
+#elif defined(CONFIG_X86_32)
+	self[PAGE_LEVELS-1][PAGE_MAP_ENTRIES-2] = dest->page_map | PG_PRESENT | PG_SELF | PG_RW;
+
+	page_map_put_tree(PAGE_LEVELS-1, 0, other[PAGE_LEVELS-1]);
+
+	/* drop all translations of the 'other' self-reference */
+	self[PAGE_LEVELS-1][PAGE_MAP_ENTRIES-2] = 0;
+	flush_tlb();
+#endif
+	spinlock_irqsave_unlock(&current_task->page_lock);
+
+	put_page(dest->page_map);
+	dest->page_map = 0;
+
+	return 0;
+}
+
+/** @brief Map a zeroed page to an anonymous VMA (e.g. the user-level stack)
+ *
+ * @return
+ * - 0 on success
+ * - -EINVAL if the address isn't part of an anonymous VMA
+ * - -ENOMEM on failure
+ */
+static int page_fault_anon(size_t viraddr)
+{
+	task_t* task = current_task;
+	size_t bits = PG_USER;
+	vma_t* vma;
+	int ret;
+
+	viraddr &= PAGE_MASK;
+
+	spinlock_lock(&task->vma_lock);
+
+	vma = vma_find(task, viraddr);
+	if (BUILTIN_EXPECT(!vma || vma->node || (vma->flags & VMA_NO_ACCESS), 0)) {
+		if (vma && (vma->flags & VMA_NO_ACCESS))
+			kprintf("Access to guard page %#lx (stack overflow?), task = %u\n", viraddr, task->id);
+		ret = -EINVAL;
+		goto out;
+	}
+
+#ifdef CONFIG_X86_64
+	if (has_nx() && !(vma->flags & VMA_EXECUTE))
+		bits |= PG_XD;
+#endif
+
+	ret = page_populate(viraddr, 1, bits);
+	if (!ret && !(vma->flags & VMA_WRITE))
+		ret = page_map(viraddr, virt_to_phys(viraddr), 1, bits);
+
+out:
+	spinlock_unlock(&task->vma_lock);
+
+	return ret;
+}
+
+/** @brief Resolve a write access to a copy-on-write page
+ *
+ * If the current task is the last user of the page frame,
+ * it becomes the owner. Otherwise, the page is copied.
+ * Pages of shared writable VMAs are made writable in place.
+ *
+ * @return
+ * - 0 on success
+ * - -EINVAL if the page isn't a copy-on-write page
+ * - -ENOMEM on failure
+ */
+static int page_fault_cow(size_t viraddr)
+{
+	task_t* task = current_task;
+	size_t vpn = viraddr >> PAGE_BITS;
+	size_t entry, phyaddr, newaddr;
+	size_t* leaf;
+	page_frame_t* frame;
+	tlb_batch_t batch;
+	vma_t* vma;
+	int lvl, ret = 0;
+
+	tlb_batch_init(&batch);
+
+	spinlock_lock(&task->vma_lock);
+	spinlock_irqsave_lock(&task->page_lock);
+
+	vma = vma_find(task, viraddr);
+
+	/* copy-on-write works page-wise => split a large page */
+	while ((leaf = page_leaf(viraddr, &lvl)) && lvl && (*leaf & PG_COW)) {
+		ret = page_split(&batch, lvl, viraddr >> (lvl * PAGE_MAP_BITS + PAGE_BITS));
+		if (BUILTIN_EXPECT(ret, 0))
+			goto out;
+	}
+
+	if (BUILTIN_EXPECT(!leaf || lvl || !(*leaf & PG_COW), 0)) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	entry = *leaf;
+
+	phyaddr = entry & PAGE_MASK;
+	frame = get_frame(phyaddr);
+
+	if (vma && ((vma->flags & (VMA_SHARED|VMA_WRITE|VMA_MAYWRITE)) == (VMA_SHARED|VMA_WRITE|VMA_MAYWRITE))) {
+		/* Changes of a shared mapping are visible to all users (e.g. after fork) */
+		self[0][vpn] = (entry & ~PG_COW) | PG_RW;
+		if (vma->node)
+			vma->node->generation++;
+	} else if (frame && !(frame->flags & PF_PINNED) && (atomic_int32_read(&frame->count) == 1)) {
+		/* The other users are gone => reclaim ownership */
+		frame->owner = task->id;
+		self[0][vpn] = (entry & ~PG_COW) | PG_RW;
+	} else {
+		newaddr = get_page();
+		if (BUILTIN_EXPECT(!newaddr, 0)) {
+			ret = -ENOMEM;
+			goto out;
+		}
+
+		/* Copy only the touched page */
+		memcpy(page_frame_access(newaddr), (void*) (vpn << PAGE_BITS), PAGE_SIZE);
+
+		self[0][vpn] = newaddr | (entry & ~(PAGE_MASK|PG_COW)) | PG_RW;
+		tlb_batch_free(&batch, phyaddr, 1);
+	}
+
+	tlb_batch_add(&batch, vpn << PAGE_BITS);
+
+out:
+	spinlock_irqsave_unlock(&task->page_lock);
+	spinlock_unlock(&task->vma_lock);
+
+	tlb_batch_flush(&batch);
+
+	return ret;
+}
+
+int page_map_file(size_t viraddr)
+{
+	task_t* task = current_task;
+	fildes_t file;
+	vma_t* vma;
+	size_t phyaddr, size, pos, bits = PG_USER;
+	off_t off;
+	ssize_t len;
+	int zeroed, shared, ret = 0;
+
+	viraddr &= PAGE_MASK;
+
+	spinlock_lock(&task->vma_lock);
+
+	vma = vma_find(task, viraddr);
+	if (BUILTIN_EXPECT(!vma || !vma->node || (vma->flags & VMA_NO_ACCESS), 0)) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	// already mapped (e.g. by madvise())
+	if (page_present(viraddr))
+		goto out;
+
+#ifdef CONFIG_X86_64
+	if (has_nx() && !(vma->flags & VMA_EXECUTE))
+		bits |= PG_XD;
+#endif
+
+	off = viraddr - vma->start;
+	shared = (vma->flags & (VMA_SHARED|VMA_WRITE|VMA_MAYWRITE)) == (VMA_SHARED|VMA_WRITE|VMA_MAYWRITE);
+
+	/* zero-copy: share the page of the file system */
+	if ((off + PAGE_SIZE <= vma->file_size) || ((vma->flags & VMA_SHARED) && (off < vma->file_size))) {
+		size_t addr = getpage_fs(vma->node, vma->offset + off);
+
+		if (addr && (page_ref(virt_to_phys(addr)) > 0)) {
+			if (shared) {
+				/* the file might be changed => outdates the image cache */
+				bits |= PG_RW;
+				vma->node->generation++;
+			} else if (vma->flags & VMA_WRITE)
+				bits |= PG_COW;
+
+			ret = page_map(viraddr, virt_to_phys(addr), 1, bits);
+			if (BUILTIN_EXPECT(ret, 0))
+				put_page(virt_to_phys(addr));
+			else
+				percpu_counter_inc(&task->user_usage);
+
+			goto out;
+		}
+	}
+
+	/* a private copy would hide the changes from the other users */
+	if (BUILTIN_EXPECT(shared && (off < vma->file_size), 0)) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	/* read-only page of an other instance of the same executable */
+	if (!(vma->flags & VMA_WRITE)) {
+		phyaddr = image_getpage(vma, viraddr);
+		if (phyaddr) {
+			ret = page_map(viraddr, phyaddr, 1, bits);
+			if (BUILTIN_EXPECT(ret, 0))
+				put_page(phyaddr);
+			else
+				percpu_counter_inc(&task->user_usage);
+
+			goto out;
+		}
+	}
+
+	phyaddr = get_zeroed_page(&zeroed);
+	if (BUILTIN_EXPECT(!phyaddr, 0)) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	ret = page_map(viraddr, phyaddr, 1, bits|PG_RW);
+	if (BUILTIN_EXPECT(ret, 0)) {
+		put_page(phyaddr);
+		goto out;
+	}
+
+	if (!zeroed)
+		memset((void*) viraddr, 0x00, PAGE_SIZE);
+
+	/* copy the file content behind the page offset */
+	file.node = vma->node;
+	file.offset = vma->offset + off;
+	file.flags = 0;
+
+	size = (vma->file_size > off) ? vma->file_size - off : 0;
+	if (size > PAGE_SIZE)
+		size = PAGE_SIZE;
+
+	for (pos=0; pos<size; pos+=len) {
+		len = read_fs(&file, (uint8_t*) viraddr + pos, size - pos);
+		if (BUILTIN_EXPECT(len <= 0, 0))
+			break;
+	}
+
+	percpu_counter_inc(&task->user_usage);
+
+	if (!(vma->flags & VMA_WRITE)) {
+		ret = page_map(viraddr, phyaddr, 1, bits);
+
+		/* share the page with further instances of the executable,
+		 * but only if it isn't longer writable */
+		if (!ret)
+			image_setpage(vma, viraddr, phyaddr);
+	}
+
+out:
+	spinlock_unlock(&task->vma_lock);
+
+	return ret;
+}
+
+void page_fault_handler(struct state *s)
+{
+	size_t viraddr = read_cr2();
+	task_t* task = current_task;
+
+#ifdef CONFIG_X86_32
+	// kernel table was created in an other address space => synchronize PGD
+	size_t idx = viraddr >> (PAGE_MAP_BITS + PAGE_BITS);
+	if (!(s->error & 0x1) && (idx < KERNEL_ENTRIES(PAGE_LEVELS-1)) &&
+	    !(self[PAGE_LEVELS-1][idx] & PG_PRESENT) && (boot_map[idx] & PG_PRESENT)) {
+		self[PAGE_LEVELS-1][idx] = boot_map[idx];
+		return;
+	}
+#endif
+
+	// write access to a present page => copy-on-write?
+	if (((s->error & 0x3) == 0x3) && !page_fault_cow(viraddr))
+		return;
+
+	// on demand userspace heap mapping
+	if (!(s->error & 0x1) && (task->heap) && (viraddr >= task->heap->start) && (viraddr < task->heap->end)) {
+		/* a large page, if its whole region belongs to the heap */
+		size_t start = viraddr & ~(PAGE_HUGE_SIZE-1);
+		size_t end = start + PAGE_HUGE_SIZE;
+
+		if ((start >= task->heap->start) && (end <= PAGE_FLOOR(task->heap->end)) && !page_fault_huge(start))
+			return;
+
+		/* fault-around: map the surrounding window of the heap as well */
+		start = viraddr & ~(HEAP_FAULT_AROUND*PAGE_SIZE-1);
+		end = start + HEAP_FAULT_AROUND*PAGE_SIZE;
+
+		if (start < task->heap->start)
+			start = task->heap->start;
+		if (end > PAGE_FLOOR(task->heap->end))
+			end = PAGE_FLOOR(task->heap->end);
+
+		int ret = page_populate(start, (end - start) >> PAGE_BITS, PG_USER);
+		if (BUILTIN_EXPECT(ret, 0) && !page_present(viraddr)) {
+			kprintf("out of memory: task = %u\n", task->id);
+			goto default_handler;
+		}
+
+		return;
+	}
+
+	// on demand mapping of file-backed areas (e.g. program segments)
+	if (!(s->error & 0x1) && (viraddr >= VMA_USER_MIN) && !page_map_file(viraddr))
+		return;
+
+	// on demand mapping of anonymous areas (e.g. the user-level stack)
+	if (!(s->error & 0x1) && (viraddr >= VMA_USER_MIN) && !page_fault_anon(viraddr))
+		return;
+
+default_handler:
+#ifdef CONFIG_X86_32
+	kprintf("Page Fault Exception (%d) at cs:ip = %#x:%#lx, task = %u, addr = %#lx, error = %#x [ %s %s %s %s %s ]\n",
+		s->int_no, s->cs, s->eip, current_task->id, viraddr, s->error,
+		(s->error & 0x4) ? "user" : "supervisor",
+		(s->error & 0x10) ? "instruction" : "data",
+		(s->error & 0x2) ? "write" : ((s->error & 0x10) ? "fetch" : "read"),
+		(s->error & 0x1) ? "protection" : "not present",
 		(s->error & 0x8) ? "reserved bit" : "\b");
 #elif defined(CONFIG_X86_64)
 	kprintf("Page Fault Exception (%d) at cs:ip = %#x:%#lx, task = %u, addr = %#lx, error = %#x [ %s %s %s %s %s ]\n",
@@ -314,6 +1577,102 @@ default_handler:
 	while(1) HALT;
 }
 
+int page_map_phys(size_t size)
+{
+#ifdef CONFIG_X86_64
+	/* indices within the windows of the self-reference (without sign extension) */
+	long vpn = (PHYS_MAP & ((1UL << VIRT_BITS) - 1)) >> PAGE_BITS;
+	long pdpt = vpn >> (2 * PAGE_MAP_BITS);
+	size_t bits = PG_PRESENT|PG_RW|PG_GLOBAL|PG_PSE;
+	size_t step = 1UL << (2 * PAGE_MAP_BITS + PAGE_BITS);
+	size_t phyaddr, base, addr, ram, i, j, k, n;
+	size_t* pde;
+	int ret = 0;
+
+	if (size > PHYS_MAP_SIZE)
+		size = PHYS_MAP_SIZE;
+	n = (size + step - 1) / step;
+
+	if (has_nx())
+		bits |= PG_XD;
+
+	spinlock_lock(&kslock);
+
+	phyaddr = get_pages(1);
+	if (BUILTIN_EXPECT(!phyaddr, 0)) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	/* Without PG_USER, page_map_copy() shares the entry and
+	 * page_map_drop() doesn't release the tables. */
+	self[PAGE_LEVELS-1][vpn >> (3 * PAGE_MAP_BITS)] = phyaddr | PG_PRESENT | PG_RW;
+	memset(&self[2][pdpt], 0x00, PAGE_SIZE);
+
+	/*
+	 * Only RAM is mapped. A write-back alias of a hole (e.g. the video
+	 * memory or the MMIO of a device) would conflict with the memory
+	 * type of its own mapping. Large pages, which cover a hole partly,
+	 * are replaced by 4 KiB pages.
+	 */
+	for (i=0; i<n; i++) {
+		base = i * step;
+		ram = phys_ram_size(base, base + step);
+		if (!ram)
+			continue;
+
+		if (has_1gbhp() && (ram == step)) {
+			self[2][pdpt+i] = base | bits;
+			continue;
+		}
+
+		phyaddr = get_pages(1);
+		if (BUILTIN_EXPECT(!phyaddr, 0)) {
+			ret = -ENOMEM;
+			goto out;
+		}
+
+		self[2][pdpt+i] = phyaddr | PG_PRESENT | PG_RW;
+		for (j=0; j<PAGE_MAP_ENTRIES; j++) {
+			addr = base + j * PAGE_HUGE_SIZE;
+			pde = &self[1][((pdpt+i) << PAGE_MAP_BITS) + j];
+
+			ram = phys_ram_size(addr, addr + PAGE_HUGE_SIZE);
+			if (ram == PAGE_HUGE_SIZE) {
+				*pde = addr | bits;
+				continue;
+			}
+
+			*pde = 0;
+			if (!ram)
+				continue;
+
+			phyaddr = get_pages(1);
+			if (BUILTIN_EXPECT(!phyaddr, 0)) {
+				ret = -ENOMEM;
+				goto out;
+			}
+
+			*pde = phyaddr | PG_PRESENT | PG_RW;
+			for (k=0; k<PAGE_MAP_ENTRIES; k++, addr+=PAGE_SIZE) {
+				/* PG_PSE is the PAT bit of a 4 KiB page */
+				if (phys_ram_size(addr, addr + PAGE_SIZE) == PAGE_SIZE)
+					self[0][(((pdpt+i) << PAGE_MAP_BITS) + j) * PAGE_MAP_ENTRIES + k] = addr | (bits & ~PG_PSE);
+				else
+					self[0][(((pdpt+i) << PAGE_MAP_BITS) + j) * PAGE_MAP_ENTRIES + k] = 0;
+			}
+		}
+	}
+
+out:
+	spinlock_unlock(&kslock);
+
+	return ret;
+#elif defined(CONFIG_X86_32)
+	return 0;
+#endif
+}
+
 int page_init(void)
 {
 	size_t addr, npages;
@@ -340,7 +1699,7 @@ int page_init(void)
 			for(i=0; i<mb_info->mods_count; i++) {
 				addr = mmodule[i].mod_start;
 				npages = PAGE_FLOOR(mmodule[i].mod_end - mmodule[i].mod_start) >> PAGE_BITS;
-				page_map(addr, addr, npages, PG_GLOBAL);
+				page_map(addr, addr, npages, PG_GLOBAL|PG_RW);
 				kprintf("Map modules at 0x%lx\n", addr);
 			}
 		}
@@ -0,0 +1,327 @@
+/*
+ * Copyright (c) eduOS contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the University nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * @file arch/x86/mm/tlb.c
+ * @brief Batched TLB shootdowns
+ */
+
+#include <eduos/stdio.h>
+#include <eduos/tasks.h>
+#include <eduos/memory.h>
+#include <eduos/errno.h>
+#include <asm/irq.h>
+#include <asm/apic.h>
+#include <asm/page.h>
+#include <asm/tlb.h>
+
+#if MAX_CORES > 32
+#error "The CPU mask of an address space is limited to 32 cores"
+#endif
+
+extern uint32_t tlb_kernel_gen;
+
+/** Batches, which changed at least one page */
+atomic_int32_t tlb_batches = ATOMIC_INIT(0);
+/** Batches, which had to notify other cores */
+atomic_int32_t tlb_shootdowns = ATOMIC_INIT(0);
+/** Sent shootdown IPIs */
+atomic_int32_t tlb_ipis = ATOMIC_INIT(0);
+/** Cycles, which the initiators waited for the acknowledgements */
+uint64_t tlb_shootdown_cycles = 0;
+/** Longest shootdown in cycles */
+uint64_t tlb_shootdown_max = 0;
+
+#if MAX_CORES > 1
+/** @brief Drop all TLB entries including the global ones */
+static inline void flush_tlb_global(void)
+{
+	size_t cr4 = read_cr4();
+
+	if (cr4 & CR4_PGE) {
+		write_cr4(cr4 & ~CR4_PGE);
+		write_cr4(cr4);
+	} else flush_tlb();
+}
+
+/** @brief Apply a batch to the TLB of the current core */
+static void tlb_invalidate(tlb_batch_t* batch)
+{
+	size_t addr;
+	uint32_t i;
+
+	if (batch->npages <= TLB_BATCH_PAGES) {
+		for (i=0; i<batch->npages; i++)
+			tlb_flush_one_page(batch->pages[i]);
+	} else if (((batch->end - batch->start) >> PAGE_BITS) > TLB_FLUSH_CEILING) {
+		/* kernel pages are global and survive a reload of CR3 */
+		if (batch->kernel)
+			flush_tlb_global();
+		else
+			flush_tlb();
+	} else {
+		for (addr=batch->start; addr<batch->end; addr+=PAGE_SIZE)
+			tlb_flush_one_page(addr);
+	}
+}
+
+/** Cores, which receive shootdowns of the kernel space */
+static volatile uint32_t tlb_online = 0;
+/** Address space, which is currently used by each core */
+static task_t* tlb_active[MAX_CORES] = {[0 ... MAX_CORES-1] = NULL};
+/** Signalizes a pending request to each core */
+static volatile uint8_t tlb_todo[MAX_CORES] = {[0 ... MAX_CORES-1] = 0};
+/** The batch, which is currently shot down */
+static tlb_batch_t* volatile tlb_request = NULL;
+/** Number of cores, which didn't acknowledge the current request */
+static atomic_int32_t tlb_acks = ATOMIC_INIT(0);
+/** Serializes the initiators of shootdowns */
+static atomic_int32_t tlb_busy = ATOMIC_INIT(0);
+
+static inline void cpu_mask_set(volatile uint32_t* mask, uint32_t core)
+{
+	asm volatile (LOCK "orl %1, %0" : "+m" (*mask) : "r" (1 << core) : "memory");
+}
+
+static inline void cpu_mask_clear(volatile uint32_t* mask, uint32_t core)
+{
+	asm volatile (LOCK "andl %1, %0" : "+m" (*mask) : "r" (~(1 << core)) : "memory");
+}
+
+/** @brief Acknowledge a pending request to the current core */
+static void tlb_service(uint32_t core)
+{
+	if (!tlb_todo[core])
+		return;
+
+	tlb_todo[core] = 0;
+	tlb_invalidate(tlb_request);
+	atomic_int32_dec(&tlb_acks);
+}
+
+static void tlb_handler(struct state* s)
+{
+	uint32_t core = current_core;
+
+	if (BUILTIN_EXPECT(core < MAX_CORES, 1))
+		tlb_service(core);
+}
+
+/** @brief Send a batch to the other cores and wait for their acknowledgements */
+static void tlb_shootdown(tlb_batch_t* batch)
+{
+	uint32_t core = current_core;
+	uint32_t targets, i, n = 0;
+	uint64_t start, cycles;
+
+	if (BUILTIN_EXPECT(core >= MAX_CORES, 0))
+		return;
+
+#ifdef CONFIG_X86_64
+	/* Cores, which ran the address space before, might still hold
+	 * entries tagged by its PCID => the next activation flushes them */
+	if (has_pcid() && !batch->kernel)
+		batch->task->tlb_gen = tlb_kernel_gen - 1;
+#endif
+	/* the changed entries have to be visible before the CPU mask is read */
+	mb();
+
+	if (batch->kernel)
+		targets = tlb_online;
+	else
+		targets = batch->task->cpu_mask & tlb_online;
+	targets &= ~(1 << core);
+
+	if (!targets)
+		return;
+
+	start = rdtsc();
+
+	/* An other initiator might wait for this core.
+	 * Therefore, its requests are served while spinning. */
+	while (atomic_int32_test_and_set(&tlb_busy, 1)) {
+		tlb_service(core);
+		PAUSE;
+	}
+
+	/* a core without a known APIC ID isn't able to receive the IPI */
+	for (i=0; i<MAX_CORES; i++) {
+		if (!(targets & (1 << i)))
+			continue;
+
+		if (BUILTIN_EXPECT(apic_core_id(i) < 0, 0))
+			targets &= ~(1 << i);
+		else
+			n++;
+	}
+
+	tlb_request = batch;
+	atomic_int32_set(&tlb_acks, n);
+
+	for (i=0; i<MAX_CORES; i++) {
+		if (!(targets & (1 << i)))
+			continue;
+
+		tlb_todo[i] = 1;
+		apic_send_ipi(apic_core_id(i), TLB_SHOOTDOWN_IRQ);
+	}
+
+	/* as above, this core never waits without serving its requests */
+	while (atomic_int32_read(&tlb_acks)) {
+		tlb_service(core);
+		PAUSE;
+	}
+
+	cycles = rdtsc() - start;
+	tlb_shootdown_cycles += cycles;
+	if (cycles > tlb_shootdown_max)
+		tlb_shootdown_max = cycles;
+
+	tlb_request = NULL;
+	atomic_int32_set(&tlb_busy, 0);
+
+	atomic_int32_inc(&tlb_shootdowns);
+	atomic_int32_add(&tlb_ipis, n);
+}
+#endif
+
+void tlb_batch_init(tlb_batch_t* batch)
+{
+	batch->task = current_task;
+	batch->start = batch->end = 0;
+	batch->npages = 0;
+	batch->kernel = 0;
+	batch->nframes = 0;
+}
+
+void tlb_batch_add(tlb_batch_t* batch, size_t viraddr)
+{
+	viraddr &= PAGE_MASK;
+	tlb_flush_one_page(viraddr);
+
+	if (viraddr < KERNEL_SPACE)
+		batch->kernel = 1;
+
+	if (!batch->npages || (viraddr < batch->start))
+		batch->start = viraddr;
+	if (!batch->npages || (viraddr + PAGE_SIZE > batch->end))
+		batch->end = viraddr + PAGE_SIZE;
+
+	if (batch->npages < TLB_BATCH_PAGES)
+		batch->pages[batch->npages] = viraddr;
+	batch->npages++;
+}
+
+void tlb_batch_range(tlb_batch_t* batch, size_t viraddr, size_t npages)
+{
+	size_t i;
+
+	viraddr &= PAGE_MASK;
+
+	if (npages <= TLB_FLUSH_CEILING) {
+		for (i=0; i<npages; i++)
+			tlb_batch_add(batch, viraddr + i*PAGE_SIZE);
+		return;
+	}
+
+	flush_tlb();
+
+	if (!batch->npages || (viraddr < batch->start))
+		batch->start = viraddr;
+	if (!batch->npages || (viraddr + npages*PAGE_SIZE > batch->end))
+		batch->end = viraddr + npages*PAGE_SIZE;
+
+	/* exceeds the list => the remote cores flush the range */
+	batch->npages += npages;
+}
+
+void tlb_batch_free(tlb_batch_t* batch, size_t phyaddr, size_t npages)
+{
+	if (batch->nframes >= TLB_BATCH_FRAMES)
+		tlb_batch_flush(batch);
+
+	batch->frames[batch->nframes].phyaddr = phyaddr;
+	batch->frames[batch->nframes].npages = npages;
+	batch->nframes++;
+}
+
+int tlb_batch_full(tlb_batch_t* batch)
+{
+	return batch->nframes + TLB_BATCH_STEP > TLB_BATCH_FRAMES;
+}
+
+void tlb_batch_flush(tlb_batch_t* batch)
+{
+	uint32_t i;
+
+	if (batch->npages) {
+		atomic_int32_inc(&tlb_batches);
+#if MAX_CORES > 1
+		tlb_shootdown(batch);
+#endif
+	}
+
+	/* no core is able to access the page frames anymore */
+	for (i=0; i<batch->nframes; i++)
+		put_pages(batch->frames[i].phyaddr, batch->frames[i].npages);
+
+	batch->start = batch->end = 0;
+	batch->npages = 0;
+	batch->kernel = 0;
+	batch->nframes = 0;
+}
+
+void tlb_switch(task_t* task)
+{
+#if MAX_CORES > 1
+	uint32_t core = current_core;
+
+	if (BUILTIN_EXPECT(core >= MAX_CORES, 0))
+		return;
+
+	if (tlb_active[core] && (tlb_active[core] != task))
+		cpu_mask_clear(&tlb_active[core]->cpu_mask, core);
+
+	cpu_mask_set(&task->cpu_mask, core);
+	tlb_active[core] = task;
+#endif
+}
+
+int tlb_init(void)
+{
+#if MAX_CORES > 1
+	uint32_t core = current_core;
+
+	if (BUILTIN_EXPECT(core >= MAX_CORES, 0))
+		return -EINVAL;
+
+	irq_install_handler(TLB_SHOOTDOWN_IRQ, tlb_handler);
+	cpu_mask_set(&tlb_online, core);
+#endif
+
+	return 0;
+}
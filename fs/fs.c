@@ -68,6 +68,22 @@ ssize_t write_fs(fildes_t* file, uint8_t* buffer, size_t size)
 	return ret;
 }
 
+size_t getpage_fs(vfs_node_t* node, off_t offset)
+{
+	size_t ret = 0;
+
+	if (BUILTIN_EXPECT(!node || (offset & (PAGE_SIZE-1)), 0))
+		return ret;
+
+	spinlock_lock(&node->lock);
+	// Has the node got a getpage callback?
+	if (node->getpage != 0)
+		ret = node->getpage(node, offset);
+	spinlock_unlock(&node->lock);
+
+	return ret;
+}
+
 int open_fs(fildes_t* file, const char* name)
 {
 	uint32_t ret = 0, i, j = 1;
@@ -134,6 +150,24 @@ int close_fs(fildes_t* file)
 	return ret;
 }
 
+int put_fildes(fildes_t* file)
+{
+	int ret = 0;
+
+	if (BUILTIN_EXPECT(!file, 0))
+		return -EINVAL;
+
+	// other tasks (e.g. forked children) still use the file
+	if (atomic_int32_dec(&file->count) > 0)
+		return 0;
+
+	if (file->node && file->node->close)
+		ret = close_fs(file);
+	kfree(file);
+
+	return ret;
+}
+
 struct dirent* readdir_fs(vfs_node_t * node, uint32_t index)
 {
 	struct dirent* ret = NULL;
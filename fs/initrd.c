@@ -108,6 +108,50 @@ static ssize_t initrd_read(fildes_t* file, uint8_t* buffer, size_t size)
 	return size;
 }
 
+/*
+ * The files of a module are stored in one contiguous data block,
+ * which is mapped into the kernel space. Consequently, a page of
+ * the file can be used in place if it is page aligned.
+ */
+static size_t initrd_getpage(vfs_node_t* node, off_t offset)
+{
+	size_t addr = (size_t) node->block_list.data[0];
+
+	if (BUILTIN_EXPECT(!addr || (offset + PAGE_SIZE > node->block_size), 0))
+		return 0;
+
+	addr += offset;
+	if ((addr & (PAGE_SIZE-1)) != 0)
+		return 0;
+
+	return addr;
+}
+
+/*
+ * The data blocks of files, which are created at runtime, are
+ * allocated page-wise. Consequently, each block can be mapped
+ * in place (e.g. by a shared mapping).
+ */
+static size_t ramfs_getpage(vfs_node_t* node, off_t offset)
+{
+	block_list_t* blist = &node->block_list;
+	uint32_t pos = offset / MAX_DATAENTRIES;
+
+	if (BUILTIN_EXPECT(offset >= node->block_size, 0))
+		return 0;
+
+	/* the data blocks are allocated without holes */
+	while (blist && (pos >= MAX_DATABLOCKS)) {
+		pos -= MAX_DATABLOCKS;
+		blist = blist->next;
+	}
+
+	if (BUILTIN_EXPECT(!blist, 0))
+		return 0;
+
+	return (size_t) blist->data[pos];
+}
+
 static ssize_t initrd_emu_readdir(fildes_t* file, uint8_t* buffer, size_t size)
 {
 	vfs_node_t* node = file->node;
@@ -173,7 +217,7 @@ static ssize_t initrd_write(fildes_t* file, uint8_t* buffer, size_t size)
 				size = MAX_DATAENTRIES - offset;
 			if(!blist->data[i]) { 
 				blist->data[i] = (data_block_t*) 
-					kmalloc(sizeof(data_block_t));
+					palloc(sizeof(data_block_t), 0);
 				if (blist->data[i])
 					memset(blist->data[i], 0x00, 
 						sizeof(data_block_t));
@@ -205,6 +249,7 @@ static ssize_t initrd_write(fildes_t* file, uint8_t* buffer, size_t size)
          */
 	memcpy(data + offset, buffer, size);
 	file->offset += size;
+	node->generation++;
 	return size;
 }
 
@@ -214,8 +259,11 @@ static int initrd_open(fildes_t* file, const char* name)
 		if ((file->flags & O_CREAT) && (file->flags & O_EXCL)) 
 			return -EEXIST;
 		
-		/* in the case of O_TRUNC kfree all the nodes */
-		if (file->flags & O_TRUNC) {
+		/*
+		 * in the case of O_TRUNC free all the data blocks,
+		 * the files of a module are truncated in place
+		 */
+		if ((file->flags & O_TRUNC) && (file->node->getpage == ramfs_getpage)) {
 			uint32_t i;
 			char* data = NULL;
 			block_list_t* blist = &file->node->block_list;
@@ -224,7 +272,8 @@ static int initrd_open(fildes_t* file, const char* name)
 			/* the first blist pointer have do remain valid. */
 			for(i=0; i<MAX_DATABLOCKS && !data; i++) {
 				if (blist->data[i]) {
-					kfree(blist->data[i]);
+					pfree(blist->data[i], sizeof(data_block_t));
+					blist->data[i] = NULL;
 				}
 			}
 			if (blist->next) {
@@ -236,7 +285,7 @@ static int initrd_open(fildes_t* file, const char* name)
 				do {
 					for(i=0; i<MAX_DATABLOCKS && !data; i++) {
 						if (blist->data[i]) {
-							kfree(blist->data[i]);
+							pfree(blist->data[i], sizeof(data_block_t));
 						}
 					}
 					lastblist = blist;
@@ -247,6 +296,10 @@ static int initrd_open(fildes_t* file, const char* name)
 
 			/* reset the block_size */
 			file->node->block_size = 0;
+			file->node->generation++;
+		} else if (file->flags & O_TRUNC) {
+			file->node->block_size = 0;
+			file->node->generation++;
 		}
 	}
 
@@ -276,6 +329,7 @@ static int initrd_open(fildes_t* file, const char* name)
 		new_node->read = initrd_read;
 		new_node->write = initrd_write;
 		new_node->open = initrd_open;
+		new_node->getpage = ramfs_getpage;
 		spinlock_init(&new_node->lock);
 
 		/* create a entry for the new node in the directory block of current node */
@@ -524,6 +578,7 @@ int initrd_init(void)
 			new_node->read = initrd_read;
 			new_node->write = initrd_write;
 			new_node->open = initrd_open;
+			new_node->getpage = initrd_getpage;
 			new_node->block_size = file_desc->length;
 			new_node->block_list.data[0] = ((char*) header) + file_desc->offset;
 			spinlock_init(&new_node->lock);
@@ -36,6 +36,7 @@
 
 #include <eduos/stddef.h>
 #include <eduos/spinlock_types.h>
+#include <asm/atomic.h>
 
 #define FS_FILE		0x01
 #define FS_DIRECTORY	0x02
@@ -114,6 +115,8 @@ typedef struct dirent *(*readdir_type_t) (struct vfs_node *, uint32_t);
 typedef struct vfs_node *(*finddir_type_t) (struct vfs_node *, const char *name);
 /** @brief Make directory function pointer */
 typedef struct vfs_node *(*mkdir_type_t) (struct vfs_node *, const char *name);
+/** @brief Get page function pointer */
+typedef size_t (*getpage_type_t) (struct vfs_node *, off_t);
 
 /** @} */
 
@@ -153,12 +156,16 @@ typedef struct vfs_node {
 	finddir_type_t finddir;
 	/// Make dir handler function pointer
 	mkdir_type_t mkdir;
+	/// Get page handler function pointer
+	getpage_type_t getpage;
 	/// Lock variable to thread-protect this structure
 	spinlock_t lock;
 	/// Block size
 	size_t block_size;
 	/// List of blocks
 	block_list_t block_list;
+	/// Incremented by each change of the content (write, truncate, writable shared mapping)
+	uint32_t generation;
 } vfs_node_t;
 
 /** @brief file descriptor structure */
@@ -167,7 +174,7 @@ typedef struct fildes {
         off_t 		offset;		/*  */
 	int 		flags;		/*  */
 	int 		mode;		/*  */
-	int 		count;		/* number of tasks using this fd */
+	atomic_int32_t	count;		/* number of tasks using this fd */
 } fildes_t, *filp_t;
 
 /** @brief Directory entry structure */
@@ -244,12 +251,36 @@ ssize_t read_fs(fildes_t* file, uint8_t* buffer, size_t size);
  */
 ssize_t write_fs(fildes_t* file, uint8_t* buffer, size_t size);
 
+/** @brief Get the page, which holds the file content at offset
+ *
+ * The file content is used in place (e.g. the init ram disk).
+ * Changes of the page are visible to all users of the file.
+ *
+ * @param node The file
+ * @param offset Page aligned file offset
+ * @return
+ * - kernel address of the page
+ * - 0 if the file system isn't able to provide the page
+ */
+size_t getpage_fs(vfs_node_t* node, off_t offset);
+
 /** @brief Yet to be documented */
 int open_fs(fildes_t* file, const char* fname);
 
 /** @brief Yet to be documented */
 int close_fs(fildes_t * file);
 
+/** @brief Drop a reference of a file descriptor
+ *
+ * The file is closed and the descriptor is released with the last reference.
+ *
+ * @param file File descriptor, which was allocated by kmalloc()
+ * @return
+ * - 0 on success
+ * - -EINVAL (-22) on failure
+ */
+int put_fildes(fildes_t* file);
+
 /** @brief Get dir entry at index
  * @param node VFS node to get dir entry from
  * @param index Index position of desired dir entry
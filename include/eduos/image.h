@@ -0,0 +1,140 @@
+/*
+ * Copyright (c) eduOS contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the University nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * @file include/eduos/image.h
+ * @brief Cache of executable images
+ *
+ * The cache keeps the parsed program headers of recently loaded
+ * executables. Further instances of the same executable are set up
+ * without parsing the ELF file again. The page frames of non-writable
+ * segments are shared between all instances.
+ */
+
+#ifndef __IMAGE_H__
+#define __IMAGE_H__
+
+#include <eduos/stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Maximal number of cached executables
+#define MAX_IMAGES		8
+/// Maximal number of loadable segments per executable
+#define MAX_SEGMENTS		8
+
+struct vfs_node;
+struct vma;
+
+/** @brief A loadable segment of an executable */
+typedef struct image_segment {
+	/// Start address (page aligned)
+	size_t start;
+	/// End address (page aligned)
+	size_t end;
+	/// VMA flags
+	uint32_t flags;
+	/// File offset of the start address
+	off_t offset;
+	/// Number of bytes behind the start address, which are backed by the file
+	size_t file_size;
+	/// Shared page frames of a non-writable segment (or NULL)
+	size_t* frames;
+} image_segment_t;
+
+/** @brief A cached executable */
+typedef struct image {
+	/// Executable file (or NULL for an unused entry)
+	struct vfs_node* node;
+	/// Generation of the file at the time the image was parsed
+	uint32_t generation;
+	/// Entry point
+	size_t entry;
+	/// VMA flags of the user-level stack
+	uint32_t stack_flags;
+	/// Number of loadable segments
+	uint32_t nsegs;
+	/// Loadable segments
+	image_segment_t segs[MAX_SEGMENTS];
+	/// Time of the last use (for replacement)
+	uint32_t used;
+} image_t;
+
+/** @brief Search an executable in the image cache
+ *
+ * @param node Executable file
+ * @param image Receives a copy of the cached image
+ * @return
+ * - 0 on success
+ * - -ENOENT (-2) if the file isn't cached
+ */
+int image_lookup(struct vfs_node* node, image_t* image);
+
+/** @brief Insert a parsed executable into the image cache
+ *
+ * The least recently used entry is replaced if the cache is full.
+ *
+ * @param image Parsed executable
+ * @return
+ * - 0 on success
+ * - -EINVAL (-22) on failure
+ */
+int image_insert(const image_t* image);
+
+/** @brief Get the shared page frame of a non-writable segment
+ *
+ * The caller receives an additional reference of the frame.
+ *
+ * @param vma File-backed VMA of the current task
+ * @param viraddr Page aligned virtual address within the VMA
+ * @return
+ * - physical address of the page frame
+ * - 0 if the page isn't cached
+ */
+size_t image_getpage(struct vma* vma, size_t viraddr);
+
+/** @brief Register the page frame of a non-writable segment
+ *
+ * The cache takes an additional reference of the frame.
+ * Further instances of the executable will share it.
+ *
+ * @param vma File-backed VMA of the current task
+ * @param viraddr Page aligned virtual address within the VMA
+ * @param phyaddr Physical address of the filled page frame
+ * @return
+ * - 0 on success
+ * - -EINVAL (-22) if the VMA doesn't belong to a cached segment
+ */
+int image_setpage(struct vma* vma, size_t viraddr, size_t phyaddr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
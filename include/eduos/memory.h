@@ -36,19 +36,59 @@
 #ifndef __MEMORY_H__
 #define __MEMORY_H__
 
+#include <eduos/stddef.h>
+#include <asm/atomic.h>
+
+/// Page frame contains only zeros
+#define PF_ZEROED	(1 << 0)
+/// Page frame is never released (kernel, modules, ...)
+#define PF_PINNED	(1 << 1)
+/// Page frame is used as page table
+#define PF_PAGETABLE	(1 << 2)
+/// Page frame is referenced by more than one mapping
+#define PF_SHARED	(1 << 3)
+
+/** @brief Descriptor of a physical page frame */
+typedef struct page_frame {
+	/// Number of references to this page frame
+	atomic_int32_t count;
+	/// Page frame flags (PF_*)
+	uint32_t flags;
+	/// Task, which has allocated the page frame
+	tid_t owner;
+	/// Number of present entries, if the page frame is used as page table
+	uint32_t entries;
+} page_frame_t;
+
 /** @brief Initialize the memory subsystem */
 int memory_init(void);
 
 /** @brief Request physical page frames */
 size_t get_pages(size_t npages);
 
+/** @brief Request physical page frames, which start at a multiple of align
+ *
+ * Large pages have to be aligned to their size.
+ *
+ * @param npages Number of page frames
+ * @param align Alignment in number of page frames (power of two)
+ * @return Physical address of the first page frame or 0 on failure
+ */
+size_t get_aligned_pages(size_t npages, size_t align);
+
 /** @brief Get a single page
  *
  * Convenience function: uses get_pages(1);
  */
 static inline size_t get_page(void) { return get_pages(1); }
 
-/** @brief release physical page frames */
+/** @brief Release physical page frames
+ *
+ * The reference count of each page frame is decremented.
+ * A page frame is only released, if its last reference is dropped.
+ *
+ * @return Number of released page frames or -EINVAL
+ */
 int put_pages(size_t phyaddr, size_t npages);
 
 /** @brief Put a single page
@@ -57,6 +97,52 @@ int put_pages(size_t phyaddr, size_t npages);
  */
 static inline int put_page(size_t phyaddr) { return put_pages(phyaddr, 1); }
 
+/** @brief Add a reference to an allocated page frame
+ *
+ * @return
+ * - the new reference count on success
+ * - -EINVAL if the page frame isn't allocated
+ */
+int page_ref(size_t phyaddr);
+
+/** @brief Get a single page, which is preferably filled with zeros
+ *
+ * The page frame is taken from the pool of pre-zeroed frames.
+ * If the pool is empty, an uncleared frame is returned.
+ *
+ * @param zeroed Is set to 1 if the frame is filled with zeros
+ * @return Physical address of the page frame or 0 on failure
+ */
+size_t get_zeroed_page(int* zeroed);
+
+/** @brief Add a page frame to the pool of pre-zeroed frames
+ *
+ * This function is called by the idle task and uses
+ * non-temporal stores to clear the frame.
+ *
+ * @return
+ * - 1 if a frame was added
+ * - 0 if the pool is already filled
+ * - -ENOMEM on failure
+ */
+int zero_pool_fill(void);
+
+/** @brief Determine the amount of RAM within a physical address range
+ *
+ * RAM is described by the available regions of the Multiboot memory map.
+ * Holes (e.g. the video memory or the MMIO of devices) don't count.
+ *
+ * @return Number of bytes of [start, end), which are RAM
+ */
+size_t phys_ram_size(size_t start, size_t end);
+
+/** @brief Get the descriptor of a physical page frame
+ *
+ * @return Pointer to the descriptor or NULL, if the
+ * page frame isn't managed by the memory subsystem
+ */
+page_frame_t* get_frame(size_t phyaddr);
+
 /** @brief Copy a physical page frame
  *
  * @param psrc physical address of source page frame
@@ -67,4 +153,12 @@ static inline int put_page(size_t phyaddr) { return put_pages(phyaddr, 1); }
  */
 int copy_page(size_t pdest, size_t psrc);
 
+#ifdef CONFIG_BENCHMARK
+/** @brief Print the global counters of the memory subsystem
+ *
+ * Covers the zeroed page pool, the large heap pages and the TLB shootdowns.
+ */
+void memory_report(void);
+#endif
+
 #endif
@@ -0,0 +1,238 @@
+/*
+ * Copyright (c) eduOS contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the University nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * @file include/eduos/percpu_counter.h
+ * @brief Counters with per-core deltas
+ *
+ * An update changes only the delta of the current core. Once the delta
+ * reaches PERCPU_COUNTER_BATCH, it's folded into the shared value.
+ * Frequent updates (e.g. per page frame) don't touch a shared cache line.
+ *
+ * percpu_counter_read() returns the folded value, which deviates by less
+ * than PERCPU_COUNTER_BATCH per core. percpu_counter_sum() adds the
+ * deltas of all cores and returns the exact value.
+ */
+
+#ifndef __PERCPU_COUNTER_H__
+#define __PERCPU_COUNTER_H__
+
+#include <eduos/stddef.h>
+#include <asm/atomic.h>
+#include <asm/irqflags.h>
+#include <asm/processor.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Maximal delta of a core before it's folded into the shared value
+#define PERCPU_COUNTER_BATCH	32
+
+/// Maximal deviation of percpu_counter_read() from the exact value
+#define PERCPU_COUNTER_ERROR	(PERCPU_COUNTER_BATCH * MAX_CORES)
+
+/** @brief Counter with per-core deltas */
+typedef struct percpu_counter {
+	/// Folded value
+	atomic_int32_t count;
+#if MAX_CORES > 1
+	/// Serializes the folds and percpu_counter_sum()
+	atomic_int32_t lock;
+#endif
+	/// Deltas of the cores, which aren't folded yet (one cache line per core)
+	struct {
+		int32_t delta;
+	} __attribute__ ((aligned (CACHE_LINE))) local[MAX_CORES];
+} percpu_counter_t;
+
+/// Macro for the initialization of a percpu_counter_t var
+#if MAX_CORES > 1
+#define PERCPU_COUNTER_INIT(v)	{ ATOMIC_INIT(v), ATOMIC_INIT(0), {[0 ... MAX_CORES-1] = {0}} }
+#else
+#define PERCPU_COUNTER_INIT(v)	{ ATOMIC_INIT(v), {[0 ... MAX_CORES-1] = {0}} }
+#endif
+
+/*
+ * The caller has to disable the interrupts. Thereby, the task can't be
+ * preempted or migrated while it updates the delta of its core.
+ * Returns NULL, if the core has no valid index.
+ */
+inline static int32_t* percpu_counter_local(percpu_counter_t* c)
+{
+#if MAX_CORES > 1
+	uint32_t core = current_core;
+
+	if (BUILTIN_EXPECT(core >= MAX_CORES, 0))
+		return NULL;
+
+	return &c->local[core].delta;
+#else
+	return &c->local[0].delta;
+#endif
+}
+
+inline static void percpu_counter_lock(percpu_counter_t* c)
+{
+#if MAX_CORES > 1
+	while (atomic_int32_test_and_set(&c->lock, 1))
+		PAUSE;
+#endif
+}
+
+inline static void percpu_counter_unlock(percpu_counter_t* c)
+{
+#if MAX_CORES > 1
+	atomic_int32_set(&c->lock, 0);
+#endif
+}
+
+/** @brief Set a counter to a value
+ *
+ * The caller has to ensure that the counter isn't updated concurrently.
+ *
+ * @param c The counter
+ * @param v New value
+ */
+inline static void percpu_counter_set(percpu_counter_t* c, int32_t v)
+{
+	uint32_t i;
+
+	for(i=0; i<MAX_CORES; i++)
+		c->local[i].delta = 0;
+	atomic_int32_set(&c->count, v);
+}
+
+/** @brief Add a value to a counter
+ *
+ * @param c The counter
+ * @param i Value to add (may be negative)
+ */
+inline static void percpu_counter_add(percpu_counter_t* c, int32_t i)
+{
+	uint8_t flags = irq_nested_disable();
+	int32_t* delta = percpu_counter_local(c);
+	int32_t val;
+
+	if (BUILTIN_EXPECT(!delta, 0)) {
+		/* no delta => update the shared value */
+		atomic_int32_add(&c->count, i);
+		irq_nested_enable(flags);
+		return;
+	}
+
+	val = *delta + i;
+	if ((val >= PERCPU_COUNTER_BATCH) || (val <= -PERCPU_COUNTER_BATCH)) {
+		percpu_counter_lock(c);
+		atomic_int32_add(&c->count, val);
+		*delta = 0;
+		percpu_counter_unlock(c);
+	} else *delta = val;
+
+	irq_nested_enable(flags);
+}
+
+/** @brief Subtract a value from a counter */
+inline static void percpu_counter_sub(percpu_counter_t* c, int32_t i)
+{
+	percpu_counter_add(c, -i);
+}
+
+/** @brief Increment a counter by one */
+inline static void percpu_counter_inc(percpu_counter_t* c)
+{
+	percpu_counter_add(c, 1);
+}
+
+/** @brief Decrement a counter by one */
+inline static void percpu_counter_dec(percpu_counter_t* c)
+{
+	percpu_counter_add(c, -1);
+}
+
+/** @brief Approximate value of a counter
+ *
+ * @return The folded value, which deviates by less than PERCPU_COUNTER_ERROR
+ */
+inline static int32_t percpu_counter_read(percpu_counter_t* c)
+{
+	return atomic_int32_read(&c->count);
+}
+
+/** @brief Exact value of a counter
+ *
+ * Reads the deltas of all cores. Therefore, it's more expensive than
+ * percpu_counter_read().
+ */
+inline static int32_t percpu_counter_sum(percpu_counter_t* c)
+{
+	uint8_t flags = irq_nested_disable();
+	int32_t ret;
+	uint32_t i;
+
+	percpu_counter_lock(c);
+	ret = atomic_int32_read(&c->count);
+	for(i=0; i<MAX_CORES; i++)
+		ret += *((volatile int32_t*) &c->local[i].delta);
+	percpu_counter_unlock(c);
+
+	irq_nested_enable(flags);
+
+	return ret;
+}
+
+/** @brief Compare a counter with a value
+ *
+ * Uses the approximate value if it's far enough from the value.
+ * Otherwise, the exact value is computed.
+ *
+ * @return
+ * - 1 if the counter is greater than the value
+ * - 0 if both are equal
+ * - -1 if the counter is less than the value
+ */
+inline static int percpu_counter_compare(percpu_counter_t* c, int32_t v)
+{
+	int32_t count = percpu_counter_read(c);
+
+	if ((count - v > PERCPU_COUNTER_ERROR) || (v - count > PERCPU_COUNTER_ERROR))
+		return (count > v) ? 1 : -1;
+
+	count = percpu_counter_sum(c);
+	if (count > v)
+		return 1;
+	if (count < v)
+		return -1;
+
+	return 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
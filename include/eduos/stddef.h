@@ -49,6 +49,8 @@ typedef unsigned int tid_t;
 struct task;
 /// pointer to the current (running) task
 extern struct task* current_task;
+/// dense index of the current core (0 ... MAX_CORES-1), which is assigned at boot
+extern uint32_t current_core;
 
 #ifdef __cplusplus
 }
@@ -51,6 +51,7 @@ extern "C" {
  *
  * @param sz Desired size of the new memory
  * @param flags Flags to for map_region(), vma_add()
+ * (VMA_HUGE maps the memory by large pages, if possible)
  *
  * @return Pointer to the new memory range
  */
@@ -75,6 +75,49 @@ extern "C" {
 #define __NR_stat		30
 #define __NR_dup		31
 #define __NR_dup2		32
+#define __NR_madvise		33
+#define __NR_mmap		34
+#define __NR_munmap		35
+#define __NR_mprotect		36
+
+/* advices of madvise() */
+#define MADV_NORMAL		0
+#define MADV_WILLNEED		3
+#define MADV_DONTNEED		4
+
+/* protection of mmap() and mprotect() */
+#define PROT_NONE		0x0
+#define PROT_READ		0x1
+#define PROT_WRITE		0x2
+#define PROT_EXEC		0x4
+
+/* flags of mmap() */
+#define MAP_SHARED		0x01
+#define MAP_PRIVATE		0x02
+#define MAP_FIXED		0x10
+#define MAP_ANONYMOUS		0x20
+#define MAP_POPULATE		0x8000
+#define MAP_HUGETLB		0x40000
+
+/** @brief Arguments of mmap()
+ *
+ * mmap() takes six arguments, but a system call passes only five.
+ * Therefore, the arguments are passed by a pointer.
+ */
+typedef struct mmap_args {
+	/// Preferred (or with MAP_FIXED required) start address
+	size_t addr;
+	/// Size of the mapping in bytes
+	size_t len;
+	/// Protection (PROT_*)
+	int prot;
+	/// Flags (MAP_*)
+	int flags;
+	/// File descriptor of a file mapping
+	int fd;
+	/// File offset of a file mapping
+	off_t offset;
+} mmap_args_t;
 
 #ifdef __cplusplus
 }
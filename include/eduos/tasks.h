@@ -47,6 +47,28 @@ extern "C" {
 /** @brief System call to terminate a user level process */
 void NORETURN sys_exit(int);
 
+/** @brief System call to duplicate the current user level process
+ *
+ * The new task gets a copy of the registers, the VMA list and the heap.
+ * The page frames are shared copy-on-write.
+ *
+ * @return
+ * - the id of the new task (in the calling task)
+ * - 0 (in the new task)
+ * - -EINVAL (-22) or -ENOMEM (-12) on failure
+ */
+int sys_fork(void);
+
+/** @brief System call to wait for the termination of a child task
+ *
+ * @param result Stores the exit status of the child task in the layout
+ *        of WEXITSTATUS(), i.e. (value & 0xff) << 8 (if not NULL)
+ * @return
+ * - the id of the terminated child task
+ * - -ECHILD (-10) if the task has no children
+ */
+int sys_wait(int32_t* result);
+
 /** @brief Task switcher
  *
  * Timer-interrupted use of this function for task switching
@@ -40,6 +40,8 @@
 #include <eduos/stddef.h>
 #include <eduos/spinlock_types.h>
 #include <eduos/vma.h>
+#include <eduos/mailbox_types.h>
+#include <eduos/percpu_counter.h>
 #include <asm/tasks_types.h>
 #include <asm/atomic.h>
 
@@ -57,6 +59,7 @@ extern "C" {
 #define TASK_DEFAULT_FLAGS	0
 #define TASK_FPU_INIT		(1 << 0)
 #define TASK_FPU_USED		(1 << 1)
+#define TASK_HEAP_COLLAPSE	(1 << 2)
 
 #define MAX_PRIO	31
 #define REALTIME_PRIO	31
@@ -89,16 +92,30 @@ typedef struct task {
 	spinlock_t		vma_lock;
 	/// list of VMAs
 	vma_t*			vma_list;
+	/// root of the VMA tree
+	vma_t*			vma_tree;
+	/// last VMA found by the page fault handler
+	vma_t*			vma_cache;
 	/// the userspace heap
 	vma_t*			heap;
 	/// usage in number of pages (including page map tables)
-	atomic_int32_t	user_usage;
+	percpu_counter_t	user_usage;
 	/// next task in the queue
 	struct task*	next;
 	/// previous task in the queue
 	struct task*	prev;
 	/// FPU state
 	union fpu_state	fpu;
+	/// id of the parent task
+	tid_t			parent;
+	/// exit messages of the child tasks
+	mailbox_wait_msg_t	inbox;
+	/// open files (file descriptors 0 - 2 belong to the console)
+	struct fildes*	fildes_table[MAX_FILES];
+	/// generation of the kernel mappings, which the TLB entries of the address space reflect
+	uint32_t		tlb_gen;
+	/// cores, which currently run the address space (bit i = core with the index i, see current_core)
+	uint32_t		cpu_mask;
 } task_t;
 
 typedef struct {
@@ -55,6 +55,14 @@ extern "C" {
 #define VMA_NO_ACCESS	(1 << 4)
 /// This VMA should be part of the userspace
 #define VMA_USER	(1 << 5)
+/// Map the pages at allocation time instead on first access
+#define VMA_POPULATE	(1 << 6)
+/// Changes of a file-backed VMA are visible to all users of the file
+#define VMA_SHARED	(1 << 7)
+/// Map this VMA by large pages, where the alignment allows it
+#define VMA_HUGE	(1 << 8)
+/// mprotect() is allowed to enable write access (a shared file has to be writable)
+#define VMA_MAYWRITE	(1 << 9)
 /// A collection of flags used for the kernel heap (kmalloc)
 #define VMA_HEAP	(VMA_READ|VMA_WRITE|VMA_CACHEABLE)
 
@@ -71,11 +79,17 @@ extern "C" {
 #endif
 
 struct vma;
+struct vfs_node;
 
 /** @brief VMA structure definition
  *
  * Each item in this linked list marks a used part of the virtual address space.
  * Its used by vm_alloc() to find holes between them.
+ *
+ * In addition, the VMAs are indexed by a balanced (AVL) tree, which is
+ * sorted by the start address. Each node records the largest free gap in
+ * front of a VMA of its subtree. Thereby, lookups and the search for a
+ * free gap take O(log n) steps.
  */
 typedef struct vma {
 	/// Start address of the memory area
@@ -84,10 +98,26 @@ typedef struct vma {
 	size_t end;
 	/// Type flags field
 	uint32_t flags;
+	/// File, which backs the memory area (or NULL for anonymous memory)
+	struct vfs_node* node;
+	/// File offset of the start address
+	off_t offset;
+	/// Number of bytes behind the start address, which are backed by the file
+	size_t file_size;
 	/// Pointer of next VMA element in the list
 	struct vma* next;
 	/// Pointer to previous VMA element in the list
 	struct vma* prev;
+	/// Parent node in the VMA tree
+	struct vma* parent;
+	/// Left child in the VMA tree (lower addresses)
+	struct vma* left;
+	/// Right child in the VMA tree (higher addresses)
+	struct vma* right;
+	/// Height of the subtree
+	uint32_t height;
+	/// Largest gap in front of a VMA of this subtree
+	size_t gap;
 } vma_t;
 
 /** @brief Initalize the kernelspace VMA list
@@ -115,11 +145,58 @@ int vma_init(void);
  *
  * @return
  * - 0 on success
- * - -EINVAL (-22) or -EINVAL (-12) on failure
+ * - -EINVAL (-22) or -ENOMEM (-12) on failure
  */
 int vma_add(size_t start, size_t end, uint32_t flags);
 
+/** @brief Add a new file-backed virtual memory area to the list of VMAs
+ *
+ * The pages of the area are mapped on demand by the page fault handler.
+ * Bytes behind file_size are filled with zeros.
+ *
+ * @param start Start address of the new area (page aligned)
+ * @param end End address of the new area
+ * @param flags Type flags the new area shall have
+ * @param node File, which backs the area
+ * @param offset File offset of the start address
+ * @param file_size Number of bytes, which are backed by the file
+ *
+ * @return
+ * - 0 on success
+ * - -EINVAL (-22) or -ENOMEM (-12) on failure
+ */
+int vma_add_file(size_t start, size_t end, uint32_t flags, struct vfs_node* node, off_t offset, size_t file_size);
+
+/** @brief Search the user-level VMA, which contains an address
+ *
+ * The last hit is cached per task, because consecutive page faults
+ * usually hit the same area.
+ * The caller has to hold the vma_lock of the task.
+ *
+ * @param task Task, whose VMA list is searched
+ * @param addr Virtual address
+ * @return
+ * - pointer to the VMA
+ * - NULL if the address isn't part of an VMA
+ */
+vma_t* vma_find(struct task* task, size_t addr);
+
+/** @brief Search the first user-level VMA, which ends behind an address
+ *
+ * The caller has to hold the vma_lock of the task.
+ *
+ * @param task Task, whose VMA list is searched
+ * @param addr Virtual address
+ * @return
+ * - pointer to the VMA
+ * - NULL if no VMA ends behind the address
+ */
+vma_t* vma_lookup(struct task* task, size_t addr);
+
 /** @brief Search for a free memory area
+ *
+ * Kernel areas are allocated first fit. User areas are allocated
+ * top down above the heap, which keeps its room to grow.
  *
  * @param size Size of requestes VMA in bytes
  * @param flags
@@ -129,6 +206,48 @@ int vma_add(size_t start, size_t end, uint32_t flags);
  */
 size_t vma_alloc(size_t size, uint32_t flags);
 
+/** @brief Search for a free memory area and back it by a file
+ *
+ * Like vma_alloc(), but the new area isn't merged with its neighbours.
+ *
+ * @param size Size of requested VMA in bytes
+ * @param flags Type flags the new area shall have
+ * @param node File, which backs the area
+ * @param offset File offset of the start address
+ * @param file_size Number of bytes, which are backed by the file
+ * @return
+ * - 0 on failure
+ * - the start address of a free area
+ */
+size_t vma_alloc_file(size_t size, uint32_t flags, struct vfs_node* node, off_t offset, size_t file_size);
+
+/** @brief Search for a free memory area, which starts at a multiple of align
+ *
+ * Large pages have to be aligned to their size.
+ *
+ * @param size Size of requested VMA in bytes
+ * @param align Alignment in bytes (power of two, at least PAGE_SIZE)
+ * @param flags Type flags the new area shall have
+ * @return
+ * - 0 on failure
+ * - the start address of a free area
+ */
+size_t vma_alloc_aligned(size_t size, size_t align, uint32_t flags);
+
+/** @brief Change the type flags of a part of a VMA
+ *
+ * The VMA is split, if the range doesn't cover it completely.
+ *
+ * @param start Start address of the range (page aligned)
+ * @param end End address of the range (page aligned)
+ * @param flags New type flags of the range
+ * @return
+ * - 0 on success
+ * - -EINVAL (-22) if the range isn't part of a single VMA
+ * - -ENOMEM (-12) on failure
+ */
+int vma_set_flags(size_t start, size_t end, uint32_t flags);
+
 /** @brief Free an allocated memory area
  *
  * @param start Start address of the area to be freed
@@ -157,6 +276,16 @@ int copy_vma_list(struct task* src, struct task* dest);
 /** @brief Dump information about this task's VMAs into the terminal. */
 void vma_dump(void);
 
+#ifdef CONFIG_BENCHMARK
+/** @brief Measure the VMA operations with many user-level areas
+ *
+ * Uses the VMA list of the current task, which has to be empty.
+ *
+ * @param n Number of areas
+ */
+void vma_benchmark(uint32_t n);
+#endif
+
 #ifdef __cplusplus
 }
 #endif
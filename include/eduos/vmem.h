@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) eduOS contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the University nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * @file include/eduos/vmem.h
+ * @brief Arena of kernel virtual address space for palloc()
+ *
+ * The arena is a reserved range of the kernel space. Its free segments
+ * are kept in free lists, which are segregated by power of two sizes.
+ * An allocation takes the head of the smallest list, whose segments
+ * are large enough (instant fit). Small ranges are cached by quantum
+ * caches, one for each size up to VMEM_QCACHE_MAX pages.
+ * The boundary tags come from a static pool. Therefore, the arena
+ * never calls kmalloc() or vma_alloc() after its initialization.
+ */
+
+#ifndef __VMEM_H__
+#define __VMEM_H__
+
+#include <eduos/stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Largest range (in pages), which is cached by a quantum cache
+#define VMEM_QCACHE_MAX		8
+/// Capacity of each quantum cache
+#define VMEM_QCACHE_DEPTH	16
+
+/** @brief Reserve the virtual address range of the arena
+ *
+ * @param size Size of the arena in bytes
+ * @return
+ * - 0 on success
+ * - -ENOMEM (-12) if the kernel space is exhausted
+ */
+int vmem_init(size_t size);
+
+/** @brief Allocate a range of the arena
+ *
+ * @param npages Size of the range in pages
+ * @return
+ * - start address of the range
+ * - 0 if the arena is exhausted or not initialized
+ */
+size_t vmem_alloc(size_t npages);
+
+/** @brief Release a range of the arena
+ *
+ * @param viraddr Start address, which was returned by vmem_alloc()
+ * @param npages Size of the range in pages (as passed to vmem_alloc())
+ * @return
+ * - 0 on success
+ * - -ENOENT (-2) if the range lies outside of the arena
+ * - -EINVAL (-22) if the range wasn't allocated
+ */
+int vmem_free(size_t viraddr, size_t npages);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
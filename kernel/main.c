@@ -41,6 +41,7 @@
 #include <asm/atomic.h>
 #include <asm/page.h>
 #include <asm/uart.h>
+#include <asm/vga.h>
 
 /*
  * Note that linker symbols are not variables, they have no memory allocated for
@@ -55,8 +56,9 @@ extern char __BUILD_TIME;
 
 /* Page frame counters */
 extern atomic_int32_t total_pages;
-extern atomic_int32_t total_allocated_pages;
-extern atomic_int32_t total_available_pages;
+extern percpu_counter_t total_allocated_pages;
+extern percpu_counter_t total_available_pages;
+extern atomic_int32_t kernel_page_tables;
 
 #if 0
 // Demo of a user-level task
@@ -117,6 +119,26 @@ static int foo(void* arg)
 	return 0;
 }
 
+#ifdef CONFIG_BENCHMARK
+/** @brief Run a user-level task and report the memory counters after its termination */
+static int benchmark(void* arg)
+{
+	char** argv = (char**) arg;
+	int ret;
+
+	ret = create_user_task(NULL, argv[0], argv);
+	if (BUILTIN_EXPECT(ret, 0))
+		return ret;
+
+	// the counters are global => wait for all children
+	while(sys_wait(NULL) >= 0) ;
+
+	memory_report();
+
+	return 0;
+}
+#endif
+
 static int eduos_init(void)
 {
 	// initialize .bss section
@@ -147,14 +169,27 @@ int main(void)
 	kprintf("This is eduOS %s Build %u, %u\n", EDUOS_VERSION, &__BUILD_DATE, &__BUILD_TIME);
 	kprintf("Kernel starts at %p and ends at %p\n", &kernel_start, &kernel_end);
 	kprintf("Processor frequency: %u MHz\n", get_cpu_frequency());
-	kprintf("Total memory: %lu KiB\n", atomic_int32_read(&total_pages) * PAGE_SIZE / 1024);
-	kprintf("Current allocated memory: %lu KiB\n", atomic_int32_read(&total_allocated_pages) * PAGE_SIZE / 1024);
-	kprintf("Current available memory: %lu KiB\n", atomic_int32_read(&total_available_pages) * PAGE_SIZE / 1024);
+	kprintf("Total memory: %lu KiB\n", atomic_int32_read(&total_pages) * (PAGE_SIZE >> 10));
+	kprintf("Current allocated memory: %lu KiB\n", percpu_counter_sum(&total_allocated_pages) * (PAGE_SIZE >> 10));
+	kprintf("Current available memory: %lu KiB\n", percpu_counter_sum(&total_available_pages) * (PAGE_SIZE >> 10));
+	kprintf("Kernel page tables: %lu KiB\n", atomic_int32_read(&kernel_page_tables) * (PAGE_SIZE >> 10));
 
 	//vma_dump();
 
+#ifdef CONFIG_BENCHMARK
+	vma_benchmark(4096);
+	string_benchmark();
+#ifdef CONFIG_VGA
+	vga_benchmark(1000);
+#endif
+#endif
+
 	create_kernel_task(NULL, foo, "foo", NORMAL_PRIO);
+#ifdef CONFIG_BENCHMARK
+	create_kernel_task(NULL, benchmark, argv1, NORMAL_PRIO);
+#else
 	create_user_task(NULL, "/bin/hello", argv1);
+#endif
 	//create_user_task(NULL, "/bin/jacobi", argv2);
 	//create_user_task(NULL, "/bin/jacobi", argv2);
 
@@ -166,8 +201,10 @@ int main(void)
 	// x64: wrapper maps function to user space to start a user-space task
 	//create_kernel_task(NULL, wrapper, "userfoo", NORMAL_PRIO);
 
-	while(1) { 
-		HALT;
+	// idle loop: prepare zeroed page frames, if nothing else is to do
+	while(1) {
+		if (zero_pool_fill() <= 0)
+			HALT;
 	}
 
 	return 0;
@@ -31,19 +31,97 @@
 #include <eduos/errno.h>
 #include <eduos/syscall.h>
 #include <eduos/spinlock.h>
+#include <eduos/stdlib.h>
+#include <eduos/fs.h>
+
+/** @brief Get the open file of a file descriptor (or NULL) */
+static fildes_t* get_fildes(int fd)
+{
+	if (BUILTIN_EXPECT((fd < 0) || (fd >= MAX_FILES), 0))
+		return NULL;
+
+	return current_task->fildes_table[fd];
+}
 
 static int sys_write(int fd, const char* buf, size_t len)
 {
-	//TODO: Currently, we ignore the file descriptor
+	fildes_t* file = get_fildes(fd);
 
 	if (BUILTIN_EXPECT(!buf, 0))
 		return -1;
 
+	if (file)
+		return write_fs(file, (uint8_t*) buf, len);
+
+	//TODO: Currently, the console ignores the file descriptor
 	kputs(buf);
 
 	return 0;
 }
 
+static ssize_t sys_read(int fd, char* buf, size_t len)
+{
+	fildes_t* file = get_fildes(fd);
+
+	if (BUILTIN_EXPECT(!file, 0))
+		return -EBADF;
+	if (BUILTIN_EXPECT(!buf, 0))
+		return -EINVAL;
+
+	return read_fs(file, (uint8_t*) buf, len);
+}
+
+static int sys_open(const char* name, int flags, int mode)
+{
+	task_t* task = current_task;
+	fildes_t* file;
+	int fd, ret;
+
+	if (BUILTIN_EXPECT(!name, 0))
+		return -EINVAL;
+
+	// the file descriptors 0 - 2 belong to the console
+	for(fd=3; (fd<MAX_FILES) && task->fildes_table[fd]; fd++)
+		;
+	if (BUILTIN_EXPECT(fd >= MAX_FILES, 0))
+		return -EMFILE;
+
+	file = (fildes_t*) kmalloc(sizeof(fildes_t));
+	if (BUILTIN_EXPECT(!file, 0))
+		return -ENOMEM;
+
+	file->node = NULL;
+	file->offset = 0;
+	file->flags = flags;
+	file->mode = mode;
+	atomic_int32_set(&file->count, 1);
+
+	ret = open_fs(file, name);
+	if (BUILTIN_EXPECT(ret || !file->node, 0)) {
+		kfree(file);
+		return ret ? ret : -ENOENT;
+	}
+
+	task->fildes_table[fd] = file;
+
+	return fd;
+}
+
+static int sys_close(int fd)
+{
+	fildes_t* file = get_fildes(fd);
+
+	// the console isn't closed
+	if ((fd >= 0) && (fd < 3))
+		return 0;
+	if (BUILTIN_EXPECT(!file, 0))
+		return -EBADF;
+
+	current_task->fildes_table[fd] = NULL;
+
+	return put_fildes(file);
+}
+
 static ssize_t sys_sbrk(int incr)
 {
 	task_t* task = current_task;
@@ -58,13 +136,367 @@ static ssize_t sys_sbrk(int incr)
 	}
 
 	ret = heap->end;
+
+	// the heap must not grow into an other area (e.g. the stack)
+	if (incr > 0) {
+		vma_t* vma = vma_lookup(task, heap->end);
+
+		if (vma && (vma->start < PAGE_FLOOR(heap->end + incr))) {
+			spinlock_unlock(&task->vma_lock);
+			return -ENOMEM;
+		}
+	}
+
 	heap->end += incr;
 	if (heap->end < heap->start)
 		heap->end = heap->start;
 
+	// release the pages behind the shrunken heap
+	if (PAGE_FLOOR(heap->end) < PAGE_FLOOR(ret))
+		page_release(PAGE_FLOOR(heap->end), (PAGE_FLOOR(ret) - PAGE_FLOOR(heap->end)) >> PAGE_BITS);
+
 	// allocation and mapping of new pages for the heap
 	// is catched by the pagefault handler
+	// or eagerly done, if the heap is populated (like MAP_POPULATE)
+	if ((heap->flags & VMA_POPULATE) && (incr > 0)) {
+		// the page of the old end is already in use => start behind it
+		size_t start = PAGE_FLOOR(ret);
+		size_t npages = (PAGE_FLOOR(heap->end) - start) >> PAGE_BITS;
+
+		if (npages && BUILTIN_EXPECT(page_populate(start, npages, PG_USER), 0)) {
+			// out of memory => release the pages behind the old end and restore it
+			page_release(start, npages);
+			heap->end = ret;
+			ret = -ENOMEM;
+		}
+	}
+
+	spinlock_unlock(&task->vma_lock);
+
+	return ret;
+}
+
+/** @brief Convert the protection of mmap() into VMA flags */
+static uint32_t prot2flags(int prot)
+{
+	uint32_t flags = VMA_USER|VMA_CACHEABLE;
+
+	if (prot & PROT_READ)
+		flags |= VMA_READ;
+	if (prot & PROT_WRITE)
+		flags |= VMA_WRITE;
+	if (prot & PROT_EXEC)
+		flags |= VMA_EXECUTE;
+	if (!(prot & (PROT_READ|PROT_WRITE|PROT_EXEC)))
+		flags |= VMA_NO_ACCESS;
+
+	return flags;
+}
+
+/** @brief Convert VMA flags into the flags of a page table entry */
+static size_t flags2bits(uint32_t flags)
+{
+	size_t bits = PG_USER;
+
+	if (flags & VMA_NO_ACCESS)
+		return PG_NONE;
+	if (flags & VMA_WRITE)
+		bits |= PG_RW;
+#ifdef CONFIG_X86_64
+	if (has_nx() && !(flags & VMA_EXECUTE))
+		bits |= PG_XD;
+#endif
+
+	return bits;
+}
+
+static int sys_madvise(size_t addr, size_t len, int advice)
+{
+	task_t* task = current_task;
+	vma_t* heap = task->heap;
+	vma_t* vma;
+	size_t end, i;
+	int ret = 0;
+
+	if (BUILTIN_EXPECT((addr & ~PAGE_MASK) || (addr < VMA_USER_MIN), 0))
+		return -EINVAL;
+
+	end = PAGE_FLOOR(addr + len);
+	if (BUILTIN_EXPECT((end <= addr) || (end > VMA_USER_MAX), 0))
+		return -EINVAL;
+
+	spinlock_lock(&task->vma_lock);
+
+	// only areas, which are mapped on demand, are able to release their pages
+	if (heap && (addr >= heap->start) && (end <= PAGE_FLOOR(heap->end)))
+		vma = NULL;
+	else {
+		vma = vma_find(task, addr);
+		if (BUILTIN_EXPECT(!vma || (vma->flags & VMA_NO_ACCESS) || (end > vma->end), 0)) {
+			ret = -EINVAL;
+			goto out;
+		}
+	}
+
+	switch(advice)
+	{
+	case MADV_NORMAL:
+		break;
+	case MADV_DONTNEED:
+		// the next access maps a zeroed page or reloads the file content
+		page_release(addr, (end - addr) >> PAGE_BITS);
+		break;
+	case MADV_WILLNEED:
+		if (!vma)
+			ret = page_populate(addr, (end - addr) >> PAGE_BITS, PG_USER);
+		else if (!vma->node) {
+			ret = page_populate(addr, (end - addr) >> PAGE_BITS, PG_USER);
+			if (!ret)
+				ret = page_set_flags(addr, (end - addr) >> PAGE_BITS, flags2bits(vma->flags));
+		} else for (i=addr; (i<end) && !ret; i+=PAGE_SIZE)
+			ret = page_map_file(i);
+		break;
+	default:
+		ret = -EINVAL;
+		break;
+	}
+
+out:
+	spinlock_unlock(&task->vma_lock);
+
+	return ret;
+}
+
+/** @brief Remove all VMAs and pages in the range [start, end)
+ *
+ * The caller has to hold the vma_lock of the task.
+ */
+static int do_munmap(size_t start, size_t end)
+{
+	task_t* task = current_task;
+	vma_t* vma;
+	size_t s, e;
+	int ret;
+
+	while ((vma = vma_lookup(task, start)) && (vma->start < end)) {
+		s = (vma->start > start) ? vma->start : start;
+		e = (vma->end < end) ? vma->end : end;
+
+		page_release(s, (e - s) >> PAGE_BITS);
+
+		ret = vma_free(s, e);
+		if (BUILTIN_EXPECT(ret, 0))
+			return ret;
+
+		start = e;
+	}
+
+	return 0;
+}
+
+static ssize_t sys_mmap(mmap_args_t* uargs)
+{
+	task_t* task = current_task;
+	vma_t* heap = task->heap;
+	vma_t* vma;
+	vfs_node_t* node = NULL;
+	mmap_args_t args;
+	size_t addr, end, len, i;
+	size_t align = PAGE_SIZE;
+	size_t file_size = 0;
+	off_t offset = 0;
+	uint32_t flags;
+	ssize_t ret;
+
+	if (BUILTIN_EXPECT(((size_t) uargs < VMA_USER_MIN) || ((size_t) uargs + sizeof(args) > VMA_USER_MAX), 0))
+		return -EINVAL;
+
+	args = *uargs;
+
+	len = PAGE_FLOOR(args.len);
+	if (BUILTIN_EXPECT(!len || (len < args.len), 0))
+		return -EINVAL;
+
+	// either private or shared
+	if (BUILTIN_EXPECT(!(args.flags & MAP_SHARED) == !(args.flags & MAP_PRIVATE), 0))
+		return -EINVAL;
+
+	flags = prot2flags(args.prot);
+	if ((args.flags & MAP_POPULATE) && !(flags & VMA_NO_ACCESS))
+		flags |= VMA_POPULATE;
+
+	// large pages are aligned to their size and mapped at once
+	if (args.flags & MAP_HUGETLB) {
+		len = (len + PAGE_HUGE_SIZE - 1) & ~(PAGE_HUGE_SIZE - 1);
+		if (BUILTIN_EXPECT(!len || !(args.flags & MAP_ANONYMOUS), 0))
+			return -EINVAL;
+
+		align = PAGE_HUGE_SIZE;
+		flags |= VMA_HUGE;
+		if (!(flags & VMA_NO_ACCESS))
+			flags |= VMA_POPULATE;
+	}
+
+	if (args.flags & MAP_ANONYMOUS) {
+		// shared anonymous memory isn't supported
+		if (BUILTIN_EXPECT(args.flags & MAP_SHARED, 0))
+			return -EINVAL;
+
+		flags |= VMA_MAYWRITE;
+	} else {
+		fildes_t* file = get_fildes(args.fd);
+
+		if (BUILTIN_EXPECT(!file, 0))
+			return -EBADF;
+		if (BUILTIN_EXPECT(file->node->type != FS_FILE, 0))
+			return -ENODEV;
+		if (BUILTIN_EXPECT((args.offset < 0) || (args.offset & (PAGE_SIZE-1)), 0))
+			return -EINVAL;
+
+		// the file has to be readable and, for shared writable mappings, writable
+		if (BUILTIN_EXPECT((file->flags & O_WRONLY) ||
+		    ((args.flags & MAP_SHARED) && (args.prot & PROT_WRITE) && !(file->flags & O_RDWR)), 0))
+			return -EACCES;
+
+		if (args.flags & MAP_SHARED)
+			flags |= VMA_SHARED;
+
+		// changes of a private mapping aren't written back to the file
+		if (!(args.flags & MAP_SHARED) || (file->flags & O_RDWR))
+			flags |= VMA_MAYWRITE;
+
+		node = file->node;
+		offset = args.offset;
+		if (node->block_size > (size_t) offset)
+			file_size = node->block_size - offset;
+		if (file_size > len)
+			file_size = len;
+	}
+
+	spinlock_lock(&task->vma_lock);
+
+	addr = args.addr & PAGE_MASK;
+	end = addr + len;
+
+	if (args.flags & MAP_FIXED) {
+		if (BUILTIN_EXPECT((addr != args.addr) || (addr & (align-1)) ||
+		    (addr < VMA_USER_MIN) || (end > VMA_USER_MAX) || (end < addr), 0)) {
+			ret = -EINVAL;
+			goto out;
+		}
+
+		// the heap isn't able to shrink by mmap()
+		if (BUILTIN_EXPECT(heap && (addr < PAGE_FLOOR(heap->end)) && (end > heap->start), 0)) {
+			ret = -ENOMEM;
+			goto out;
+		}
+
+		// the new mapping replaces the old one
+		ret = do_munmap(addr, end);
+		if (BUILTIN_EXPECT(ret, 0))
+			goto out;
+	} else if (!addr || (addr & (align-1)) || (addr < VMA_USER_MIN) || (end > VMA_USER_MAX) || (end < addr) ||
+		   (heap && (addr < PAGE_FLOOR(heap->end)) && (end > heap->start)) ||
+		   ((vma = vma_lookup(task, addr)) && (vma->start < end))) {
+		// the hint isn't usable => search a free area
+		if (node)
+			addr = vma_alloc_file(len, flags, node, offset, file_size);
+		else
+			addr = vma_alloc_aligned(len, align, flags);
+		if (BUILTIN_EXPECT(!addr, 0)) {
+			ret = -ENOMEM;
+			goto out;
+		}
+
+		end = addr + len;
+		goto mapped;
+	}
+
+	ret = vma_add_file(addr, end, flags, node, offset, file_size);
+	if (BUILTIN_EXPECT(ret, 0))
+		goto out;
+
+mapped:
+	// map the pages at once, otherwise the page fault handler maps them on demand
+	if (flags & VMA_POPULATE) {
+		if (node) {
+			for (i=addr, ret=0; (i<end) && !ret; i+=PAGE_SIZE)
+				ret = page_map_file(i);
+		} else {
+			ret = page_populate(addr, len >> PAGE_BITS, (flags & VMA_HUGE) ? PG_USER|PG_PSE : PG_USER);
+			if (!ret)
+				ret = page_set_flags(addr, len >> PAGE_BITS, flags2bits(flags));
+		}
+		if (BUILTIN_EXPECT(ret, 0)) {
+			do_munmap(addr, end);
+			goto out;
+		}
+	}
+
+	ret = addr;
+
+out:
+	spinlock_unlock(&task->vma_lock);
+
+	return ret;
+}
+
+static int sys_munmap(size_t addr, size_t len)
+{
+	task_t* task = current_task;
+	size_t end;
+	int ret;
+
+	if (BUILTIN_EXPECT((addr & ~PAGE_MASK) || (addr < VMA_USER_MIN), 0))
+		return -EINVAL;
+
+	end = PAGE_FLOOR(addr + len);
+	if (BUILTIN_EXPECT((end <= addr) || (end > VMA_USER_MAX), 0))
+		return -EINVAL;
+
+	spinlock_lock(&task->vma_lock);
+	ret = do_munmap(addr, end);
+	spinlock_unlock(&task->vma_lock);
+
+	return ret;
+}
+
+static int sys_mprotect(size_t addr, size_t len, int prot)
+{
+	task_t* task = current_task;
+	vma_t* vma;
+	size_t end;
+	uint32_t flags;
+	int ret;
+
+	if (BUILTIN_EXPECT((addr & ~PAGE_MASK) || (addr < VMA_USER_MIN), 0))
+		return -EINVAL;
+
+	end = PAGE_FLOOR(addr + len);
+	if (BUILTIN_EXPECT((end <= addr) || (end > VMA_USER_MAX), 0))
+		return -EINVAL;
+
+	spinlock_lock(&task->vma_lock);
+
+	vma = vma_find(task, addr);
+	if (BUILTIN_EXPECT(!vma || (end > vma->end), 0)) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	// a shared mapping of a read-only file has to stay read-only, see sys_mmap()
+	if (BUILTIN_EXPECT((prot & PROT_WRITE) && (vma->flags & VMA_SHARED) && !(vma->flags & VMA_MAYWRITE), 0)) {
+		ret = -EACCES;
+		goto out;
+	}
 
+	flags = (vma->flags & ~(VMA_READ|VMA_WRITE|VMA_EXECUTE|VMA_NO_ACCESS|VMA_POPULATE)) | prot2flags(prot);
+
+	ret = vma_set_flags(addr, end, flags);
+	if (!ret)
+		ret = page_set_flags(addr, (end - addr) >> PAGE_BITS, flags2bits(flags));
+
+out:
 	spinlock_unlock(&task->vma_lock);
 
 	return ret;
@@ -90,17 +522,72 @@ ssize_t syscall_handler(uint32_t sys_nr, ...)
 		ret = sys_write(fd, buf, len);
 		break;
 	}
-	//TODO: Currently, we ignore file descriptors
-	case __NR_open:
-	case __NR_close:
-		ret = 0;
+	case __NR_open: {
+		const char* name = va_arg(vl, const char*);
+		int flags = va_arg(vl, int);
+		int mode = va_arg(vl, int);
+
+		ret = sys_open(name, flags, mode);
 		break;
+	}
+	case __NR_close: {
+		int fd = va_arg(vl, int);
+
+		ret = sys_close(fd);
+		break;
+	}
+	case __NR_read: {
+		int fd = va_arg(vl, int);
+		char* buf = va_arg(vl, char*);
+		size_t len = va_arg(vl, size_t);
+
+		ret = sys_read(fd, buf, len);
+		break;
+	}
 	case __NR_sbrk: {
 		int incr = va_arg(vl, int);
 
 		ret = sys_sbrk(incr);
 		break;
 	}
+	case __NR_fork:
+		ret = sys_fork();
+		break;
+	case __NR_wait: {
+		int32_t* status = va_arg(vl, int32_t*);
+
+		ret = sys_wait(status);
+		break;
+	}
+	case __NR_madvise: {
+		size_t addr = va_arg(vl, size_t);
+		size_t len = va_arg(vl, size_t);
+		int advice = va_arg(vl, int);
+
+		ret = sys_madvise(addr, len, advice);
+		break;
+	}
+	case __NR_mmap: {
+		mmap_args_t* args = va_arg(vl, mmap_args_t*);
+
+		ret = sys_mmap(args);
+		break;
+	}
+	case __NR_munmap: {
+		size_t addr = va_arg(vl, size_t);
+		size_t len = va_arg(vl, size_t);
+
+		ret = sys_munmap(addr, len);
+		break;
+	}
+	case __NR_mprotect: {
+		size_t addr = va_arg(vl, size_t);
+		size_t len = va_arg(vl, size_t);
+		int prot = va_arg(vl, int);
+
+		ret = sys_mprotect(addr, len, prot);
+		break;
+	}
 	default:
 		kprintf("invalid system call: %u\n", sys_nr);
 		ret = -ENOSYS;
@@ -35,20 +35,23 @@
 #include <eduos/errno.h>
 #include <eduos/syscall.h>
 #include <eduos/memory.h>
+#include <eduos/mailbox.h>
+#include <eduos/fs.h>
 
 /** @brief Array of task structures (aka PCB)
  *
  * A task's id will be its position in this array.
  */
 static task_t task_table[MAX_TASKS] = { \
-		[0]                 = {0, TASK_IDLE, NULL, NULL, TASK_DEFAULT_FLAGS, 0, 0, SPINLOCK_IRQSAVE_INIT, SPINLOCK_INIT, NULL, NULL, ATOMIC_INIT(0), NULL, NULL}, \
-		[1 ... MAX_TASKS-1] = {0, TASK_INVALID, NULL, NULL, TASK_DEFAULT_FLAGS, 0, 0, SPINLOCK_IRQSAVE_INIT, SPINLOCK_INIT, NULL, NULL,ATOMIC_INIT(0), NULL, NULL}};
+		[0]                 = {0, TASK_IDLE, NULL, NULL, TASK_DEFAULT_FLAGS, 0, 0, SPINLOCK_IRQSAVE_INIT, SPINLOCK_INIT, NULL, NULL, NULL, NULL, PERCPU_COUNTER_INIT(0), NULL, NULL}, \
+		[1 ... MAX_TASKS-1] = {0, TASK_INVALID, NULL, NULL, TASK_DEFAULT_FLAGS, 0, 0, SPINLOCK_IRQSAVE_INIT, SPINLOCK_INIT, NULL, NULL, NULL, NULL,PERCPU_COUNTER_INIT(0), NULL, NULL}};
 
 static spinlock_irqsave_t table_lock = SPINLOCK_IRQSAVE_INIT;
 
 static readyqueues_t readyqueues = {task_table+0, NULL, 0, 0, {[0 ... MAX_PRIO-2] = {NULL, NULL}}, SPINLOCK_IRQSAVE_INIT};
 
 task_t* current_task = task_table+0;
+uint32_t current_core = 0;
 extern const void boot_stack;
 
 /** @brief helper function for the assembly code to determine the current task
@@ -74,6 +77,7 @@ int multitasking_init(void)
 	task_table[0].prio = IDLE_PRIO;
 	task_table[0].stack = (void*) &boot_stack;
 	task_table[0].page_map = read_cr3();
+	mailbox_wait_msg_init(&task_table[0].inbox);
 
 	// register idle task
 	register_task();
@@ -93,6 +97,12 @@ void finish_task_switch(void)
 			old->stack = NULL;
 			old->last_stack_pointer = NULL;
 			readyqueues.old_task = NULL;
+
+			// the root table isn't longer in use => release it
+			if (old->page_map) {
+				put_page(old->page_map);
+				old->page_map = 0;
+			}
 		} else {
 			prio = old->prio;
 			if (!readyqueues.queue[prio-1].first) {
@@ -110,9 +120,6 @@ void finish_task_switch(void)
 	}
 
 	spinlock_irqsave_unlock(&readyqueues.lock);
-
-	if (current_task->heap)
-		kfree(current_task->heap);
 }
 
 /** @brief A procedure to be called by
@@ -121,10 +128,46 @@ static void NORETURN do_exit(int arg)
 {
 	task_t* curr_task = current_task;
 
+	task_t* parent_task;
+	wait_msg_t msg = { curr_task->id, arg };
+	uint32_t i;
+
 	kprintf("Terminate task: %u, return value %d\n", curr_task->id, arg);
+#ifdef CONFIG_BENCHMARK
+	kprintf("Task %u used %d resident pages\n", curr_task->id, percpu_counter_sum(&curr_task->user_usage));
+#endif
+
+	// close all open files
+	for(i=0; i<MAX_FILES; i++) {
+		if (curr_task->fildes_table[i]) {
+			put_fildes(curr_task->fildes_table[i]);
+			curr_task->fildes_table[i] = NULL;
+		}
+	}
+
+	drop_vma_list(curr_task);
+	if (curr_task->heap) {
+		kfree(curr_task->heap);
+		curr_task->heap = NULL;
+	}
 
 	page_map_drop();
 
+	spinlock_irqsave_lock(&table_lock);
+
+	// the children become orphans => they don't inform a reused slot
+	for(i=0; i<MAX_TASKS; i++) {
+		if ((i != curr_task->id) && (task_table[i].parent == curr_task->id))
+			task_table[i].parent = i;
+	}
+
+	// inform the parent task
+	parent_task = task_table + curr_task->parent;
+	if ((parent_task != curr_task) && (parent_task->status != TASK_INVALID) && (parent_task->status != TASK_FINISHED))
+		mailbox_wait_msg_trypost(&parent_task->inbox, msg);
+
+	spinlock_irqsave_unlock(&table_lock);
+
 	// decrease the number of active tasks
 	spinlock_irqsave_lock(&readyqueues.lock);
 	readyqueues.nr_tasks--;
@@ -180,18 +223,25 @@ int create_task(tid_t* id, entry_point_t ep, void* arg, uint8_t prio)
 			task_table[i].prio = prio;
 			spinlock_init(&task_table[i].vma_lock);
 			task_table[i].vma_list = NULL;
+			task_table[i].vma_tree = NULL;
+			task_table[i].vma_cache = NULL;
 			task_table[i].heap = NULL;
+			memset(task_table[i].fildes_table, 0x00, sizeof(task_table[i].fildes_table));
 
 			spinlock_irqsave_init(&task_table[i].page_lock);
-			atomic_int32_set(&task_table[i].user_usage, 0);
+			percpu_counter_set(&task_table[i].user_usage, 0);
+			task_table[i].parent = current_task->id;
+			mailbox_wait_msg_init(&task_table[i].inbox);
 
-			/* Allocated new PGD or PML4 and copy page table */
+			/* Allocated new PGD or PML4, which contains only the kernel space */
 			task_table[i].page_map = get_pages(1);
 			if (BUILTIN_EXPECT(!task_table[i].page_map, 0))
 				goto out;
 
-			/* Copy page tables & user frames of current task to new one */
-			page_map_copy(&task_table[i]);
+			/* User mappings of the current task aren't inherited */
+			ret = page_map_create(&task_table[i]);
+			if (BUILTIN_EXPECT(ret, 0))
+				goto out;
 
 			if (id)
 				*id = i;
@@ -223,6 +273,163 @@ out:
 	return ret;
 }
 
+int sys_fork(void)
+{
+	task_t* parent_task = current_task;
+	task_t* child;
+	int ret = -ENOMEM;
+	uint32_t i, j, prio;
+
+	// only user-level tasks are able to fork
+	if (BUILTIN_EXPECT(!parent_task->heap, 0))
+		return -EINVAL;
+
+	/* reserve a slot, the address space is copied without the table_lock */
+	spinlock_irqsave_lock(&table_lock);
+
+	for(i=0; i<MAX_TASKS; i++) {
+		if (task_table[i].status == TASK_INVALID) {
+			// blocked and in no queue => nobody wakes it up
+			task_table[i].status = TASK_BLOCKED;
+			task_table[i].parent = parent_task->id;
+			break;
+		}
+	}
+
+	spinlock_irqsave_unlock(&table_lock);
+
+	if (BUILTIN_EXPECT(i >= MAX_TASKS, 0))
+		return -ENOMEM;
+
+	child = task_table+i;
+	child->id = i;
+	child->last_stack_pointer = NULL;
+	child->stack = create_stack(i);
+	child->prio = prio = parent_task->prio;
+	spinlock_init(&child->vma_lock);
+	child->vma_list = NULL;
+	child->vma_tree = NULL;
+	child->vma_cache = NULL;
+	child->heap = NULL;
+	mailbox_wait_msg_init(&child->inbox);
+
+	spinlock_irqsave_init(&child->page_lock);
+	percpu_counter_set(&child->user_usage, 0);
+
+	/* Allocated new PGD or PML4 and share the user frames copy-on-write */
+	child->page_map = get_pages(1);
+	if (BUILTIN_EXPECT(!child->page_map, 0))
+		goto out_slot;
+
+	ret = page_map_copy(child);
+	if (BUILTIN_EXPECT(ret, 0))
+		goto out_map;
+
+	ret = copy_vma_list(parent_task, child);
+	if (BUILTIN_EXPECT(ret, 0))
+		goto out_vma;
+
+	child->heap = (vma_t*) kmalloc(sizeof(vma_t));
+	if (BUILTIN_EXPECT(!child->heap, 0)) {
+		ret = -ENOMEM;
+		goto out_vma;
+	}
+	*child->heap = *parent_task->heap;
+	child->heap->prev = child->heap->next = NULL;
+
+	// copy register state => the new task returns to user space
+	ret = arch_fork(child);
+	if (BUILTIN_EXPECT(ret, 0))
+		goto out_heap;
+
+	// the child shares the open files with its parent
+	for(j=0; j<MAX_FILES; j++) {
+		child->fildes_table[j] = parent_task->fildes_table[j];
+		if (child->fildes_table[j])
+			atomic_int32_inc(&child->fildes_table[j]->count);
+	}
+
+	child->status = TASK_READY;
+
+	// add task in the readyqueues
+	spinlock_irqsave_lock(&readyqueues.lock);
+	readyqueues.prio_bitmap |= (1 << prio);
+	readyqueues.nr_tasks++;
+	if (!readyqueues.queue[prio-1].first) {
+		child->next = child->prev = NULL;
+		readyqueues.queue[prio-1].first = child;
+		readyqueues.queue[prio-1].last = child;
+	} else {
+		child->prev = readyqueues.queue[prio-1].last;
+		child->next = NULL;
+		readyqueues.queue[prio-1].last->next = child;
+		readyqueues.queue[prio-1].last = child;
+	}
+	spinlock_irqsave_unlock(&readyqueues.lock);
+
+	return i;
+
+	/* undo in reverse order */
+out_heap:
+	kfree(child->heap);
+	child->heap = NULL;
+out_vma:
+	drop_vma_list(child);
+out_map:
+	page_map_release(child);
+out_slot:
+	spinlock_irqsave_lock(&table_lock);
+	child->status = TASK_INVALID;
+	spinlock_irqsave_unlock(&table_lock);
+
+	return ret;
+}
+
+int sys_wait(int32_t* result)
+{
+	task_t* curr_task = current_task;
+	wait_msg_t msg = {0, 0};
+	uint32_t i;
+	int ret;
+
+	/*
+	 * do_exit() posts the message under the table_lock, before the child
+	 * is finished => check both under the table_lock
+	 */
+	spinlock_irqsave_lock(&table_lock);
+
+	// does a child already terminate?
+	ret = mailbox_wait_msg_tryfetch(&curr_task->inbox, &msg);
+	if (ret) {
+		ret = -ECHILD;
+		for(i=0; i<MAX_TASKS; i++) {
+			if ((i != curr_task->id) && (task_table[i].parent == curr_task->id)
+			    && (task_table[i].status != TASK_INVALID) && (task_table[i].status != TASK_FINISHED)) {
+				ret = 1;
+				break;
+			}
+		}
+	}
+
+	spinlock_irqsave_unlock(&table_lock);
+
+	if (ret < 0)
+		return ret;
+
+	// block until the next child terminates
+	if (ret > 0) {
+		ret = mailbox_wait_msg_fetch(&curr_task->inbox, &msg);
+		if (BUILTIN_EXPECT(ret, 0))
+			return ret;
+	}
+
+	// layout of WEXITSTATUS()
+	if (result)
+		*result = (msg.result & 0xff) << 8;
+
+	return msg.id;
+}
+
 int create_kernel_task(tid_t* id, entry_point_t ep, void* args, uint8_t prio)
 {
 	if (prio > MAX_PRIO)
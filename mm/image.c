@@ -0,0 +1,221 @@
+/*
+ * Copyright (c) eduOS contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the University nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <eduos/image.h>
+#include <eduos/stdlib.h>
+#include <eduos/stdio.h>
+#include <eduos/string.h>
+#include <eduos/spinlock.h>
+#include <eduos/memory.h>
+#include <eduos/vma.h>
+#include <eduos/fs.h>
+#include <eduos/errno.h>
+
+/** @brief Image cache and its lock */
+static image_t images[MAX_IMAGES];
+static spinlock_t image_lock = SPINLOCK_INIT;
+
+/** @brief Logical clock for the replacement of cache entries */
+static uint32_t image_clock = 0;
+
+/** @brief Release the shared page frames of an image */
+static void image_drop(image_t* image)
+{
+	uint32_t i;
+	size_t j, npages;
+
+	for (i=0; i<image->nsegs; i++) {
+		image_segment_t* seg = &image->segs[i];
+
+		if (!seg->frames)
+			continue;
+
+		npages = (seg->end - seg->start) >> PAGE_BITS;
+		for (j=0; j<npages; j++) {
+			if (seg->frames[j])
+				put_page(seg->frames[j]);
+		}
+
+		kfree(seg->frames);
+		seg->frames = NULL;
+	}
+
+	image->node = NULL;
+}
+
+/** @brief Search the cached segment, which backs a page of a VMA
+ *
+ * The segment has to map the same file content to the same address.
+ * The caller has to hold the image_lock.
+ */
+static size_t* image_frame(vma_t* vma, size_t viraddr)
+{
+	uint32_t i, j;
+	size_t off = viraddr - vma->start;
+
+	if (!vma->node || (vma->flags & VMA_WRITE))
+		return NULL;
+
+	for (i=0; i<MAX_IMAGES; i++) {
+		image_t* image = &images[i];
+
+		if (image->node != vma->node)
+			continue;
+
+		for (j=0; j<image->nsegs; j++) {
+			image_segment_t* seg = &image->segs[j];
+			size_t seg_off = viraddr - seg->start;
+			size_t vma_rest = (vma->file_size > off) ? vma->file_size - off : 0;
+			size_t seg_rest = (seg->file_size > seg_off) ? seg->file_size - seg_off : 0;
+
+			if (!seg->frames || (viraddr < seg->start) || (viraddr >= seg->end))
+				continue;
+
+			if ((seg->offset + seg_off != vma->offset + off) || (vma_rest != seg_rest))
+				continue;
+
+			image->used = ++image_clock;
+
+			return &seg->frames[seg_off >> PAGE_BITS];
+		}
+	}
+
+	return NULL;
+}
+
+int image_lookup(vfs_node_t* node, image_t* image)
+{
+	uint32_t i;
+	int ret = -ENOENT;
+
+	if (BUILTIN_EXPECT(!node || !image, 0))
+		return -EINVAL;
+
+	spinlock_lock(&image_lock);
+
+	for (i=0; i<MAX_IMAGES; i++) {
+		if (images[i].node != node)
+			continue;
+
+		/* the file was changed => the cached headers and frames are outdated */
+		if (images[i].generation != node->generation) {
+			image_drop(&images[i]);
+			break;
+		}
+
+		images[i].used = ++image_clock;
+		memcpy(image, &images[i], sizeof(image_t));
+		ret = 0;
+		break;
+	}
+
+	spinlock_unlock(&image_lock);
+
+	return ret;
+}
+
+int image_insert(const image_t* image)
+{
+	image_t* victim = NULL;
+	uint32_t i;
+	int ret = 0;
+
+	if (BUILTIN_EXPECT(!image || !image->node || (image->nsegs > MAX_SEGMENTS), 0))
+		return -EINVAL;
+
+	spinlock_lock(&image_lock);
+
+	for (i=0; i<MAX_IMAGES; i++) {
+		if (images[i].node == image->node) {
+			/* already cached by an other instance */
+			goto out;
+		}
+
+		/* prefer an unused entry, otherwise the least recently used */
+		if (!victim || (victim->node && (!images[i].node || (images[i].used < victim->used))))
+			victim = &images[i];
+	}
+
+	if (victim->node)
+		image_drop(victim);
+
+	memcpy(victim, image, sizeof(image_t));
+	victim->used = ++image_clock;
+
+	/* non-writable segments share their page frames */
+	for (i=0; i<victim->nsegs; i++) {
+		image_segment_t* seg = &victim->segs[i];
+		size_t size = ((seg->end - seg->start) >> PAGE_BITS) * sizeof(size_t);
+
+		seg->frames = NULL;
+		if (seg->flags & VMA_WRITE)
+			continue;
+
+		seg->frames = (size_t*) kmalloc(size);
+		if (seg->frames)
+			memset(seg->frames, 0x00, size);
+	}
+
+out:
+	spinlock_unlock(&image_lock);
+
+	return ret;
+}
+
+size_t image_getpage(vma_t* vma, size_t viraddr)
+{
+	size_t* frame;
+	size_t ret = 0;
+
+	spinlock_lock(&image_lock);
+
+	frame = image_frame(vma, viraddr);
+	if (frame && *frame && (page_ref(*frame) > 0))
+		ret = *frame;
+
+	spinlock_unlock(&image_lock);
+
+	return ret;
+}
+
+int image_setpage(vma_t* vma, size_t viraddr, size_t phyaddr)
+{
+	size_t* frame;
+	int ret = -EINVAL;
+
+	spinlock_lock(&image_lock);
+
+	frame = image_frame(vma, viraddr);
+	if (frame && !*frame && (page_ref(phyaddr) > 0)) {
+		*frame = phyaddr;
+		ret = 0;
+	}
+
+	spinlock_unlock(&image_lock);
+
+	return ret;
+}
@@ -33,7 +33,11 @@
 #include <eduos/malloc.h>
 #include <eduos/spinlock.h>
 #include <eduos/memory.h>
+#include <eduos/vma.h>
+#include <eduos/vmem.h>
+#include <eduos/errno.h>
 #include <asm/page.h>
+#include <asm/tlb.h>
 
 /// A linked list for each binary size exponent
 static buddy_t* buddy_lists[BUDDY_LISTS] = { [0 ... BUDDY_LISTS-1] = NULL };
@@ -132,27 +136,40 @@ void buddy_dump(void)
 void* palloc(size_t sz, uint32_t flags)
 {
 	size_t phyaddr, viraddr;
+	size_t align = PAGE_SIZE, bits = PG_RW|PG_GLOBAL;
 	uint32_t npages = PAGE_FLOOR(sz) >> PAGE_BITS;
 	int err;
 
 	//kprintf("palloc(%lu) (%lu pages)\n", sz, npages);
 
-	// get free virtual address space
-	viraddr = vma_alloc(npages*PAGE_SIZE, VMA_HEAP);
+	// large pages have to be aligned in the virtual and physical address space
+	if ((flags & VMA_HUGE) && (npages*PAGE_SIZE >= PAGE_HUGE_SIZE)) {
+		align = PAGE_HUGE_SIZE;
+		bits |= PG_PSE;
+	}
+
+	// get free virtual address space, preferably from the arena
+	viraddr = (align == PAGE_SIZE) ? vmem_alloc(npages) : 0;
+	if (!viraddr)
+		viraddr = vma_alloc_aligned(npages*PAGE_SIZE, align, VMA_HEAP);
 	if (BUILTIN_EXPECT(!viraddr, 0))
 		return NULL;
 
-	// get continous physical pages
-	phyaddr = get_pages(npages);
+	// get continous physical pages (page_map() uses 4 KiB pages, if they aren't aligned)
+	phyaddr = get_aligned_pages(npages, align >> PAGE_BITS);
+	if (!phyaddr && (align > PAGE_SIZE))
+		phyaddr = get_pages(npages);
 	if (BUILTIN_EXPECT(!phyaddr, 0)) {
-		vma_free(viraddr, viraddr+npages*PAGE_SIZE);
+		if (vmem_free(viraddr, npages) == -ENOENT)
+			vma_free(viraddr, viraddr+npages*PAGE_SIZE);
 		return NULL;
 	}
 
 	// map physical pages to VMA
-	err = page_map(viraddr, phyaddr, npages, PG_RW|PG_GLOBAL);
+	err = page_map(viraddr, phyaddr, npages, bits);
 	if (BUILTIN_EXPECT(err, 0)) {
-		vma_free(viraddr, viraddr+npages*PAGE_SIZE);
+		if (vmem_free(viraddr, npages) == -ENOENT)
+			vma_free(viraddr, viraddr+npages*PAGE_SIZE);
 		put_pages(phyaddr, npages);
 		return NULL;
 	}
@@ -165,19 +182,39 @@ void pfree(void* addr, size_t sz)
 	if (BUILTIN_EXPECT(!addr || !sz, 0))
 		return;
 
-	size_t i;
+	size_t i, n, start;
 	size_t phyaddr;
 	size_t viraddr = (size_t) addr & PAGE_MASK;
 	uint32_t npages = PAGE_FLOOR(sz) >> PAGE_BITS;
+	tlb_batch_t batch;
+
+	tlb_batch_init(&batch);
 
 	// memory is probably not continuously mapped! (userspace heap)
-	for (i=0; i<npages; i++) {
+	// => collect the runs of contiguous page frames
+	for (i=start=0; i<npages; i+=n) {
 		phyaddr = virt_to_phys(viraddr+i*PAGE_SIZE);
-		put_page(phyaddr);
+		for (n=1; (i+n<npages) && phyaddr && (virt_to_phys(viraddr+(i+n)*PAGE_SIZE) == phyaddr+n*PAGE_SIZE); n++)
+			;
+		if (!phyaddr)
+			continue;
+
+		// the page frames are released, after no core is able to access them
+		if (batch.nframes >= TLB_BATCH_FRAMES) {
+			page_unmap(viraddr+start*PAGE_SIZE, i-start);
+			tlb_batch_flush(&batch);
+			start = i;
+		}
+
+		tlb_batch_free(&batch, phyaddr, n);
 	}
 
-	page_unmap(viraddr, npages);
-	vma_free(viraddr, viraddr+npages*PAGE_SIZE);
+	page_unmap(viraddr+start*PAGE_SIZE, npages-start);
+	tlb_batch_flush(&batch);
+
+	// ranges outside of the arena belong to the VMA list
+	if (vmem_free(viraddr, npages) == -ENOENT)
+		vma_free(viraddr, viraddr+npages*PAGE_SIZE);
 }
 
 void* kmalloc(size_t sz)
@@ -30,10 +30,17 @@
 #include <eduos/stdio.h>
 #include <eduos/string.h>
 #include <eduos/spinlock.h>
+#include <eduos/memory.h>
+#include <eduos/vmem.h>
+#include <eduos/percpu_counter.h>
+#include <eduos/tasks_types.h>
+#include <eduos/errno.h>
 
 #include <asm/atomic.h>
 #include <asm/multiboot.h>
 #include <asm/page.h>
+#include <asm/processor.h>
+#include <asm/irqflags.h>
 
 /*
  * Note that linker symbols are not variables, they have no memory allocated for
@@ -43,13 +50,47 @@ extern const void kernel_start;
 extern const void kernel_end;
 
 static char stack[MAX_TASKS-1][KERNEL_STACK_SIZE];
-static char bitmap[BITMAP_SIZE];
+
+/** Bitmap of all page frames, its size is determined by memory_init() */
+static uint8_t* bitmap = NULL;
+/** Descriptors of all page frames, they are located in front of the bitmap */
+static page_frame_t* frames = NULL;
+/** Number of page frames, which are covered by the bitmap */
+static size_t nframes = 0;
+
+/** Page frames for page tables, which are required before the bitmap is available */
+static size_t early_start = 0;
+static size_t early_end = 0;
+
+/** Page tables to map the Multiboot memory map and the module list */
+static uint8_t boot_frames[2*PAGE_LEVELS][PAGE_SIZE] __attribute__ ((aligned (PAGE_SIZE)));
+static size_t boot_frames_used = 0;
 
 static spinlock_t bitmap_lock = SPINLOCK_INIT;
 
 atomic_int32_t total_pages = ATOMIC_INIT(0);
-atomic_int32_t total_allocated_pages = ATOMIC_INIT(0);
-atomic_int32_t total_available_pages = ATOMIC_INIT(0);
+percpu_counter_t total_allocated_pages = PERCPU_COUNTER_INIT(0);
+percpu_counter_t total_available_pages = PERCPU_COUNTER_INIT(0);
+
+/** Pool of page frames, which are already filled with zeros */
+static size_t zero_pool[ZERO_POOL_SIZE];
+static uint32_t zero_pool_count = 0;
+static spinlock_irqsave_t zero_pool_lock = SPINLOCK_IRQSAVE_INIT;
+
+atomic_int32_t zero_pool_hits = ATOMIC_INIT(0);
+atomic_int32_t zero_pool_misses = ATOMIC_INIT(0);
+
+#ifdef CONFIG_BENCHMARK
+/* Counters of the large heap pages and the TLB shootdowns */
+extern atomic_int32_t heap_huge_faults;
+extern atomic_int32_t heap_huge_fallbacks;
+extern atomic_int32_t heap_huge_collapses;
+extern atomic_int32_t tlb_batches;
+extern atomic_int32_t tlb_shootdowns;
+extern atomic_int32_t tlb_ipis;
+extern uint64_t tlb_shootdown_cycles;
+extern uint64_t tlb_shootdown_max;
+#endif
 
 void* create_stack(tid_t id)
 {
@@ -68,6 +109,10 @@ inline static int page_marked(size_t i)
 	size_t index = i >> 3;
 	size_t mod = i & 0x7;
 
+	// frames beyond the end of the bitmap are never available
+	if (BUILTIN_EXPECT(i >= nframes, 0))
+		return 1;
+
 	return  (bitmap[index] & (1 << mod));
 }
 
@@ -76,7 +121,8 @@ inline static void page_set_mark(size_t i)
 	size_t index = i >> 3;
 	size_t mod = i & 0x7;
 
-	bitmap[index] = bitmap[index] | (1 << mod);
+	if (BUILTIN_EXPECT(i < nframes, 1))
+		bitmap[index] = bitmap[index] | (1 << mod);
 }
 
 inline static void page_clear_mark(size_t i)
@@ -84,7 +130,27 @@ inline static void page_clear_mark(size_t i)
 	size_t index = i / 8;
 	size_t mod = i % 8;
 
-	bitmap[index] = bitmap[index] & ~(1 << mod);
+	if (BUILTIN_EXPECT(i < nframes, 1))
+		bitmap[index] = bitmap[index] & ~(1 << mod);
+}
+
+/** @brief Mark free page frames as allocated
+ *
+ * The caller has to hold the bitmap_lock.
+ */
+static void page_claim(size_t off, size_t npages)
+{
+	size_t cnt;
+
+	for (cnt=0; cnt<npages; cnt++) {
+		page_set_mark(off+cnt);
+		atomic_int32_set(&frames[off+cnt].count, 1);
+		frames[off+cnt].flags = 0;
+		frames[off+cnt].owner = current_task->id;
+	}
+
+	percpu_counter_add(&total_allocated_pages, npages);
+	percpu_counter_sub(&total_available_pages, npages);
 }
 
 size_t get_pages(size_t npages)
@@ -94,7 +160,27 @@ size_t get_pages(size_t npages)
 
 	if (BUILTIN_EXPECT(!npages, 0))
 		return 0;
-	if (BUILTIN_EXPECT(npages > atomic_int32_read(&total_available_pages), 0))
+
+	// memory_init() is still running => use the reserved frames
+	if (BUILTIN_EXPECT(!bitmap, 0)) {
+		if (early_start + npages*PAGE_SIZE <= early_end) {
+			off = early_start;
+			early_start += npages*PAGE_SIZE;
+
+			return off;
+		}
+
+		if (boot_frames_used + npages <= 2*PAGE_LEVELS) {
+			off = (size_t) boot_frames[boot_frames_used];
+			boot_frames_used += npages;
+
+			return off;
+		}
+
+		return 0;
+	}
+
+	if (BUILTIN_EXPECT(percpu_counter_compare(&total_available_pages, npages) < 0, 0))
 		return 0;
 
 	spinlock_lock(&bitmap_lock);
@@ -102,24 +188,19 @@ size_t get_pages(size_t npages)
 	if (alloc_start == (size_t)-1)
 		 alloc_start = ((size_t) &kernel_end >> PAGE_BITS);
 	off = 1;
-	while (off <= BITMAP_SIZE*8 - npages) {
+	while (off <= nframes - npages) {
 		for (cnt=0; cnt<npages; cnt++) {
-			if (page_marked(((off+alloc_start)%(BITMAP_SIZE*8 - npages))+cnt))
+			if (page_marked(((off+alloc_start)%(nframes - npages))+cnt))
 				goto next;
 		}
 
-		off = (off+alloc_start) % (BITMAP_SIZE*8 - npages);
+		off = (off+alloc_start) % (nframes - npages);
 		alloc_start = off+npages;
 
-		for (cnt=0; cnt<npages; cnt++) {
-			page_set_mark(off+cnt);
-		}
+		page_claim(off, npages);
 
 		spinlock_unlock(&bitmap_lock);
 
-		atomic_int32_add(&total_allocated_pages, npages);
-		atomic_int32_sub(&total_available_pages, npages);
-
 		return off << PAGE_BITS;
 
 next:		off += cnt+1;
@@ -130,6 +211,42 @@ next:		off += cnt+1;
 	return 0;
 }
 
+size_t get_aligned_pages(size_t npages, size_t align)
+{
+	size_t cnt, off;
+
+	if (align <= 1)
+		return get_pages(npages);
+
+	if (BUILTIN_EXPECT(!npages || (align & (align-1)) || !bitmap, 0))
+		return 0;
+	if (BUILTIN_EXPECT(percpu_counter_compare(&total_available_pages, npages) < 0, 0))
+		return 0;
+
+	spinlock_lock(&bitmap_lock);
+
+	for (off=align; off+npages <= nframes; ) {
+		for (cnt=0; cnt<npages; cnt++) {
+			if (page_marked(off+cnt))
+				break;
+		}
+
+		if (cnt == npages) {
+			page_claim(off, npages);
+			spinlock_unlock(&bitmap_lock);
+
+			return off << PAGE_BITS;
+		}
+
+		// continue at the next boundary behind the used frame
+		off = (off + cnt + align) & ~(align-1);
+	}
+
+	spinlock_unlock(&bitmap_lock);
+
+	return 0;
+}
+
 int put_pages(size_t phyaddr, size_t npages)
 {
 	size_t i, ret = 0;
@@ -139,26 +256,173 @@ int put_pages(size_t phyaddr, size_t npages)
 		return -EINVAL;
 	if (BUILTIN_EXPECT(!npages, 0))
 		return -EINVAL;
+	if (BUILTIN_EXPECT(!bitmap || base+npages > nframes, 0))
+		return -EINVAL;
 
 	spinlock_lock(&bitmap_lock);
 
 	for (i=0; i<npages; i++) {
-		if (page_marked(base+i)) {
+		page_frame_t* frame = frames + base + i;
+
+		if (!page_marked(base+i) || (frame->flags & PF_PINNED))
+			continue;
+
+		switch (atomic_int32_dec(&frame->count)) {
+		case 0:
+			// last reference is dropped => release page frame
+			frame->flags = 0;
+			frame->owner = 0;
 			page_clear_mark(base+i);
 			ret++;
+			break;
+		case 1:
+			frame->flags &= ~PF_SHARED;
+			break;
+		default:
+			break;
 		}
 	}
 
 	spinlock_unlock(&bitmap_lock);
 
-	atomic_int32_sub(&total_allocated_pages, ret);
-	atomic_int32_add(&total_available_pages, ret);
+	percpu_counter_sub(&total_allocated_pages, ret);
+	percpu_counter_add(&total_available_pages, ret);
 
 	return ret;
 }
 
+int page_ref(size_t phyaddr)
+{
+	page_frame_t* frame = get_frame(phyaddr);
+	int ret;
+
+	if (BUILTIN_EXPECT(!frame, 0))
+		return -EINVAL;
+
+	spinlock_lock(&bitmap_lock);
+
+	if (BUILTIN_EXPECT(!page_marked(phyaddr >> PAGE_BITS), 0)) {
+		spinlock_unlock(&bitmap_lock);
+		return -EINVAL;
+	}
+
+	ret = atomic_int32_inc(&frame->count);
+	if (ret > 1)
+		frame->flags |= PF_SHARED;
+
+	spinlock_unlock(&bitmap_lock);
+
+	return ret;
+}
+
+page_frame_t* get_frame(size_t phyaddr)
+{
+	size_t pfn = phyaddr >> PAGE_BITS;
+
+	if (BUILTIN_EXPECT(!frames || pfn >= nframes, 0))
+		return NULL;
+
+	return frames + pfn;
+}
+
+size_t get_zeroed_page(int* zeroed)
+{
+	size_t phyaddr = 0;
+
+	spinlock_irqsave_lock(&zero_pool_lock);
+	if (zero_pool_count > 0)
+		phyaddr = zero_pool[--zero_pool_count];
+	spinlock_irqsave_unlock(&zero_pool_lock);
+
+	if (phyaddr) {
+		frames[phyaddr >> PAGE_BITS].flags &= ~PF_ZEROED;
+		frames[phyaddr >> PAGE_BITS].owner = current_task->id;
+		atomic_int32_inc(&zero_pool_hits);
+		*zeroed = 1;
+
+		return phyaddr;
+	}
+
+	atomic_int32_inc(&zero_pool_misses);
+	*zeroed = 0;
+
+	return get_page();
+}
+
+int zero_pool_fill(void)
+{
+	size_t viraddr, phyaddr;
+	uint8_t flags;
+#ifdef CONFIG_X86_32
+	static size_t window = 0;
+	int ret;
+#endif
+
+	/* don't hold back frames, if the memory is getting low */
+	if ((zero_pool_count >= ZERO_POOL_SIZE) ||
+	    (percpu_counter_read(&total_available_pages) < 2*ZERO_POOL_SIZE))
+		return 0;
+
+	/*
+	 * The idle task runs only if no other task is ready. Therefore,
+	 * it must not be preempted while holding the locks of the
+	 * memory subsystem.
+	 */
+	flags = irq_nested_disable();
+#ifdef CONFIG_X86_64
+	phyaddr = get_page();
+	irq_nested_enable(flags);
+	if (BUILTIN_EXPECT(!phyaddr, 0))
+		return -ENOMEM;
+
+	viraddr = (size_t) phys_to_virt(phyaddr);
+#elif defined(CONFIG_X86_32)
+	if (!window) // statically allocate virtual memory area
+		window = vma_alloc(PAGE_SIZE, VMA_HEAP);
+
+	phyaddr = get_page();
+	if (BUILTIN_EXPECT(!window || !phyaddr, 0)) {
+		if (phyaddr)
+			put_page(phyaddr);
+		irq_nested_enable(flags);
+		return -ENOMEM;
+	}
+
+	/* the window is only remapped, page_map() flushes the old TLB entry */
+	ret = page_map(window, phyaddr, 1, PG_GLOBAL|PG_RW);
+	irq_nested_enable(flags);
+	if (BUILTIN_EXPECT(ret, 0)) {
+		put_page(phyaddr);
+		return ret;
+	}
+
+	viraddr = window;
+#endif
+
+	memzero_page((void*) viraddr, PAGE_SIZE);
+
+	frames[phyaddr >> PAGE_BITS].flags |= PF_ZEROED;
+
+	spinlock_irqsave_lock(&zero_pool_lock);
+	if (zero_pool_count < ZERO_POOL_SIZE) {
+		zero_pool[zero_pool_count++] = phyaddr;
+		phyaddr = 0;
+	}
+	spinlock_irqsave_unlock(&zero_pool_lock);
+
+	if (phyaddr)
+		put_page(phyaddr);
+
+	return 1;
+}
+
 int copy_page(size_t pdest, size_t psrc)
 {
+#ifdef CONFIG_X86_64
+	memcpy_page(phys_to_virt(pdest), phys_to_virt(psrc), PAGE_SIZE);
+
+	return 0;
+#elif defined(CONFIG_X86_32)
 	int err;
 
 	static size_t viraddr;
@@ -183,25 +447,233 @@ int copy_page(size_t pdest, size_t psrc)
 		return -ENOMEM;
 	}
 
-	kprintf("copy_page: copy page frame from: %#lx (%#lx) to %#lx (%#lx)\n", vsrc, psrc, vdest, pdest); // TODO remove
-
 	// copy the whole page
-	memcpy((void*) vdest, (void*) vsrc, PAGE_SIZE);
+	memcpy_page((void*) vdest, (void*) vsrc, PAGE_SIZE);
 
 	// householding
 	page_unmap(viraddr, 2);
 
 	return 0;
+#endif
+}
+
+/** @brief Determine the number of page frames up to the highest usable address */
+static size_t count_frames(void)
+{
+	uint64_t end, max = 0;
+
+	if (mb_info->flags & MULTIBOOT_INFO_MEM_MAP) {
+		multiboot_memory_map_t* mmap = (multiboot_memory_map_t*) ((size_t) mb_info->mmap_addr);
+		multiboot_memory_map_t* mmap_end = (void*) ((size_t) mb_info->mmap_addr + mb_info->mmap_length);
+
+		while (mmap < mmap_end) {
+			if (mmap->type == MULTIBOOT_MEMORY_AVAILABLE) {
+				end = mmap->addr + mmap->len;
+				if (end > max)
+					max = end;
+			}
+			mmap = (multiboot_memory_map_t*) ((size_t) mmap + sizeof(uint32_t) + mmap->size);
+		}
+	} else if (mb_info->flags & MULTIBOOT_INFO_MEM)
+		max = (1ULL << 20) + ((uint64_t) mb_info->mem_upper << 10); /* mem_upper starts at 1 MiB */
+
+	max >>= PAGE_BITS;
+
+	// we are only able to address PHYS_BITS
+	if (max > (1ULL << (PHYS_BITS - PAGE_BITS)))
+		max = 1ULL << (PHYS_BITS - PAGE_BITS);
+
+	return (size_t) max;
+}
+
+/** @brief Size of the intersection of [s, e) and [start, end) */
+static inline size_t range_overlap(uint64_t s, uint64_t e, size_t start, size_t end)
+{
+	if (s < start)
+		s = start;
+	if (e > end)
+		e = end;
+
+	return (s < e) ? (size_t) (e - s) : 0;
+}
+
+size_t phys_ram_size(size_t start, size_t end)
+{
+	size_t ret = 0;
+
+	if (mb_info->flags & MULTIBOOT_INFO_MEM_MAP) {
+		multiboot_memory_map_t* mmap = (multiboot_memory_map_t*) ((size_t) mb_info->mmap_addr);
+		multiboot_memory_map_t* mmap_end = (void*) ((size_t) mb_info->mmap_addr + mb_info->mmap_length);
+
+		while (mmap < mmap_end) {
+			if (mmap->type == MULTIBOOT_MEMORY_AVAILABLE)
+				ret += range_overlap(mmap->addr, mmap->addr + mmap->len, start, end);
+			mmap = (multiboot_memory_map_t*) ((size_t) mmap + sizeof(uint32_t) + mmap->size);
+		}
+	} else if (mb_info->flags & MULTIBOOT_INFO_MEM) {
+		ret += range_overlap(0, (uint64_t) mb_info->mem_lower << 10, start, end);
+		ret += range_overlap(1ULL << 20, (1ULL << 20) + ((uint64_t) mb_info->mem_upper << 10), start, end); /* mem_upper starts at 1 MiB */
+	}
+
+	/* overlapping regions of a broken memory map */
+	if (ret > end - start)
+		ret = end - start;
+
+	return ret;
+}
+
+/** @brief Check if a physical memory range is already in use
+ *
+ * @return
+ * - 0 if the range is free
+ * - the end address of the region, which overlaps with the range
+ */
+static size_t range_used(size_t start, size_t end)
+{
+	size_t rstart, rend;
+	unsigned int i;
+
+#define OVERLAPS(s, e) \
+	rstart = PAGE_CEIL((size_t) (s)); rend = PAGE_FLOOR((size_t) (e)); \
+	if ((start < rend) && (end > rstart)) return rend;
+
+	OVERLAPS(&kernel_start, &kernel_end);
+	OVERLAPS(mb_info, (size_t) mb_info + sizeof(multiboot_info_t));
+	OVERLAPS(mb_info->mmap_addr, mb_info->mmap_addr + mb_info->mmap_length);
+
+	if (mb_info->flags & MULTIBOOT_INFO_MODS) {
+		multiboot_module_t* mmodule = (multiboot_module_t*) ((size_t) mb_info->mods_addr);
+
+		OVERLAPS(mb_info->mods_addr, mb_info->mods_addr + mb_info->mods_count*sizeof(multiboot_module_t));
+		for(i=0; i<mb_info->mods_count; i++) {
+			OVERLAPS(mmodule[i].mod_start, mmodule[i].mod_end);
+		}
+	}
+#undef OVERLAPS
+
+	return 0;
+}
+
+/** @brief Search the memory map for a free physical memory range
+ *
+ * The range is mapped 1:1 into the kernel space.
+ * Therefore, it has to be located below VMA_KERN_MAX.
+ *
+ * @return Physical start address of the range or 0 on failure
+ */
+static size_t find_free_range(size_t size)
+{
+	size_t addr, end, used;
+
+	if (mb_info->flags & MULTIBOOT_INFO_MEM_MAP) {
+		multiboot_memory_map_t* mmap = (multiboot_memory_map_t*) ((size_t) mb_info->mmap_addr);
+		multiboot_memory_map_t* mmap_end = (void*) ((size_t) mb_info->mmap_addr + mb_info->mmap_length);
+
+		while (mmap < mmap_end) {
+			if ((mmap->type == MULTIBOOT_MEMORY_AVAILABLE) && (mmap->addr < VMA_KERN_MAX)) {
+				addr = PAGE_FLOOR((size_t) mmap->addr);
+				end = (mmap->addr + mmap->len > VMA_KERN_MAX) ? VMA_KERN_MAX : (size_t) (mmap->addr + mmap->len);
+
+				while (addr + size <= end) {
+					if (addr < PAGE_FLOOR((size_t) &kernel_end))
+						addr = PAGE_FLOOR((size_t) &kernel_end);
+					else if ((used = range_used(addr, addr + size)))
+						addr = used;
+					else
+						return addr;
+				}
+			}
+			mmap = (multiboot_memory_map_t*) ((size_t) mmap + sizeof(uint32_t) + mmap->size);
+		}
+	} else if (mb_info->flags & MULTIBOOT_INFO_MEM) {
+		addr = PAGE_FLOOR((size_t) &kernel_end);
+		end = (1UL << 20) + ((size_t) mb_info->mem_upper << 10);
+		if (end > VMA_KERN_MAX)
+			end = VMA_KERN_MAX;
+
+		while (addr + size <= end) {
+			if ((used = range_used(addr, addr + size)))
+				addr = used;
+			else
+				return addr;
+		}
+	}
+
+	return 0;
+}
+
+/** @brief Mark a physical memory range as used and pin its page frames */
+static void reserve_range(size_t start, size_t end)
+{
+	size_t addr, pfn;
+	int32_t n = 0;
+
+	for(addr=PAGE_CEIL(start); addr<end; addr+=PAGE_SIZE) {
+		pfn = addr >> PAGE_BITS;
+		if (pfn >= nframes)
+			break;
+
+		if (!page_marked(pfn)) {
+			page_set_mark(pfn);
+			n++;
+		}
+
+		atomic_int32_set(&frames[pfn].count, 1);
+		frames[pfn].flags = PF_PINNED;
+	}
+
+	percpu_counter_add(&total_allocated_pages, n);
+	percpu_counter_sub(&total_available_pages, n);
 }
 
 int memory_init(void)
 {
 	unsigned int i;
-	size_t addr;
+	size_t addr, meta_start, meta_size, frames_size, early_size, mods_size = 0;
 	int ret = 0;
 
-	// mark all memory as used
-	memset(bitmap, 0xff, BITMAP_SIZE);
+	if (BUILTIN_EXPECT(!mb_info || !(mb_info->flags & (MULTIBOOT_INFO_MEM_MAP|MULTIBOOT_INFO_MEM)), 0)) {
+		kputs("Unable to initialize the memory management subsystem\n");
+		while (1) HALT;
+	}
+
+	// entry.asm maps only mb_info => map the memory map and the module list 1:1
+	if (mb_info->flags & MULTIBOOT_INFO_MEM_MAP) {
+		addr = PAGE_CEIL((size_t) mb_info->mmap_addr);
+		page_map(addr, addr, (PAGE_FLOOR(mb_info->mmap_addr + mb_info->mmap_length) - addr) >> PAGE_BITS, PG_GLOBAL);
+	}
+	if (mb_info->flags & MULTIBOOT_INFO_MODS) {
+		addr = PAGE_CEIL((size_t) mb_info->mods_addr);
+		page_map(addr, addr, (PAGE_FLOOR(mb_info->mods_addr + mb_info->mods_count*sizeof(multiboot_module_t)) - addr) >> PAGE_BITS, PG_GLOBAL);
+	}
+
+	// the bitmap and the descriptors cover all frames up to the highest usable address
+	nframes = count_frames();
+	frames_size = nframes * sizeof(page_frame_t);
+	meta_size = PAGE_FLOOR(frames_size + ((nframes + 7) >> 3));
+
+	if (mb_info->flags & MULTIBOOT_INFO_MODS) {
+		multiboot_module_t* mmodule = (multiboot_module_t*) ((size_t) mb_info->mods_addr);
+		for(i=0; i<mb_info->mods_count; i++)
+			mods_size += PAGE_FLOOR(mmodule[i].mod_end - mmodule[i].mod_start);
+	}
+
+	/*
+	 * Until the bitmap is initialized, page tables to map the bitmap
+	 * and the modules are taken from a small range behind the bitmap.
+	 */
+	early_size = ((meta_size + mods_size) >> (PAGE_BITS + PAGE_MAP_BITS)) + PAGE_LEVELS * (mb_info->mods_count + 2);
+	early_size <<= PAGE_BITS;
+
+	// the metadata itself is placed in free memory, which is taken from the memory map
+	meta_start = find_free_range(meta_size + early_size);
+	if (BUILTIN_EXPECT(!meta_start, 0)) {
+		kprintf("Unable to find %lu KiB for the page frame metadata\n", (meta_size + early_size) >> 10);
+		while (1) HALT;
+	}
+
+	early_start = meta_start + meta_size;
+	early_end = early_start + early_size;
 
 	// enable paging and map Multiboot modules etc.
 	ret = page_init();
@@ -210,84 +682,99 @@ int memory_init(void)
 		return ret;
 	}
 
+	// map the metadata 1:1 into the kernel space
+	ret = page_map(meta_start, meta_start, meta_size >> PAGE_BITS, PG_GLOBAL|PG_RW);
+	if (BUILTIN_EXPECT(ret, 0)) {
+		kputs("Failed to map the page frame metadata!\n");
+		return ret;
+	}
+
+	// mark all memory as used
+	memset((void*) meta_start, 0x00, frames_size);
+	memset((void*) (meta_start + frames_size), 0xff, meta_size - frames_size);
+	frames = (page_frame_t*) meta_start;
+	bitmap = (uint8_t*) (meta_start + frames_size);
+
 	// parse multiboot information for available memory
-	if (mb_info) {
-		if (mb_info->flags & MULTIBOOT_INFO_MEM_MAP) {
-			size_t end_addr;
-			multiboot_memory_map_t* mmap = (multiboot_memory_map_t*) ((size_t) mb_info->mmap_addr);
-			multiboot_memory_map_t* mmap_end = (void*) ((size_t) mb_info->mmap_addr + mb_info->mmap_length);
-
-			// mark available memory as free
-			while (mmap < mmap_end) {
-				if (mmap->type == MULTIBOOT_MEMORY_AVAILABLE) {
-					/* set the available memory as "unused" */
-					addr = mmap->addr;
-					end_addr = addr + mmap->len;
-
-					while ((addr < end_addr) && (addr < (BITMAP_SIZE*8*PAGE_SIZE))) {
-						if (page_marked(addr >> PAGE_BITS)) {
-							page_clear_mark(addr >> PAGE_BITS);
-							atomic_int32_inc(&total_pages);
-							atomic_int32_inc(&total_available_pages);
-						}
-						addr += PAGE_SIZE;
+	if (mb_info->flags & MULTIBOOT_INFO_MEM_MAP) {
+		multiboot_memory_map_t* mmap = (multiboot_memory_map_t*) ((size_t) mb_info->mmap_addr);
+		multiboot_memory_map_t* mmap_end = (void*) ((size_t) mb_info->mmap_addr + mb_info->mmap_length);
+
+		// mark available memory as free
+		while (mmap < mmap_end) {
+			if (mmap->type == MULTIBOOT_MEMORY_AVAILABLE) {
+				/* set the available memory as "unused" */
+				uint64_t frame = (mmap->addr + PAGE_SIZE - 1) >> PAGE_BITS;
+				uint64_t last = (mmap->addr + mmap->len) >> PAGE_BITS;
+				int32_t n = 0;
+
+				if (last > nframes)
+					last = nframes;
+
+				for(; frame<last; frame++) {
+					if (page_marked(frame)) {
+						page_clear_mark(frame);
+						n++;
 					}
 				}
-				mmap = (multiboot_memory_map_t*) ((size_t) mmap + sizeof(uint32_t) + mmap->size);
+
+				atomic_int32_add(&total_pages, n);
+				percpu_counter_add(&total_available_pages, n);
 			}
-		} else if (mb_info->flags & MULTIBOOT_INFO_MEM) {
-			size_t page;
-			size_t pages_lower = mb_info->mem_lower >> 2; /* KiB to page number */
-			size_t pages_upper = mb_info->mem_upper >> 2;
+			mmap = (multiboot_memory_map_t*) ((size_t) mmap + sizeof(uint32_t) + mmap->size);
+		}
+	} else {
+		size_t page;
+		size_t pages_lower = mb_info->mem_lower >> 2; /* KiB to page number */
+		size_t pages_upper = mb_info->mem_upper >> 2;
 
-			for (page=0; page<pages_lower; page++)
-				page_clear_mark(page);
+		for (page=0; page<pages_lower; page++)
+			page_clear_mark(page);
 
-			if (pages_upper > BITMAP_SIZE*8-256)
-				pages_upper = BITMAP_SIZE*8-256;
+		if (pages_upper > nframes-256)
+			pages_upper = nframes-256;
 
-			for (page=0; page<pages_upper; page++)
-				page_clear_mark(page + 256); /* 1 MiB == 256 pages offset */
+		for (page=0; page<pages_upper; page++)
+			page_clear_mark(page + 256); /* 1 MiB == 256 pages offset */
 
-			atomic_int32_add(&total_pages, pages_lower + pages_upper);
-			atomic_int32_add(&total_available_pages, pages_lower + pages_upper);
-		}
-		else {
-			kputs("Unable to initialize the memory management subsystem\n");
-			while (1) HALT;
-		}
+		atomic_int32_add(&total_pages, pages_lower + pages_upper);
+		percpu_counter_add(&total_available_pages, pages_lower + pages_upper);
+	}
 
-		// mark mb_info as used
-		page_set_mark((size_t) mb_info >> PAGE_BITS);
-		atomic_int32_inc(&total_allocated_pages);
-		atomic_int32_dec(&total_available_pages);
+	// mark mb_info and the memory map as used
+	reserve_range((size_t) mb_info, (size_t) mb_info + sizeof(multiboot_info_t));
+	if (mb_info->flags & MULTIBOOT_INFO_MEM_MAP)
+		reserve_range(mb_info->mmap_addr, mb_info->mmap_addr + mb_info->mmap_length);
 
+	/*
+	 * Modules like the init ram disk are already loaded.
+	 * Therefore, we set these pages as used.
+	 */
+	if (mb_info->flags & MULTIBOOT_INFO_MODS) {
+		multiboot_module_t* mmodule = (multiboot_module_t*) ((size_t) mb_info->mods_addr);
 
-		if (mb_info->flags & MULTIBOOT_INFO_MODS) {
-			// mark modules list as used
-			for(addr=mb_info->mods_addr; addr<mb_info->mods_addr+mb_info->mods_count*sizeof(multiboot_module_t); addr+=PAGE_SIZE) {
-				page_set_mark(addr >> PAGE_BITS);
-				atomic_int32_inc(&total_allocated_pages);
-				atomic_int32_dec(&total_available_pages);
-			}
+		// mark modules list as used
+		reserve_range(mb_info->mods_addr, mb_info->mods_addr + mb_info->mods_count*sizeof(multiboot_module_t));
 
-			// mark modules as used
-			multiboot_module_t* mmodule = (multiboot_module_t*) ((size_t) mb_info->mods_addr);
-			for(i=0; i<mb_info->mods_count; i++) {
-				for(addr=mmodule[i].mod_start; addr<mmodule[i].mod_end; addr+=PAGE_SIZE) {
-					page_set_mark(addr >> PAGE_BITS);
-					atomic_int32_inc(&total_allocated_pages);
-					atomic_int32_dec(&total_available_pages);
-				}
-			}
-		}
+		// mark modules as used
+		for(i=0; i<mb_info->mods_count; i++)
+			reserve_range(mmodule[i].mod_start, mmodule[i].mod_end);
 	}
 
 	// mark kernel as used
-	for(addr=(size_t) &kernel_start; addr<(size_t) &kernel_end; addr+=PAGE_SIZE) {
-		page_set_mark(addr >> PAGE_BITS);
-		atomic_int32_inc(&total_allocated_pages);
-		atomic_int32_dec(&total_available_pages);
+	reserve_range((size_t) &kernel_start, (size_t) &kernel_end);
+
+	// mark the metadata and the consumed early page tables as used
+	reserve_range(meta_start, early_start);
+
+	kprintf("Page frame metadata: %lu KiB at %#lx for %lu MiB of RAM\n",
+		meta_size >> 10, meta_start, nframes >> (20 - PAGE_BITS));
+
+	// copies and page table walks access the page frames by the direct map
+	ret = page_map_phys(nframes << PAGE_BITS);
+	if (BUILTIN_EXPECT(ret, 0)) {
+		kprintf("Failed to map the physical memory: %d\n", ret);
+		return ret;
 	}
 
 	ret = vma_init();
@@ -296,20 +783,34 @@ int memory_init(void)
 		return ret;
 	}
 
-	/*
-	 * Modules like the init ram disk are already loaded.
-	 * Therefore, we set these pages as used.
-	 */
-	if (mb_info && (mb_info->flags & MULTIBOOT_INFO_MODS)) {
-		multiboot_module_t* mmodule = (multiboot_module_t*) ((size_t) mb_info->mods_addr);
-		for(i=0; i<mb_info->mods_count; i++) {
-			for(addr=mmodule[i].mod_start; addr<mmodule[i].mod_end; addr+=PAGE_SIZE) {
-				page_set_mark(addr >> PAGE_BITS);
-				atomic_int32_inc(&total_allocated_pages);
-				atomic_int32_dec(&total_available_pages);
-			}
-		}
+	// reserve the virtual address range of the metadata
+	ret = vma_add(meta_start, meta_start + meta_size, VMA_READ|VMA_WRITE|VMA_CACHEABLE);
+	if (BUILTIN_EXPECT(ret, 0)) {
+		kprintf("Failed to reserve the VMA of the page frame metadata: %d\n", ret);
+		return ret;
+	}
+
+	// palloc() takes its virtual address space from a dedicated arena
+	ret = vmem_init(KERNEL_ARENA_SIZE);
+	if (BUILTIN_EXPECT(ret, 0)) {
+		kprintf("Failed to initialize the kernel arena: %d\n", ret);
+		return ret;
 	}
 
 	return ret;
 }
+
+#ifdef CONFIG_BENCHMARK
+void memory_report(void)
+{
+	kprintf("Current allocated memory: %lu KiB\n", percpu_counter_sum(&total_allocated_pages) * (PAGE_SIZE >> 10));
+	kprintf("Zeroed page pool: %d hits, %d misses\n",
+		atomic_int32_read(&zero_pool_hits), atomic_int32_read(&zero_pool_misses));
+	kprintf("Large heap pages: %d faults, %d fallbacks, %d collapses\n",
+		atomic_int32_read(&heap_huge_faults), atomic_int32_read(&heap_huge_fallbacks),
+		atomic_int32_read(&heap_huge_collapses));
+	kprintf("TLB: %d batches, %d shootdowns by %d IPIs within %llu cycles (max %llu)\n",
+		atomic_int32_read(&tlb_batches), atomic_int32_read(&tlb_shootdowns),
+		atomic_int32_read(&tlb_ipis), tlb_shootdown_cycles, tlb_shootdown_max);
+}
+#endif
@@ -32,6 +32,7 @@
 #include <eduos/spinlock.h>
 #include <eduos/errno.h>
 #include <asm/multiboot.h>
+#include <asm/processor.h>
 
 /* 
  * Note that linker symbols are not variables, they have no memory allocated for
@@ -46,10 +47,285 @@ extern const void kernel_end;
  * For bootstrapping we initialize the VMA list with one empty VMA
  * (start == end) and expand this VMA by calls to vma_alloc()
  */
-static vma_t vma_boot = { VMA_KERN_MIN, VMA_KERN_MIN, VMA_HEAP };
+static vma_t vma_boot = { VMA_KERN_MIN, VMA_KERN_MIN, VMA_HEAP, NULL, 0, 0, NULL, NULL, NULL, NULL, NULL, 1, 0 };
 static vma_t* vma_list = &vma_boot;
+static vma_t* vma_tree = &vma_boot;
 static spinlock_t vma_lock = SPINLOCK_INIT;
 
+static inline uint32_t vma_height(vma_t* vma)
+{
+	return (vma) ? vma->height : 0;
+}
+
+/** @brief Recalculate the height and the largest gap of a subtree */
+static void vma_tree_fix(vma_t* vma)
+{
+	size_t gap = vma->start - ((vma->prev) ? vma->prev->end : 0);
+	uint32_t lh = vma_height(vma->left);
+	uint32_t rh = vma_height(vma->right);
+
+	if (vma->left && (vma->left->gap > gap))
+		gap = vma->left->gap;
+	if (vma->right && (vma->right->gap > gap))
+		gap = vma->right->gap;
+
+	vma->gap = gap;
+	vma->height = ((lh > rh) ? lh : rh) + 1;
+}
+
+static inline void vma_tree_replace(vma_t** root, vma_t* parent, vma_t* old, vma_t* new)
+{
+	if (!parent)
+		*root = new;
+	else if (parent->left == old)
+		parent->left = new;
+	else
+		parent->right = new;
+}
+
+/** @brief Rotate the subtree to the left and return its new root */
+static vma_t* vma_rotate_left(vma_t** root, vma_t* x)
+{
+	vma_t* y = x->right;
+
+	x->right = y->left;
+	if (y->left)
+		y->left->parent = x;
+
+	y->parent = x->parent;
+	vma_tree_replace(root, x->parent, x, y);
+
+	y->left = x;
+	x->parent = y;
+
+	vma_tree_fix(x);
+	vma_tree_fix(y);
+
+	return y;
+}
+
+/** @brief Rotate the subtree to the right and return its new root */
+static vma_t* vma_rotate_right(vma_t** root, vma_t* x)
+{
+	vma_t* y = x->left;
+
+	x->left = y->right;
+	if (y->right)
+		y->right->parent = x;
+
+	y->parent = x->parent;
+	vma_tree_replace(root, x->parent, x, y);
+
+	y->right = x;
+	x->parent = y;
+
+	vma_tree_fix(x);
+	vma_tree_fix(y);
+
+	return y;
+}
+
+/** @brief Update the subtrees on the path to the root and restore the balance
+ *
+ * Has to be called, if a node was changed or its predecessor in the list.
+ */
+static void vma_tree_update(vma_t** root, vma_t* vma)
+{
+	while (vma) {
+		vma_tree_fix(vma);
+
+		if (vma_height(vma->left) > vma_height(vma->right) + 1) {
+			if (vma_height(vma->left->left) < vma_height(vma->left->right))
+				vma_rotate_left(root, vma->left);
+			vma = vma_rotate_right(root, vma);
+		}
+		else if (vma_height(vma->right) > vma_height(vma->left) + 1) {
+			if (vma_height(vma->right->right) < vma_height(vma->right->left))
+				vma_rotate_right(root, vma->right);
+			vma = vma_rotate_left(root, vma);
+		}
+
+		vma = vma->parent;
+	}
+}
+
+/** @brief Insert a VMA into the tree
+ *
+ * The VMA has to be already linked into the list.
+ */
+static void vma_tree_insert(vma_t** root, vma_t* new)
+{
+	vma_t* parent = NULL;
+	vma_t** link = root;
+
+	while (*link) {
+		parent = *link;
+		link = (new->start < parent->start) ? &parent->left : &parent->right;
+	}
+
+	new->parent = parent;
+	new->left = new->right = NULL;
+	new->height = 1;
+	*link = new;
+
+	vma_tree_update(root, new);
+	// the gap in front of the successor shrinks
+	if (new->next)
+		vma_tree_update(root, new->next);
+}
+
+/** @brief Remove a VMA from the tree
+ *
+ * The VMA has to be already removed from the list.
+ */
+static void vma_tree_erase(vma_t** root, vma_t* vma, vma_t* succ)
+{
+	vma_t* fix;
+
+	if (vma->left && vma->right) {
+		// replace the node by its in-order successor
+		vma_t* s = vma->right;
+		while (s->left)
+			s = s->left;
+
+		if (s->parent != vma) {
+			fix = s->parent;
+			fix->left = s->right;
+			if (s->right)
+				s->right->parent = fix;
+			s->right = vma->right;
+			vma->right->parent = s;
+		} else fix = s;
+
+		s->left = vma->left;
+		vma->left->parent = s;
+		s->parent = vma->parent;
+		vma_tree_replace(root, vma->parent, vma, s);
+	} else {
+		vma_t* child = (vma->left) ? vma->left : vma->right;
+
+		if (child)
+			child->parent = vma->parent;
+		vma_tree_replace(root, vma->parent, vma, child);
+		fix = vma->parent;
+	}
+
+	vma_tree_update(root, fix);
+	// the gap in front of the successor grows
+	if (succ)
+		vma_tree_update(root, succ);
+}
+
+/** @brief Search the first VMA, which ends behind addr */
+static vma_t* vma_tree_lookup(vma_t* vma, size_t addr)
+{
+	vma_t* ret = NULL;
+
+	while (vma) {
+		if (vma->end > addr) {
+			ret = vma;
+			vma = vma->left;
+		} else vma = vma->right;
+	}
+
+	return ret;
+}
+
+/** @brief Search the last VMA of the tree */
+static vma_t* vma_tree_last(vma_t* vma)
+{
+	while (vma && vma->right)
+		vma = vma->right;
+
+	return vma;
+}
+
+/** @brief First fit search for a gap in front of a VMA
+ *
+ * The gaps of the subtrees are ignored, if they aren't large enough.
+ * Thereby, only a few paths of the tree are visited.
+ *
+ * @return The VMA behind the lowest gap, which is larger than size
+ */
+static vma_t* vma_tree_gap(vma_t* vma, size_t base, size_t limit, size_t size)
+{
+	vma_t* ret;
+	size_t start, end;
+
+	if (!vma || (vma->gap <= size))
+		return NULL;
+
+	ret = vma_tree_gap(vma->left, base, limit, size);
+	if (ret)
+		return ret;
+
+	start = (vma->prev) ? vma->prev->end : base;
+	if (start < base)
+		start = base;
+	end = (vma->start < limit) ? vma->start : limit;
+
+	if (start + size < end)
+		return vma;
+
+	return vma_tree_gap(vma->right, base, limit, size);
+}
+
+/** @brief Top down search for a gap in front of a VMA
+ *
+ * @return The VMA behind the highest gap, which is larger than size
+ */
+static vma_t* vma_tree_gap_last(vma_t* vma, size_t base, size_t limit, size_t size)
+{
+	vma_t* ret;
+	size_t start, end;
+
+	if (!vma || (vma->gap <= size))
+		return NULL;
+
+	ret = vma_tree_gap_last(vma->right, base, limit, size);
+	if (ret)
+		return ret;
+
+	start = (vma->prev) ? vma->prev->end : base;
+	if (start < base)
+		start = base;
+	end = (vma->start < limit) ? vma->start : limit;
+
+	if (start + size < end)
+		return vma;
+
+	return vma_tree_gap_last(vma->left, base, limit, size);
+}
+
+/** @brief Split a VMA at addr
+ *
+ * @return The new VMA, which covers the upper part
+ */
+static vma_t* vma_split(vma_t** tree, vma_t* vma, size_t addr)
+{
+	vma_t* new = kmalloc(sizeof(vma_t));
+	if (BUILTIN_EXPECT(!new, 0))
+		return NULL;
+
+	new->start = addr;
+	new->end = vma->end;
+	new->flags = vma->flags;
+	new->node = vma->node;
+	new->offset = vma->offset + (addr - vma->start);
+	new->file_size = (vma->file_size > addr - vma->start) ? vma->file_size - (addr - vma->start) : 0;
+	vma->end = addr;
+
+	new->next = vma->next;
+	if (new->next)
+		new->next->prev = new;
+	vma->next = new;
+	new->prev = vma;
+
+	vma_tree_insert(tree, new);
+
+	return new;
+}
+
 // TODO: we might move the architecture specific VMA regions to a
 //       seperate function arch_vma_init()
 int vma_init(void)
@@ -104,44 +380,101 @@ out:
 }
 
 size_t vma_alloc(size_t size, uint32_t flags)
+{
+	return vma_alloc_file(size, flags, NULL, 0, 0);
+}
+
+size_t vma_alloc_aligned(size_t size, size_t align, uint32_t flags)
+{
+	size_t start, aligned, end;
+
+	if (align <= PAGE_SIZE)
+		return vma_alloc(size, flags);
+
+	// reserve enough space to align the area, afterwards release the rest
+	start = vma_alloc(size + align - PAGE_SIZE, flags);
+	if (BUILTIN_EXPECT(!start, 0))
+		return 0;
+
+	end = start + size + align - PAGE_SIZE;
+	aligned = (start + align - 1) & ~(align - 1);
+
+	if (aligned > start)
+		vma_free(start, aligned);
+	if (aligned + size < end)
+		vma_free(aligned + size, end);
+
+	return aligned;
+}
+
+size_t vma_alloc_file(size_t size, uint32_t flags, struct vfs_node* node, off_t offset, size_t file_size)
 {
 	task_t* task = current_task;
 	spinlock_t* lock;
 	vma_t** list;
+	vma_t** tree;
 
-	//kprintf("vma_alloc: size = %#lx, flags = %#x\n", size, flags);
+	//kprintf("vma_alloc_file: size = %#lx, flags = %#x\n", size, flags);
 
 	size_t base, limit; // boundaries for search
 	size_t start, end; // boundaries of free gaps
 
+	vma_t* pred;  // vma before current gap
+	vma_t* succ;  // vma after current gap
+
 	if (flags & VMA_USER) {
 		base = VMA_USER_MIN;
 		limit = VMA_USER_MAX;
 		list = &task->vma_list;
+		tree = &task->vma_tree;
 		lock = &task->vma_lock;
 	}
 	else {
 		base = VMA_KERN_MIN;
 		limit = VMA_KERN_MAX;
 		list = &vma_list;
+		tree = &vma_tree;
 		lock = &vma_lock;
 	}
 
 	spinlock_lock(lock);
 
-	// first fit search for free memory area
-	vma_t* pred = NULL;  // vma before current gap
-	vma_t* succ = *list; // vma after current gap
-	do {
-		start = (pred) ? pred->end : base;
+	if (flags & VMA_USER) {
+		// the heap grows upwards => user areas are allocated top down above the heap
+		if (task->heap && (PAGE_FLOOR(task->heap->end) > base))
+			base = PAGE_FLOOR(task->heap->end);
+
+		// top down search for free memory area, beginning behind the last vma
+		succ = NULL;
+		pred = vma_tree_last(*tree);
+		start = (pred && (pred->end > base)) ? pred->end : base;
+
+		if (start + size >= limit) {
+			succ = vma_tree_gap_last(*tree, base, limit, size);
+			if (!succ)
+				goto fail;
+			pred = succ->prev;
+		}
+
 		end = (succ) ? succ->start : limit;
+		start = end - size;
+
+		goto found;
+	}
+
+	// first fit search for free memory area
+	succ = vma_tree_gap(*tree, base, limit, size);
+
+	// otherwise, use the gap behind the last vma
+	pred = (succ) ? succ->prev : vma_tree_last(*tree);
+	start = (pred) ? pred->end : base;
+	end = (succ) ? succ->start : limit;
 
-		if (start + size < end && start >= base && start + size < limit)
-			goto found; // we found a gap which is large enough and in the bounds
+	if (start < base)
+		start = base;
 
-		pred = succ;
-		succ = (pred) ? pred->next : NULL;
-	} while (pred || succ);
+	if (start + size < end && start + size < limit)
+		goto found; // we found a gap which is large enough and in the bounds
 
 fail:
 	spinlock_unlock(lock);	// we were unlucky to find a free gap
@@ -149,9 +482,15 @@ fail:
 	return 0;
 
 found:
-	if (pred && pred->flags == flags)
+	// file-backed areas are never merged
+	if (!node && pred && (pred->end == start) && (pred->flags == flags) && !pred->node) {
 		pred->end = start + size; // resize VMA
-	else {
+		if (succ)
+			vma_tree_update(tree, succ);
+	} else if (!node && succ && (succ->start == start + size) && (succ->flags == flags) && !succ->node) {
+		succ->start = start; // resize VMA
+		vma_tree_update(tree, succ);
+	} else {
 		// insert new VMA
 		vma_t* new = kmalloc(sizeof(vma_t));
 		if (BUILTIN_EXPECT(!new, 0))
@@ -160,6 +499,9 @@ found:
 		new->start = start;
 		new->end = start + size;
 		new->flags = flags;
+		new->node = node;
+		new->offset = offset;
+		new->file_size = file_size;
 		new->next = succ;
 		new->prev = pred;
 
@@ -169,6 +511,8 @@ found:
 			pred->next = new;
 		else
 			*list = new;
+
+		vma_tree_insert(tree, new);
 	}
 
 	spinlock_unlock(lock);
@@ -182,6 +526,7 @@ int vma_free(size_t start, size_t end)
 	spinlock_t* lock;
 	vma_t* vma;
 	vma_t** list = NULL;
+	vma_t** tree = NULL;
 
 	//kprintf("vma_free: start = %#lx, end = %#lx\n", start, end);
 
@@ -191,10 +536,12 @@ int vma_free(size_t start, size_t end)
 	if (end < VMA_KERN_MAX) {
 		lock = &vma_lock;
 		list = &vma_list;
+		tree = &vma_tree;
 	}
 	else if (start >= VMA_KERN_MAX) {
 		lock = &task->vma_lock;
 		list = &task->vma_list;
+		tree = &task->vma_tree;
 	}
 
 	if (BUILTIN_EXPECT(!list || !*list, 0))
@@ -203,11 +550,9 @@ int vma_free(size_t start, size_t end)
 	spinlock_lock(lock);
 
 	// search vma
-	vma = *list;
-	while (vma) {
-		if (start >= vma->start && end <= vma->end) break;
-		vma = vma->next;
-	}
+	vma = vma_tree_lookup(*tree, start);
+	if (vma && !(start >= vma->start && end <= vma->end))
+		vma = NULL;
 
 	if (BUILTIN_EXPECT(!vma, 0)) {
 		spinlock_unlock(lock);
@@ -222,26 +567,31 @@ int vma_free(size_t start, size_t end)
 			vma->prev->next = vma->next;
 		if (vma->next)
 			vma->next->prev = vma->prev;
+		vma_tree_erase(tree, vma, vma->next);
+		if (vma == task->vma_cache)
+			task->vma_cache = NULL;
 		kfree(vma);
 	}
-	else if (start == vma->start)
+	else if (start == vma->start) {
+		vma->offset += end - vma->start;
+		vma->file_size = (vma->file_size > end - vma->start) ? vma->file_size - (end - vma->start) : 0;
 		vma->start = end;
-	else if (end == vma->end)
+		vma_tree_update(tree, vma);
+	}
+	else if (end == vma->end) {
 		vma->end = start;
+		if (vma->next)
+			vma_tree_update(tree, vma->next);
+	}
 	else {
-		vma_t* new = kmalloc(sizeof(vma_t));
+		vma_t* new = vma_split(tree, vma, end);
 		if (BUILTIN_EXPECT(!new, 0)) {
 			spinlock_unlock(lock);
 			return -ENOMEM;
 		}
 
-		new->end = vma->end;
 		vma->end = start;
-		new->start = end;
-
-		new->next = vma->next;
-		vma->next = new;
-		new->prev = vma;
+		vma_tree_update(tree, new);
 	}
 
 	spinlock_unlock(lock);
@@ -249,17 +599,76 @@ int vma_free(size_t start, size_t end)
 	return 0;
 }
 
+int vma_set_flags(size_t start, size_t end, uint32_t flags)
+{
+	task_t* task = current_task;
+	spinlock_t* lock;
+	vma_t* vma;
+	vma_t** tree;
+	int ret = 0;
+
+	if (BUILTIN_EXPECT(start >= end, 0))
+		return -EINVAL;
+
+	if (flags & VMA_USER) {
+		tree = &task->vma_tree;
+		lock = &task->vma_lock;
+	} else {
+		tree = &vma_tree;
+		lock = &vma_lock;
+	}
+
+	spinlock_lock(lock);
+
+	vma = vma_tree_lookup(*tree, start);
+	if (BUILTIN_EXPECT(!vma || (start < vma->start) || (end > vma->end), 0)) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	if (vma->flags == flags)
+		goto out;
+
+	// the head and the tail keep their flags
+	if (start > vma->start) {
+		vma = vma_split(tree, vma, start);
+		if (BUILTIN_EXPECT(!vma, 0)) {
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+
+	if ((end < vma->end) && BUILTIN_EXPECT(!vma_split(tree, vma, end), 0)) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	vma->flags = flags;
+
+out:
+	spinlock_unlock(lock);
+
+	return ret;
+}
+
 int vma_add(size_t start, size_t end, uint32_t flags)
+{
+	return vma_add_file(start, end, flags, NULL, 0, 0);
+}
+
+int vma_add_file(size_t start, size_t end, uint32_t flags, struct vfs_node* node, off_t offset, size_t file_size)
 {
 	task_t* task = current_task;
 	spinlock_t* lock;
 	vma_t** list;
+	vma_t** tree;
 
 	if (BUILTIN_EXPECT(start >= end, 0))
 		return -EINVAL;
 
 	if (flags & VMA_USER) {
 		list = &task->vma_list;
+		tree = &task->vma_tree;
 		lock = &task->vma_lock;
 
 		// check if address is in userspace
@@ -268,6 +677,7 @@ int vma_add(size_t start, size_t end, uint32_t flags)
 	}
 	else {
 		list = &vma_list;
+		tree = &vma_tree;
 		lock = &vma_lock;
 
 		// check if address is in kernelspace
@@ -280,19 +690,10 @@ int vma_add(size_t start, size_t end, uint32_t flags)
 	spinlock_lock(lock);
 
 	// search gap
-	vma_t* pred = NULL;
-	vma_t* succ = *list;
-
-	while (pred || succ) {
-		if ((!pred || pred->end <= start) &&
-		    (!succ || succ->start >= end))
-			break;
+	vma_t* succ = vma_tree_lookup(*tree, start);
+	vma_t* pred = (succ) ? succ->prev : vma_tree_last(*tree);
 
-		pred = succ;
-		succ = (succ) ? succ->next : NULL;
-	}
-
-	if (BUILTIN_EXPECT(*list && !pred && !succ, 0)) {
+	if (BUILTIN_EXPECT(succ && (succ->start < end), 0)) {
 		spinlock_unlock(lock);
 		return -EINVAL;
 	}
@@ -307,6 +708,9 @@ int vma_add(size_t start, size_t end, uint32_t flags)
 	new->start = start;
 	new->end = end;
 	new->flags = flags;
+	new->node = node;
+	new->offset = offset;
+	new->file_size = file_size;
 	new->next = succ;
 	new->prev = pred;
 
@@ -317,11 +721,34 @@ int vma_add(size_t start, size_t end, uint32_t flags)
 	else
 		*list = new;
 
+	vma_tree_insert(tree, new);
+
 	spinlock_unlock(lock);
 
 	return 0;
 }
 
+vma_t* vma_find(task_t* task, size_t addr)
+{
+	vma_t* vma = task->vma_cache;
+
+	if (vma && (addr >= vma->start) && (addr < vma->end))
+		return vma;
+
+	vma = vma_tree_lookup(task->vma_tree, addr);
+	if (!vma || (addr < vma->start))
+		return NULL;
+
+	task->vma_cache = vma;
+
+	return vma;
+}
+
+vma_t* vma_lookup(task_t* task, size_t addr)
+{
+	return vma_tree_lookup(task->vma_tree, addr);
+}
+
 int copy_vma_list(task_t* src, task_t* dest)
 {
 	spinlock_init(&dest->vma_lock);
@@ -329,6 +756,10 @@ int copy_vma_list(task_t* src, task_t* dest)
 	spinlock_lock(&src->vma_lock);
 	spinlock_lock(&dest->vma_lock);
 
+	dest->vma_list = NULL;
+	dest->vma_tree = NULL;
+	dest->vma_cache = NULL;
+
 	vma_t* last = NULL;
 	vma_t* old;
 	for (old=src->vma_list; old; old=old->next) {
@@ -342,6 +773,10 @@ int copy_vma_list(task_t* src, task_t* dest)
 		new->start = old->start;
 		new->end = old->end;
 		new->flags = old->flags;
+		new->node = old->node;
+		new->offset = old->offset;
+		new->file_size = old->file_size;
+		new->next = NULL;
 		new->prev = last;
 
 		if (last)
@@ -349,6 +784,8 @@ int copy_vma_list(task_t* src, task_t* dest)
 		else
 			dest->vma_list = new;
 
+		vma_tree_insert(&dest->vma_tree, new);
+
 		last = new;
 	}
 
@@ -369,6 +806,9 @@ int drop_vma_list(task_t *task)
 		kfree(vma);
 	}
 
+	task->vma_tree = NULL;
+	task->vma_cache = NULL;
+
 	spinlock_unlock(&task->vma_lock);
 
 	return 0;
@@ -398,3 +838,42 @@ void vma_dump(void)
 	print_vma(task->vma_list);
 	spinlock_unlock(&task->vma_lock);
 }
+
+#ifdef CONFIG_BENCHMARK
+void vma_benchmark(uint32_t n)
+{
+	task_t* task = current_task;
+	uint32_t i, seed = 42;
+	uint64_t tsc;
+	size_t addr;
+
+	if (BUILTIN_EXPECT(task->vma_list != NULL, 0))
+		return;
+
+	// only every second page is used => n gaps, which are too small for vma_alloc()
+	tsc = rdtsc();
+	for(i=0; i<n; i++)
+		vma_add(VMA_USER_MAX - 2*(i+1)*PAGE_SIZE, VMA_USER_MAX - (2*i+1)*PAGE_SIZE, VMA_USER|VMA_READ);
+	kprintf("vma_benchmark: %u x vma_add within %llu cycles\n", n, rdtsc() - tsc);
+
+	spinlock_lock(&task->vma_lock);
+	tsc = rdtsc();
+	for(i=0; i<n; i++) {
+		seed = seed * 1103515245 + 12345;
+		task->vma_cache = NULL; // measure the tree and not the cache
+		vma_find(task, VMA_USER_MAX - (size_t) (seed % (2*n) + 1) * PAGE_SIZE);
+	}
+	kprintf("vma_benchmark: %u x vma_find within %llu cycles\n", n, rdtsc() - tsc);
+	spinlock_unlock(&task->vma_lock);
+
+	tsc = rdtsc();
+	for(i=0; i<n; i++) {
+		addr = vma_alloc(2*PAGE_SIZE, VMA_USER|VMA_READ|VMA_WRITE);
+		if (addr)
+			vma_free(addr, addr + 2*PAGE_SIZE);
+	}
+	kprintf("vma_benchmark: %u x vma_alloc/vma_free within %llu cycles\n", n, rdtsc() - tsc);
+
+	drop_vma_list(task);
+}
+#endif
@@ -0,0 +1,348 @@
+/*
+ * Copyright (c) eduOS contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the University nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <eduos/stdio.h>
+#include <eduos/string.h>
+#include <eduos/spinlock.h>
+#include <eduos/vma.h>
+#include <eduos/vmem.h>
+#include <eduos/errno.h>
+
+#include <asm/page.h>
+#include <asm/processor.h>
+
+/// Number of segregated free lists (one per power of two)
+#define VMEM_LISTS	BITS
+/// Number of buckets of the hash table of allocated segments
+#define VMEM_HASH	64
+
+/** @brief Boundary tag of a segment of the arena */
+typedef struct vmem_seg {
+	/// Start address
+	size_t start;
+	/// Size in pages
+	size_t npages;
+	/// Neighbors in address order
+	struct vmem_seg* prev;
+	struct vmem_seg* next;
+	/// Free list (free segment), hash chain (allocated segment) or unused tags
+	struct vmem_seg* lprev;
+	struct vmem_seg* lnext;
+	/// The segment is free
+	uint8_t free;
+	/// The allocated segment is kept by a quantum cache
+	uint8_t cached;
+} vmem_seg_t;
+
+/** @brief Static pool of boundary tags */
+static vmem_seg_t tags[KERNEL_ARENA_TAGS];
+static vmem_seg_t* unused_tags = NULL;
+
+/** @brief Segregated free lists, bit i of free_map marks a non-empty list i */
+static vmem_seg_t* free_lists[VMEM_LISTS] = { [0 ... VMEM_LISTS-1] = NULL };
+static size_t free_map = 0;
+
+/** @brief Allocated segments, hashed by their start address */
+static vmem_seg_t* alloc_hash[VMEM_HASH] = { [0 ... VMEM_HASH-1] = NULL };
+
+/** @brief Quantum caches of recently released small ranges
+ *
+ * The segments stay allocated (and hashed) while they are cached.
+ */
+static vmem_seg_t* qcache[VMEM_QCACHE_MAX][VMEM_QCACHE_DEPTH];
+static uint32_t qcache_count[VMEM_QCACHE_MAX] = { [0 ... VMEM_QCACHE_MAX-1] = 0 };
+
+/** @brief Boundaries of the arena */
+static size_t arena_start = 0;
+static size_t arena_end = 0;
+
+static spinlock_t vmem_lock = SPINLOCK_INIT;
+
+/** @brief Insert a doubly linked element at the head of a list */
+static inline void list_push(vmem_seg_t** list, vmem_seg_t* seg)
+{
+	seg->lprev = NULL;
+	seg->lnext = *list;
+	if (*list)
+		(*list)->lprev = seg;
+	*list = seg;
+}
+
+/** @brief Remove a doubly linked element from a list */
+static inline void list_remove(vmem_seg_t** list, vmem_seg_t* seg)
+{
+	if (seg->lprev)
+		seg->lprev->lnext = seg->lnext;
+	else
+		*list = seg->lnext;
+	if (seg->lnext)
+		seg->lnext->lprev = seg->lprev;
+}
+
+static inline vmem_seg_t** hash_bucket(size_t viraddr)
+{
+	return &alloc_hash[(viraddr >> PAGE_BITS) % VMEM_HASH];
+}
+
+/** @brief Search the allocated segment, which starts at viraddr */
+static vmem_seg_t* hash_find(size_t viraddr)
+{
+	vmem_seg_t* seg;
+
+	for (seg=*hash_bucket(viraddr); seg && (seg->start != viraddr); seg=seg->lnext)
+		;
+
+	return seg;
+}
+
+static void free_insert(vmem_seg_t* seg)
+{
+	size_t idx = msb(seg->npages);
+
+	seg->free = 1;
+	list_push(&free_lists[idx], seg);
+	free_map |= 1UL << idx;
+}
+
+static void free_remove(vmem_seg_t* seg)
+{
+	size_t idx = msb(seg->npages);
+
+	list_remove(&free_lists[idx], seg);
+	if (!free_lists[idx])
+		free_map &= ~(1UL << idx);
+	seg->free = 0;
+}
+
+static inline vmem_seg_t* tag_get(void)
+{
+	vmem_seg_t* seg = unused_tags;
+
+	if (seg)
+		unused_tags = seg->lnext;
+
+	return seg;
+}
+
+static inline void tag_put(vmem_seg_t* seg)
+{
+	seg->lnext = unused_tags;
+	unused_tags = seg;
+}
+
+/** @brief Return an allocated segment to the arena and coalesce it with its free neighbors */
+static void seg_release(vmem_seg_t* seg)
+{
+	vmem_seg_t* neighbor;
+
+	list_remove(hash_bucket(seg->start), seg);
+
+	neighbor = seg->next;
+	if (neighbor && neighbor->free) {
+		free_remove(neighbor);
+		seg->npages += neighbor->npages;
+		seg->next = neighbor->next;
+		if (neighbor->next)
+			neighbor->next->prev = seg;
+		tag_put(neighbor);
+	}
+
+	neighbor = seg->prev;
+	if (neighbor && neighbor->free) {
+		free_remove(neighbor);
+		neighbor->npages += seg->npages;
+		neighbor->next = seg->next;
+		if (seg->next)
+			seg->next->prev = neighbor;
+		tag_put(seg);
+		seg = neighbor;
+	}
+
+	free_insert(seg);
+}
+
+/** @brief Return all cached segments to the arena
+ *
+ * @return Number of released segments
+ */
+static uint32_t qcache_flush(void)
+{
+	uint32_t i, ret = 0;
+	vmem_seg_t* seg;
+
+	for (i=0; i<VMEM_QCACHE_MAX; i++) {
+		while (qcache_count[i]) {
+			seg = qcache[i][--qcache_count[i]];
+			seg->cached = 0;
+			seg_release(seg);
+			ret++;
+		}
+	}
+
+	return ret;
+}
+
+int vmem_init(size_t size)
+{
+	vmem_seg_t* seg;
+	uint32_t i;
+
+	size = PAGE_FLOOR(size);
+	if (BUILTIN_EXPECT(!size || arena_end, 0))
+		return -EINVAL;
+
+	/* reserve the range in the VMA list of the kernel */
+	arena_start = vma_alloc(size, VMA_HEAP);
+	if (BUILTIN_EXPECT(!arena_start, 0))
+		return -ENOMEM;
+
+	spinlock_lock(&vmem_lock);
+
+	for (i=1; i<KERNEL_ARENA_TAGS; i++)
+		tag_put(&tags[i]);
+
+	seg = &tags[0];
+	seg->start = arena_start;
+	seg->npages = size >> PAGE_BITS;
+	seg->prev = seg->next = NULL;
+	free_insert(seg);
+
+	arena_end = arena_start + size;
+
+	spinlock_unlock(&vmem_lock);
+
+	kprintf("Kernel arena: %lu MiB at %#lx\n", size >> 20, arena_start);
+
+	return 0;
+}
+
+size_t vmem_alloc(size_t npages)
+{
+	vmem_seg_t* seg = NULL;
+	vmem_seg_t* rest;
+	size_t idx, mask, ret = 0;
+
+	if (BUILTIN_EXPECT(!npages || !arena_end, 0))
+		return 0;
+
+	spinlock_lock(&vmem_lock);
+
+	if ((npages <= VMEM_QCACHE_MAX) && qcache_count[npages-1]) {
+		seg = qcache[npages-1][--qcache_count[npages-1]];
+		seg->cached = 0;
+		ret = seg->start;
+		goto out;
+	}
+
+retry:
+	/* instant fit: each segment of a list, whose
+	 * sizes start at the next power of two, is large enough */
+	idx = msb(npages);
+	if (npages & (npages-1))
+		idx++;
+
+	mask = (idx < VMEM_LISTS) ? free_map & ~((1UL << idx) - 1) : 0;
+	if (mask) {
+		seg = free_lists[lsb(mask)];
+	} else {
+		/* the list of the exact power of two might contain a fitting segment */
+		for (seg=free_lists[msb(npages)]; seg && (seg->npages < npages); seg=seg->lnext)
+			;
+	}
+
+	if (!seg)
+		goto flush;
+
+	free_remove(seg);
+
+	if (seg->npages > npages) {
+		rest = tag_get();
+		if (BUILTIN_EXPECT(!rest, 0)) {
+			free_insert(seg);
+			goto flush;
+		}
+
+		/* the remainder becomes a free segment behind the allocated one */
+		rest->start = seg->start + npages*PAGE_SIZE;
+		rest->npages = seg->npages - npages;
+		rest->prev = seg;
+		rest->next = seg->next;
+		if (seg->next)
+			seg->next->prev = rest;
+		seg->next = rest;
+		seg->npages = npages;
+		free_insert(rest);
+	}
+
+	list_push(hash_bucket(seg->start), seg);
+	ret = seg->start;
+	goto out;
+
+flush:
+	/* cached ranges might fragment the arena or hold the tags
+	 * => return them to the arena and try again */
+	if (qcache_flush())
+		goto retry;
+
+out:
+	spinlock_unlock(&vmem_lock);
+
+	return ret;
+}
+
+int vmem_free(size_t viraddr, size_t npages)
+{
+	vmem_seg_t* seg;
+	int ret = 0;
+
+	if ((viraddr < arena_start) || (viraddr >= arena_end))
+		return -ENOENT;
+	if (BUILTIN_EXPECT(!npages || (viraddr + npages*PAGE_SIZE > arena_end), 0))
+		return -EINVAL;
+
+	spinlock_lock(&vmem_lock);
+
+	/* a double free or a wrong size would hand out the range twice */
+	seg = hash_find(viraddr);
+	if (BUILTIN_EXPECT(!seg || seg->cached || (seg->npages != npages), 0)) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	if ((npages <= VMEM_QCACHE_MAX) && (qcache_count[npages-1] < VMEM_QCACHE_DEPTH)) {
+		seg->cached = 1;
+		qcache[npages-1][qcache_count[npages-1]++] = seg;
+		goto out;
+	}
+
+	seg_release(seg);
+
+out:
+	spinlock_unlock(&vmem_lock);
+
+	return ret;
+}
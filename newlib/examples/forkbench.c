@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) eduOS contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the University nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Measures the costs of fork() in dependence of the heap size.
+ * Because the page frames are shared copy-on-write, the costs should
+ * only grow with the number of page tables and not with the heap size.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <errno.h>
+#undef errno
+extern int errno;
+
+#define ITERATIONS	10
+#define MAX_HEAP	(16 << 20)
+
+inline static unsigned long long rdtsc(void)
+{
+	unsigned int lo, hi;
+
+	asm volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+
+	return ((unsigned long long) hi << 32ULL | (unsigned long long) lo);
+}
+
+int main(int argc, char** argv)
+{
+	unsigned long long start, fork_cycles, wait_cycles;
+	size_t size;
+	char* heap;
+	int i, status;
+	pid_t pid;
+
+	printf("heap size (KiB)\tfork (cycles)\tfork+exit+wait (cycles)\n");
+
+	for(size=0; size<=MAX_HEAP; size=size ? size*4 : (64 << 10)) {
+		heap = NULL;
+		if (size) {
+			heap = (char*) malloc(size);
+			if (!heap) {
+				printf("malloc of %u KiB failed\n", (unsigned int) (size >> 10));
+				break;
+			}
+
+			// touch each page => the heap is mapped
+			memset(heap, 0xAB, size);
+		}
+
+		fork_cycles = wait_cycles = 0;
+		for(i=0; i<ITERATIONS; i++) {
+			start = rdtsc();
+			pid = fork();
+			if (pid == 0)
+				_exit(0);
+
+			fork_cycles += rdtsc() - start;
+			if (pid < 0) {
+				printf("fork failed: %d\n", errno);
+				return errno;
+			}
+
+			wait(&status);
+			wait_cycles += rdtsc() - start;
+		}
+
+		printf("%u\t\t%llu\t\t%llu\n", (unsigned int) (size >> 10),
+			fork_cycles / ITERATIONS, wait_cycles / ITERATIONS);
+
+		free(heap);
+	}
+
+	return 0;
+}
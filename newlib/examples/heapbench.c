@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) eduOS contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the University nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Measures the costs of growing the heap: a buffer is allocated by
+ * malloc() and each page is touched once. Each first access to a page
+ * of the heap raises a page fault, which maps HEAP_FAULT_AROUND pages.
+ * Build the kernel with CONFIG_HEAP_POPULATE to compare the results
+ * with an eager population of the heap by sbrk().
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#undef errno
+extern int errno;
+
+#define PAGE_SIZE	4096
+#define MAX_SIZE	(16 << 20)
+
+inline static unsigned long long rdtsc(void)
+{
+	unsigned int lo, hi;
+
+	asm volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+
+	return ((unsigned long long) hi << 32ULL | (unsigned long long) lo);
+}
+
+int main(int argc, char** argv)
+{
+	unsigned long long start, malloc_cycles, touch_cycles;
+	size_t size, i;
+	volatile char* buf;
+
+	printf("size (KiB)\tmalloc (cycles)\ttouch (cycles)\tper page (cycles)\n");
+
+	for(size=(16 << 10); size<=MAX_SIZE; size*=4) {
+		start = rdtsc();
+		buf = (volatile char*) malloc(size);
+		malloc_cycles = rdtsc() - start;
+		if (!buf) {
+			printf("malloc of %u KiB failed\n", (unsigned int) (size >> 10));
+			break;
+		}
+
+		// first touch of each page
+		start = rdtsc();
+		for(i=0; i<size; i+=PAGE_SIZE)
+			buf[i] = 1;
+		touch_cycles = rdtsc() - start;
+
+		printf("%u\t\t%llu\t\t%llu\t\t%llu\n", (unsigned int) (size >> 10),
+			malloc_cycles, touch_cycles, touch_cycles / (size / PAGE_SIZE));
+
+		// the memory isn't returned to the kernel
+		// => the next (larger) buffer grows the heap again
+		free((void*) buf);
+	}
+
+	return 0;
+}
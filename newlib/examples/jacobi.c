@@ -32,13 +32,29 @@
 #include <time.h>
 #include <unistd.h>
 #include <errno.h>
+#include <sys/mman.h>
 
+/*
+ * Build with -DMATRIX_SIZE=512 to get a matrix, which exceeds the reach
+ * of the TLB. Additionally, -DHUGE_PAGES maps the matrix by large pages.
+ */
+#ifndef MATRIX_SIZE
 #define MATRIX_SIZE 	128
+#endif
 #define MAXVALUE	1337
 #define PAGE_SIZE	4096
 #define CACHE_SIZE	(256*1024)
 #define ALIGN(x,a)	(((x)+(a)-1)&~((a)-1))
 
+inline static unsigned long long rdtsc(void)
+{
+	unsigned int lo, hi;
+
+	asm volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+
+	return ((unsigned long long) hi << 32ULL | (unsigned long long) lo);
+}
+
 static int generate_empty_matrix(double*** A , unsigned int N) {
 	unsigned int iCnt;
 	int i,j;
@@ -48,7 +64,14 @@ static int generate_empty_matrix(double*** A , unsigned int N) {
 	if (*A == NULL) 
 		return -2;	/* Error */
 
+#ifdef HUGE_PAGES
+	(*A)[0] = (double*) mmap(NULL, (N+1)*N*sizeof(double), PROT_READ|PROT_WRITE,
+				MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+	if ((*A)[0] == MAP_FAILED)
+		(*A)[0] = NULL;
+#else
 	(*A)[0] = (double*) malloc((N+1)*N*sizeof(double));
+#endif
 
 	if (**A == NULL)
 		return -2;	/* Error */
@@ -103,7 +126,7 @@ int main(int argc, char **argv)
 	double**	A=0;
 	double*		X;
 	double*		X_old, xi;
-	//clock_t		start, end;
+	unsigned long long	start, end;
 
 	if (generate_empty_matrix(&A,MATRIX_SIZE) < 0)
 	{
@@ -133,7 +156,7 @@ int main(int argc, char **argv)
 	iter_start = 0;
 	iter_end = MATRIX_SIZE;
 
-	//start = clock();
+	start = rdtsc();
 
 	while(1) 
 	{
@@ -165,7 +188,7 @@ int main(int argc, char **argv)
 		}
 	}
 
-	//end = clock();
+	end = rdtsc();
 	
 	if (MATRIX_SIZE < 16) {
 		printf("Print the solution...\n");
@@ -196,7 +219,7 @@ int main(int argc, char **argv)
 
 	printf("\nmatrix size: %d x %d\n", MATRIX_SIZE, MATRIX_SIZE);
 	printf("number of iterations: %d\n", iterations);
-	//printf("calculation time: %f s\n", (float) (end-start) / (float) CLOCKS_PER_SEC);
+	printf("calculation time: %llu cycles\n", end - start);
 
 	free((void*) X_old);
 	free((void*) X);
@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) eduOS contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the University nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Measures the costs of a task switch between two tasks with hot working sets.
+ * Both tasks touch one cache line per page of their working set. A large gap
+ * between two accesses reveals that the task was interrupted. The following
+ * pass over the working set has to refill the TLB, unless the entries were
+ * kept during the switch (PCID).
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <errno.h>
+#undef errno
+extern int errno;
+
+#define WSET_PAGES	256
+#define PAGE_SIZE	4096
+#define SWITCHES	100
+#define GAP_CYCLES	20000
+
+inline static unsigned long long rdtsc(void)
+{
+	unsigned int lo, hi;
+
+	asm volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+
+	return ((unsigned long long) hi << 32ULL | (unsigned long long) lo);
+}
+
+static void measure(const char* name)
+{
+	unsigned long long prev, now, start = 0;
+	unsigned long long hot_cycles = 0, hot_accesses = 0, cold_cycles = 0;
+	volatile char* wset;
+	int i, cold = 0, switches = 0;
+
+	wset = (volatile char*) malloc(WSET_PAGES * PAGE_SIZE);
+	if (!wset) {
+		printf("%s: malloc failed\n", name);
+		return;
+	}
+
+	// touch each page => the working set is mapped
+	memset((char*) wset, 0x00, WSET_PAGES * PAGE_SIZE);
+
+	prev = rdtsc();
+	while (switches < SWITCHES) {
+		for(i=0; i<WSET_PAGES; i++) {
+			// different cache lines to avoid conflicts within a cache set
+			wset[i*PAGE_SIZE + (i % 64) * 64]++;
+
+			now = rdtsc();
+			if (now - prev > GAP_CYCLES) {
+				// interrupted => the next pass refills the TLB
+				cold = WSET_PAGES;
+				start = now;
+				switches++;
+			} else if (cold) {
+				if (!--cold)
+					cold_cycles += now - start;
+			} else {
+				hot_cycles += now - prev;
+				hot_accesses++;
+			}
+			prev = now;
+		}
+	}
+
+	printf("%s: hot pass %llu cycles, pass after a switch %llu cycles (%d switches)\n",
+		name, hot_cycles * WSET_PAGES / hot_accesses, cold_cycles / SWITCHES, switches);
+
+	free((char*) wset);
+}
+
+int main(int argc, char** argv)
+{
+	int status;
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0) {
+		printf("fork failed: %d\n", errno);
+		return errno;
+	}
+
+	measure(pid ? "parent" : "child");
+	if (pid)
+		wait(&status);
+
+	return 0;
+}
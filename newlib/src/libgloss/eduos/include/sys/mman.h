@@ -0,0 +1,33 @@
+#ifndef _SYS_MMAN_H
+# define _SYS_MMAN_H
+
+#include <sys/types.h>
+
+/* advices of madvise(), see include/eduos/syscall.h */
+#define MADV_NORMAL	0
+#define MADV_WILLNEED	3
+#define MADV_DONTNEED	4
+
+/* protection of mmap() and mprotect(), see include/eduos/syscall.h */
+#define PROT_NONE	0x0
+#define PROT_READ	0x1
+#define PROT_WRITE	0x2
+#define PROT_EXEC	0x4
+
+/* flags of mmap() */
+#define MAP_SHARED	0x01
+#define MAP_PRIVATE	0x02
+#define MAP_FIXED	0x10
+#define MAP_ANONYMOUS	0x20
+#define MAP_ANON	MAP_ANONYMOUS
+#define MAP_POPULATE	0x8000
+#define MAP_HUGETLB	0x40000
+
+#define MAP_FAILED	((void *) -1)
+
+int madvise (void *, size_t, int);
+void *mmap (void *, size_t, int, int, int, off_t);
+int munmap (void *, size_t);
+int mprotect (void *, size_t, int);
+
+#endif
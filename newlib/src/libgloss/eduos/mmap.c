@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) eduOS contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the University nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include <_ansi.h>
+#include <_syslist.h>
+#include <sys/mman.h>
+#include <errno.h>
+#undef errno
+extern int errno;
+#include "warning.h"
+#include "syscall.h"
+
+/* see mmap_args_t in include/eduos/syscall.h */
+struct mmap_args {
+	unsigned long addr;
+	unsigned long len;
+	int prot;
+	int flags;
+	int fd;
+	off_t offset;
+};
+
+void *
+_DEFUN (mmap, (addr, len, prot, flags, fd, offset),
+        void *addr _AND
+        size_t len _AND
+        int prot _AND
+        int flags _AND
+        int fd _AND
+        off_t offset)
+{
+	struct mmap_args args = { (unsigned long) addr, len, prot, flags, fd, offset };
+	long ret;
+
+	/* mmap() takes six arguments => pass them by a pointer */
+	ret = SYSCALL1(__NR_mmap, &args);
+
+	/* the upper half of the 32 bit address space is valid as well */
+	if ((unsigned long) ret > (unsigned long) -4096) {
+		errno = -ret;
+		return MAP_FAILED;
+	}
+
+	return (void *) ret;
+}
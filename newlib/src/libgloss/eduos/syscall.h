@@ -64,6 +64,10 @@ extern "C" {
 #define __NR_stat		30
 #define __NR_dup		31
 #define __NR_dup2		32
+#define __NR_madvise		33
+#define __NR_mmap		34
+#define __NR_munmap		35
+#define __NR_mprotect		36
 
 #define _STR(token)             #token
 #define _SYSCALLSTR(x)          "int $" _STR(x) " "
@@ -96,10 +100,12 @@ syscall(int nr, unsigned long arg0, unsigned long arg1, unsigned long arg2,
 			: "D" (nr), "S" (arg0), "d" (arg1), "c" (arg2), "m" (arg3), "m" (arg4)
 			: "memory", "cc", "%r8", "%r9");
 #else
-	asm volatile ("mov %5, %%r8; mov %6, %%r9; syscall"
+	/* syscall uses rcx and r11 for the return address and rflags
+	 * => the third argument is passed by r10 */
+	asm volatile ("mov %4, %%r10; mov %5, %%r8; mov %6, %%r9; syscall"
 			: "=a" (res)
-			: "D" (nr), "S" (arg0), "d" (arg1), "c" (arg2), "m" (arg3), "m" (arg4)
-			: "memory", "cc", "%r8", "%r9");
+			: "D" (nr), "S" (arg0), "d" (arg1), "m" (arg2), "m" (arg3), "m" (arg4)
+			: "memory", "cc", "%rcx", "%r8", "%r9", "%r10", "%r11");
 #endif
 
 	return res;
@@ -305,7 +305,9 @@ extern "C" {
 
 #define POINTER_UINT unsigned _POINTER_INT
 #define SEPARATE_OBJECTS
+#ifndef HAVE_MMAP
 #define HAVE_MMAP 0
+#endif
 #define MORECORE(size) _sbrk_r(reent_ptr, (size))
 #define MORECORE_CLEARS 0
 #define MALLOC_LOCK __malloc_lock(reent_ptr)